@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+#include "audioio.h"
+#include "audioio_alsa.h"
+#include "audioio_mmap.h"
+#include "audioio_shm.h"
+
+struct audioio_backend {
+    const char *prefix;         // Device names this backend takes
+    bool (*init)(const char* device, int rate, int audio_latency, char mode, int channels);
+    size_t (*getsamples)(int16_t *buf, size_t n);
+    size_t (*putsamples)(int16_t *buf, size_t n);
+    size_t (*capture_begin)(int16_t **buf, size_t n);   // NULL if it can't
+    void (*capture_end)(size_t n);
+    void (*idle)(bool idle);
+    void (*stop)();
+    bool (*wait)(int timeout_ms);                       // NULL if it can't call a handler
+    float (*fill)();                                    // NULL if it can't tell
+    bool (*ended)();                                    // NULL if input never ends
+};
+
+// The first backend whose prefix matches is used, so the catch-all is last
+static const struct audioio_backend backends[] = {
+    { "shm:", audioio_shm_init, audioio_shm_getsamples, audioio_shm_putsamples,
+      NULL, NULL, audioio_shm_idle, audioio_shm_stop, NULL, NULL, audioio_shm_ended },
+    { "mmap:", audioio_mmap_init, audioio_mmap_getsamples, audioio_mmap_putsamples,
+      audioio_mmap_capture_begin, audioio_mmap_capture_end, audioio_mmap_idle, audioio_mmap_stop, NULL,
+      audioio_mmap_fill, NULL },
+#ifndef NO_SOUNDIO
+    { "", audioio_alsa_init, audioio_alsa_getsamples, audioio_alsa_putsamples,
+      NULL, NULL, audioio_alsa_idle, audioio_alsa_stop, audioio_alsa_wait, audioio_alsa_fill, NULL },
+#else
+    { "", audioio_mmap_init, audioio_mmap_getsamples, audioio_mmap_putsamples,
+      audioio_mmap_capture_begin, audioio_mmap_capture_end, audioio_mmap_idle, audioio_mmap_stop, NULL,
+      audioio_mmap_fill, NULL },
+#endif
+};
+
+static const struct audioio_backend *backend = NULL;
+
+#define RETRY_MIN_MS    50      // First wait before re-opening, doubling each time...
+#define RETRY_MAX_MS    1000    // ...up to this
+#define GAP_MAX_MS      2000    // Longest silence put in for lost capture
+
+struct audioio_stats audioio_stats;
+struct audioio_handler audioio_handler;
+static volatile sig_atomic_t aborted = 0;
+
+void audioio_abort()
+{
+    aborted = 1;
+}
+
+bool audioio_retry_wait(int attempt)
+{
+    if (aborted)
+        return false;
+
+    long ms = RETRY_MIN_MS;
+    while (attempt-- > 0 && ms < RETRY_MAX_MS)
+        ms *= 2;
+    if (ms > RETRY_MAX_MS)
+        ms = RETRY_MAX_MS;
+
+    // A signal cuts the wait short, so audioio_abort takes effect at once
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+    nanosleep(&ts, NULL);
+    return !aborted;
+}
+
+size_t audioio_gap_frames(const struct timespec *since, int rate)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long ms = (now.tv_sec - since->tv_sec) * 1000LL + (now.tv_nsec - since->tv_nsec) / 1000000;
+    if (ms > GAP_MAX_MS)
+        ms = GAP_MAX_MS;
+    return (ms > 0) ? (size_t)(ms * rate / 1000) : 0;
+}
+
+bool audioio_init(const char* device, int rate, int audio_latency, char mode, int channels)
+{
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); ++i) {
+        size_t len = strlen(backends[i].prefix);
+        if (len == 0 || (device && strncmp(device, backends[i].prefix, len) == 0)) {
+            if ((audioio_handler.capture || audioio_handler.render) && !backends[i].wait) {
+                fprintf(stderr, "Device %s can't run the modem in its callback\n", device);
+                return false;
+            }
+            backend = &backends[i];
+            aborted = 0;
+            memset(&audioio_stats, 0, sizeof(audioio_stats));
+            return backend->init(device ? device + len : NULL, rate, audio_latency, mode, channels);
+        }
+    }
+
+    fprintf(stderr, "No audio backend for device %s\n", device);
+    return false;
+}
+
+size_t audioio_getsamples(int16_t *buf, size_t n)
+{
+    return backend->getsamples(buf, n);
+}
+
+size_t audioio_putsamples(int16_t *buf, size_t n)
+{
+    return backend->putsamples(buf, n);
+}
+
+size_t audioio_capture_begin(int16_t **buf, size_t n)
+{
+    if (backend->capture_begin)
+        return backend->capture_begin(buf, n);
+    return backend->getsamples(*buf, n);
+}
+
+void audioio_capture_end(size_t n)
+{
+    if (backend->capture_end)
+        backend->capture_end(n);
+}
+
+void audioio_set_handler(audioio_capture_fn capture, audioio_render_fn render, void *ctx)
+{
+    audioio_handler.capture = capture;
+    audioio_handler.render = render;
+    audioio_handler.ctx = ctx;
+}
+
+bool audioio_wait(int timeout_ms)
+{
+    return backend->wait(timeout_ms);
+}
+
+float audioio_fill()
+{
+    return backend->fill ? backend->fill() : -1;
+}
+
+bool audioio_ended()
+{
+    return backend->ended ? backend->ended() : false;
+}
+
+void audioio_idle(bool idle)
+{
+    backend->idle(idle);
+}
+
+void audioio_stop()
+{
+    if (backend)
+        backend->stop();
+    backend = NULL;
+}
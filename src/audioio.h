@@ -0,0 +1,88 @@
+#ifndef _AUDIOIO_H_
+#define _AUDIOIO_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Audio I/O, passed on to a backend chosen by the device name:
+//   mmap:<pcm>     ALSA directly, through the mmap'd hardware buffer
+//   shm:<name>     A virtual line to other v23 processes, ",rt" to run in real time
+//   anything else  libsoundio, by device id (NULL for the default device)
+// With more than one channel, samples are interleaved and always come and go
+// in whole frames, as long as the counts are multiples of the channels.
+bool audioio_init(const char* device, int rate, int audio_latency, char mode, int channels);
+size_t audioio_getsamples(int16_t *buf, size_t n);
+size_t audioio_putsamples(int16_t *buf, size_t n);
+void audioio_idle(bool idle);
+void audioio_stop();
+
+// Capture without a copy where the backend can.  On entry *buf is a buffer
+// for up to n samples; on return it points to the samples, which may be in
+// the backend's own memory instead.  They stay valid until capture_end.
+size_t audioio_capture_begin(int16_t **buf, size_t n);
+void audioio_capture_end(size_t n);
+
+// How full the capture buffer is, from 0 to 1 where it would overflow, or -1
+// if the backend can't tell
+float audioio_fill();
+
+// True once capture has stopped because the input is over - every transmitter
+// on a virtual line has left - rather than because the device failed
+bool audioio_ended();
+
+// Minimum latency: rather than the caller fetching samples with getsamples or
+// handing them over with putsamples, the backend calls a handler from its own
+// audio thread with each period as the device hands it over.  capture is given
+// the samples; render fills the buffer and returns how many it filled, the
+// rest going out as silence.  Handlers run in real time, so they must not
+// block.  Set them before audioio_init: only a backend that calls back
+// (libsoundio) can be opened with a handler.  The caller then sleeps in
+// audioio_wait, which also sees to any device recovery.
+typedef void (*audioio_capture_fn)(void *ctx, const int16_t *buf, size_t n);
+typedef size_t (*audioio_render_fn)(void *ctx, int16_t *buf, size_t n);
+
+struct audioio_handler {
+    audioio_capture_fn capture;
+    audioio_render_fn render;
+    void *ctx;
+};
+extern struct audioio_handler audioio_handler;
+
+void audioio_set_handler(audioio_capture_fn capture, audioio_render_fn render, void *ctx);
+// Returns false once the stream has been given up on
+bool audioio_wait(int timeout_ms);
+
+// Device trouble doesn't end the stream.  After an overrun or underrun the
+// stream carries on: libsoundio recovers it itself and the backend only counts
+// it, while the native ALSA backend restarts it.  If the device goes away - a
+// USB interface being reset, say - it is re-opened by name as soon as it is
+// back, with the lost capture time handed on as silence.  Until then the
+// backend keeps trying, so a count of zero only comes back once audioio_abort
+// has been called.  The counts are bumped atomically from the audio threads.
+struct audioio_stats {
+    unsigned long xruns;        // Overruns and underruns
+    unsigned long errors;       // Other stream errors, each needing a re-open
+    unsigned long reopens;      // Successful re-opens
+    unsigned long gap_frames;   // Frames of silence standing in for lost capture
+};
+extern struct audioio_stats audioio_stats;
+
+// Give up on any recovery in progress - safe to call from a signal handler
+void audioio_abort();
+
+// For the backends: wait before the next attempt to re-open, false to give up
+bool audioio_retry_wait(int attempt);
+// Frames of silence to stand in for the capture lost since a time, at a rate
+size_t audioio_gap_frames(const struct timespec *since, int rate);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
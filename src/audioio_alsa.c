@@ -4,6 +4,10 @@
 #include <string.h>
 #include <soundio/soundio.h>
 #include <pthread.h>
+#include <time.h>
+
+#include "audioio.h"
+#include "audioio_alsa.h"
 
 static struct SoundIo *soundio = NULL;
 static struct SoundIoDevice *soundio_device = NULL;
@@ -14,6 +18,26 @@ struct SoundIoRingBuffer *ring_buffer = NULL;
 pthread_mutex_t ringbuffer_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t ringbuffer_cond = PTHREAD_COND_INITIALIZER;
 
+// Set while the modulator has dropped its carrier
+static volatile bool output_idle = false;
+
+// What the stream was opened with, for re-opening it
+static char *stream_device = NULL;      // Device id, NULL for the default
+static char stream_mode;
+static int stream_rate, stream_latency, stream_channels;
+
+// Set from the callbacks when the stream or the backend fails, and dealt
+// with on the next get or put
+static volatile int stream_error = 0;
+static volatile bool backend_lost = false;
+
+// Silence still to hand out for capture lost while re-opening
+static size_t gap_frames = 0;
+
+#define WAIT_MS     200     // Check on the backend if the stream is quiet this long
+
+#define HANDLER_SAMPLES 4096    // Gathered at once for a handler, when the areas aren't one buffer
+
 #define panic(fmt, ...) do {\
     __panic(fmt, __FUNCTION__, __FILE__, __LINE__, ##__VA_ARGS__); \
     exit(1); \
@@ -32,29 +56,120 @@ static void __panic(const char *format, ...) {
 static int min_int(int a, int b) {
     return (a < b) ? a : b;
 }
+
+// From the callbacks: hand the error on to whoever is waiting on the ring
+static void stream_failed(int err) {
+    pthread_mutex_lock(&ringbuffer_mutex);
+    if (!stream_error)
+        stream_error = err;
+    pthread_mutex_unlock(&ringbuffer_mutex);
+    pthread_cond_broadcast(&ringbuffer_cond);
+}
+
+// Scratch for the handlers, only touched from the callbacks
+static int16_t handler_buf[HANDLER_SAMPLES];
+
+// Hand frames of capture to the handler: straight from the device's memory
+// if it's a single channel with nothing between the samples, otherwise
+// interleaved into the scratch buffer.  With no areas, they're silence.
+static void capture_to_handler(struct SoundIoChannelArea *areas, int frame_count, int channels)
+{
+    if (areas && channels == 1 && areas[0].step == sizeof(int16_t)) {
+        audioio_handler.capture(audioio_handler.ctx, (const int16_t *)areas[0].ptr, frame_count);
+        return;
+    }
+
+    int chunk = HANDLER_SAMPLES / channels;
+    while (frame_count > 0) {
+        int frames = min_int(frame_count, chunk);
+        int16_t *p = handler_buf;
+        for (int frame = 0; frame < frames; frame += 1) {
+            for (int ch = 0; ch < channels; ch += 1) {
+                if (areas) {
+                    memcpy(p, areas[ch].ptr, sizeof(int16_t));
+                    areas[ch].ptr += areas[ch].step;
+                } else
+                    *p = 0;
+                ++p;
+            }
+        }
+        audioio_handler.capture(audioio_handler.ctx, handler_buf, frames * channels);
+        frame_count -= frames;
+    }
+}
+
+static void read_handler(struct SoundIoInStream *instream, int frame_count_max) {
+    struct SoundIoChannelArea *areas;
+    int err;
+    int channels = instream->layout.channel_count;
+
+    // Silence for what was lost while the device was away
+    size_t gap = __atomic_exchange_n(&gap_frames, 0, __ATOMIC_ACQ_REL);
+    if (gap > 0) {
+        __atomic_add_fetch(&audioio_stats.gap_frames, gap, __ATOMIC_RELAXED);
+        while (gap > 0) {
+            int frames = (gap > (size_t)HANDLER_SAMPLES) ? HANDLER_SAMPLES : (int)gap;
+            capture_to_handler(NULL, frames, channels);
+            gap -= frames;
+        }
+    }
+
+    int frames_left = frame_count_max;
+    while (frames_left > 0) {
+        int frame_count = frames_left;
+        if ((err = soundio_instream_begin_read(instream, &areas, &frame_count))) {
+            stream_failed(err);
+            return;
+        }
+        if (!frame_count)
+            break;
+        capture_to_handler(areas, frame_count, channels);
+        if ((err = soundio_instream_end_read(instream))) {
+            stream_failed(err);
+            return;
+        }
+        frames_left -= frame_count;
+    }
+}
+
 static void read_callback(struct SoundIoInStream *instream, int frame_count_min, int frame_count_max) {
     struct SoundIoChannelArea *areas;
     int err;
+
+    if (audioio_handler.capture) {
+        read_handler(instream, frame_count_max);
+        return;
+    }
+
     char *write_ptr = soundio_ring_buffer_write_ptr(ring_buffer);
     int free_bytes = soundio_ring_buffer_free_count(ring_buffer);
     int free_count = free_bytes / instream->bytes_per_frame;
-    if (frame_count_min > free_count)
-        panic("ring buffer overflow");
     int write_frames = min_int(free_count, frame_count_max);
     int frames_left = write_frames;
+    if (frame_count_min > free_count) {
+        // The reader has fallen behind: what doesn't fit is lost
+        frames_left = frame_count_min;
+        fprintf(stderr, "overflow %lu\n",
+                __atomic_add_fetch(&audioio_stats.xruns, 1, __ATOMIC_RELAXED));
+    }
+    int room = write_frames;
     for (;;) {
         int frame_count = frames_left;
-        if ((err = soundio_instream_begin_read(instream, &areas, &frame_count)))
-            panic("begin read error: %s", soundio_strerror(err));
+        if ((err = soundio_instream_begin_read(instream, &areas, &frame_count))) {
+            stream_failed(err);
+            return;
+        }
         if (!frame_count)
             break;
+        int copy = min_int(frame_count, room);
         if (!areas) {
             // Due to an overflow there is a hole. Fill the ring buffer with
             // silence for the size of the hole.
-            memset(write_ptr, 0, frame_count * instream->bytes_per_frame);
+            memset(write_ptr, 0, copy * instream->bytes_per_frame);
+            write_ptr += copy * instream->bytes_per_frame;
             fprintf(stderr, "Dropped %d frames due to internal overflow\n", frame_count);
         } else {
-            for (int frame = 0; frame < frame_count; frame += 1) {
+            for (int frame = 0; frame < copy; frame += 1) {
                 for (int ch = 0; ch < instream->layout.channel_count; ch += 1) {
                     memcpy(write_ptr, areas[ch].ptr, instream->bytes_per_sample);
                     areas[ch].ptr += areas[ch].step;
@@ -62,8 +177,11 @@ static void read_callback(struct SoundIoInStream *instream, int frame_count_min,
                 }
             }
         }
-        if ((err = soundio_instream_end_read(instream)))
-            panic("end read error: %s", soundio_strerror(err));
+        room -= copy;
+        if ((err = soundio_instream_end_read(instream))) {
+            stream_failed(err);
+            return;
+        }
         frames_left -= frame_count;
         if (frames_left <= 0)
             break;
@@ -74,23 +192,84 @@ static void read_callback(struct SoundIoInStream *instream, int frame_count_min,
     pthread_mutex_unlock(&ringbuffer_mutex);
     pthread_cond_signal(&ringbuffer_cond);
 }
+// Have the handler fill frames of output, straight into the device's memory
+// if it's a single channel with nothing between the samples
+static void render_from_handler(struct SoundIoChannelArea *areas, int frame_count, int channels)
+{
+    if (channels == 1 && areas[0].step == sizeof(int16_t)) {
+        size_t n = audioio_handler.render(audioio_handler.ctx, (int16_t *)areas[0].ptr, frame_count);
+        if (n < (size_t)frame_count)
+            memset(areas[0].ptr + n * sizeof(int16_t), 0, (frame_count - n) * sizeof(int16_t));
+        return;
+    }
+
+    int chunk = HANDLER_SAMPLES / channels;
+    while (frame_count > 0) {
+        int frames = min_int(frame_count, chunk);
+        size_t n = audioio_handler.render(audioio_handler.ctx, handler_buf, frames * channels);
+        if (n < (size_t)(frames * channels))
+            memset(handler_buf + n, 0, (frames * channels - n) * sizeof(int16_t));
+        int16_t *p = handler_buf;
+        for (int frame = 0; frame < frames; frame += 1) {
+            for (int ch = 0; ch < channels; ch += 1) {
+                memcpy(areas[ch].ptr, p++, sizeof(int16_t));
+                areas[ch].ptr += areas[ch].step;
+            }
+        }
+        frame_count -= frames;
+    }
+}
+
+// The handler keeps the device's buffer full, which is as much latency as
+// the stream was opened with and no more
+static void write_handler(struct SoundIoOutStream *outstream, int frame_count_max) {
+    struct SoundIoChannelArea *areas;
+    int err;
+
+    int frames_left = frame_count_max;
+    while (frames_left > 0) {
+        int frame_count = frames_left;
+        if ((err = soundio_outstream_begin_write(outstream, &areas, &frame_count))) {
+            stream_failed(err);
+            return;
+        }
+        if (frame_count <= 0)
+            break;
+        render_from_handler(areas, frame_count, outstream->layout.channel_count);
+        if ((err = soundio_outstream_end_write(outstream))) {
+            stream_failed(err);
+            return;
+        }
+        frames_left -= frame_count;
+    }
+}
+
 static void write_callback(struct SoundIoOutStream *outstream, int frame_count_min, int frame_count_max) {
     struct SoundIoChannelArea *areas;
     int frames_left;
     int frame_count;
     int err;
+
+    if (audioio_handler.render) {
+        write_handler(outstream, frame_count_max);
+        return;
+    }
+
     char *read_ptr = soundio_ring_buffer_read_ptr(ring_buffer);
     int fill_bytes = soundio_ring_buffer_fill_count(ring_buffer);
     int fill_count = fill_bytes / outstream->bytes_per_frame;
-    if (frame_count_min > fill_count) {
+    if (frame_count_min > fill_count || (output_idle && fill_count == 0)) {
         // Ring buffer does not have enough data, fill with zeroes.
-        frames_left = frame_count_min;
+        // Once the carrier is off, keep the device fed with silence.
+        frames_left = output_idle ? frame_count_max : frame_count_min;
         for (;;) {
             frame_count = frames_left;
             if (frame_count <= 0)
               return;
-            if ((err = soundio_outstream_begin_write(outstream, &areas, &frame_count)))
-                panic("begin write error: %s", soundio_strerror(err));
+            if ((err = soundio_outstream_begin_write(outstream, &areas, &frame_count))) {
+                stream_failed(err);
+                return;
+            }
             if (frame_count <= 0)
                 return;
             for (int frame = 0; frame < frame_count; frame += 1) {
@@ -99,8 +278,10 @@ static void write_callback(struct SoundIoOutStream *outstream, int frame_count_m
                     areas[ch].ptr += areas[ch].step;
                 }
             }
-            if ((err = soundio_outstream_end_write(outstream)))
-                panic("end write error: %s", soundio_strerror(err));
+            if ((err = soundio_outstream_end_write(outstream))) {
+                stream_failed(err);
+                return;
+            }
             frames_left -= frame_count;
         }
     }
@@ -108,8 +289,10 @@ static void write_callback(struct SoundIoOutStream *outstream, int frame_count_m
     frames_left = read_count;
     while (frames_left > 0) {
         int frame_count = frames_left;
-        if ((err = soundio_outstream_begin_write(outstream, &areas, &frame_count)))
-            panic("begin write error: %s", soundio_strerror(err));
+        if ((err = soundio_outstream_begin_write(outstream, &areas, &frame_count))) {
+            stream_failed(err);
+            return;
+        }
         if (frame_count <= 0)
             break;
         for (int frame = 0; frame < frame_count; frame += 1) {
@@ -119,8 +302,10 @@ static void write_callback(struct SoundIoOutStream *outstream, int frame_count_m
                 read_ptr += outstream->bytes_per_sample;
             }
         }
-        if ((err = soundio_outstream_end_write(outstream)))
-            panic("end write error: %s", soundio_strerror(err));
+        if ((err = soundio_outstream_end_write(outstream))) {
+            stream_failed(err);
+            return;
+        }
         frames_left -= frame_count;
     }
     pthread_mutex_lock(&ringbuffer_mutex);
@@ -129,57 +314,88 @@ static void write_callback(struct SoundIoOutStream *outstream, int frame_count_m
     pthread_cond_signal(&ringbuffer_cond);
 }
 static void underflow_callback(struct SoundIoOutStream *outstream) {
-    static int count = 0;
-    fprintf(stderr, "underflow %d\n", ++count);
+    (void)outstream;
+    if (!output_idle)
+        fprintf(stderr, "underflow %lu\n",
+                __atomic_add_fetch(&audioio_stats.xruns, 1, __ATOMIC_RELAXED));
 }
-static void overflow_callback(struct SoundIoOutStream *instream) {
-    static int count = 0;
-    fprintf(stderr, "overflow %d\n", ++count);
+static void overflow_callback(struct SoundIoInStream *instream) {
+    (void)instream;
+    fprintf(stderr, "overflow %lu\n",
+            __atomic_add_fetch(&audioio_stats.xruns, 1, __ATOMIC_RELAXED));
+}
+static void outstream_error_callback(struct SoundIoOutStream *outstream, int err) {
+    (void)outstream;
+    stream_failed(err);
+}
+static void instream_error_callback(struct SoundIoInStream *instream, int err) {
+    (void)instream;
+    stream_failed(err);
+}
+static void backend_disconnect_callback(struct SoundIo *soundio, int err) {
+    (void)soundio;
+    backend_lost = true;
+    stream_failed(err);
 }
 
-bool audioio_alsa_init(const char* device, int rate, int audio_latency, char mode)
+static void close_stream()
 {
-
-    if(soundio){
-        panic("Audio device is already initialized");
+    if(outstream){
+        soundio_outstream_destroy(outstream);
+        outstream = NULL;
     }
-    soundio = soundio_create();
-    if (!soundio)
-        panic("out of memory");
-    int err = soundio_connect(soundio);
-    if (err)
-        panic("error connecting: %s", soundio_strerror(err));
+    if(instream){
+        soundio_instream_destroy(instream);
+        instream = NULL;
+    }
+    if(soundio_device){
+        soundio_device_unref(soundio_device);
+        soundio_device = NULL;
+    }
+}
 
-    soundio_flush_events(soundio);
+// Find the device by id - its index changes as devices come and go - and
+// start a stream on it
+static bool open_stream(bool verbose)
+{
+    int err;
 
-    if (mode != 'r' && mode != 'w'){
-        fprintf(stderr, "Invalid mode specified (%c)\n", mode);
-        return false;
+    if (backend_lost) {
+        soundio_disconnect(soundio);
+        if ((err = soundio_connect(soundio))) {
+            if (verbose)
+                fprintf(stderr, "error connecting: %s\n", soundio_strerror(err));
+            return false;
+        }
+        backend_lost = false;
     }
+    soundio_flush_events(soundio);
 
-    int default_device_index = mode == 'w' ?
+    int default_device_index = stream_mode == 'w' ?
         soundio_default_output_device_index(soundio) :
         soundio_default_input_device_index(soundio);
 
     if (default_device_index < 0) {
-        panic("no device found");
+        if (verbose)
+            fprintf(stderr, "no device found\n");
+        return false;
     }
 
     struct SoundIoDevice* (*__soundio_get_device) (struct SoundIo *,int);
-    __soundio_get_device = mode == 'w' ?
+    __soundio_get_device = stream_mode == 'w' ?
         soundio_get_output_device :
         soundio_get_input_device;
 
     int device_index = default_device_index;
-    if (device) {
+    if (stream_device) {
         bool found = false;
-        int device_count = mode == 'w' ?
+        int device_count = stream_mode == 'w' ?
             soundio_output_device_count(soundio) :
             soundio_input_device_count(soundio);
 
         for (int i = 0; i < device_count; i++){
             struct SoundIoDevice *snd_device = __soundio_get_device(soundio, i);
-            if (strcmp(snd_device->id, device) == 0) {
+            if (strcmp(snd_device->id, stream_device) == 0) {
                 device_index = i;
                 found = true;
             }
@@ -190,7 +406,9 @@ bool audioio_alsa_init(const char* device, int rate, int audio_latency, char mod
         }
 
         if(!found){
-            panic("invalid device name: %s", device);
+            if (verbose)
+                fprintf(stderr, "invalid device name: %s\n", stream_device);
+            return false;
         }
     }
 
@@ -200,64 +418,189 @@ bool audioio_alsa_init(const char* device, int rate, int audio_latency, char mod
         panic("could not get device: out of memory");
     }
 
-    fprintf(stderr, "Device: %s\n", soundio_device->name);
+    if (verbose)
+        fprintf(stderr, "Device: %s\n", soundio_device->name);
 
     enum SoundIoFormat format = SoundIoFormatS16NE;
+    const struct SoundIoChannelLayout *layout = soundio_channel_layout_get_default(stream_channels);
+    if (!layout)
+        panic("no channel layout for %d channels", stream_channels);
 
-    if(mode == 'w'){
+    if(stream_mode == 'w'){
         outstream = soundio_outstream_create(soundio_device);
         if (!outstream)
             panic("out of memory");
         outstream->format = format;
-        outstream->sample_rate = rate;
-        outstream->layout = *soundio_channel_layout_get_builtin(SoundIoChannelLayoutIdMono);
-        outstream->software_latency = audio_latency / 1000.0;
+        outstream->sample_rate = stream_rate;
+        outstream->layout = *layout;
+        outstream->software_latency = stream_latency / 1000.0;
         outstream->write_callback = write_callback;
         outstream->underflow_callback = underflow_callback;
+        outstream->error_callback = outstream_error_callback;
         if ((err = soundio_outstream_open(outstream))) {
-            panic("unable to open output stream: %s", soundio_strerror(err));
+            if (verbose)
+                fprintf(stderr, "unable to open output stream: %s\n", soundio_strerror(err));
+            close_stream();
+            return false;
         }
         if ((err = soundio_outstream_start(outstream))) {
-            panic("unable to start device: %s", soundio_strerror(err));
+            if (verbose)
+                fprintf(stderr, "unable to start device: %s\n", soundio_strerror(err));
+            close_stream();
+            return false;
         }
     }else{
         instream = soundio_instream_create(soundio_device);
         if (!instream)
             panic("out of memory");
         instream->format = format;
-        instream->sample_rate = rate;
-        instream->layout = *soundio_channel_layout_get_builtin(SoundIoChannelLayoutIdMono);
-        instream->software_latency = audio_latency / 1000.0;
+        instream->sample_rate = stream_rate;
+        instream->layout = *layout;
+        instream->software_latency = stream_latency / 1000.0;
         instream->read_callback = read_callback;
         instream->overflow_callback = overflow_callback;
+        instream->error_callback = instream_error_callback;
         if ((err = soundio_instream_open(instream))) {
-            panic("unable to open input stream: %s", soundio_strerror(err));
+            if (verbose)
+                fprintf(stderr, "unable to open input stream: %s\n", soundio_strerror(err));
+            close_stream();
+            return false;
         }
         if ((err = soundio_instream_start(instream))) {
-            panic("unable to start device: %s", soundio_strerror(err));
+            if (verbose)
+                fprintf(stderr, "unable to start device: %s\n", soundio_strerror(err));
+            close_stream();
+            return false;
+        }
+    }
+    return true;
+}
+
+// The stream has failed: keep trying to open it again until the device is
+// back.  Anything already in the ring buffer stays there.
+static bool reopen()
+{
+    struct timespec lost;
+    clock_gettime(CLOCK_MONOTONIC, &lost);
+
+    fprintf(stderr, "Audio device error: %s - re-opening it\n", soundio_strerror(stream_error));
+    __atomic_add_fetch(&audioio_stats.errors, 1, __ATOMIC_RELAXED);
+    close_stream();
+    stream_error = 0;
+
+    for (int attempt = 0; ; ++attempt) {
+        if (!audioio_retry_wait(attempt))
+            return false;
+        if (open_stream(attempt == 0))
+            break;
+    }
+
+    __atomic_add_fetch(&audioio_stats.reopens, 1, __ATOMIC_RELAXED);
+    fprintf(stderr, "Re-opened %s\n", soundio_device->name);
+
+    // With a handler the capture callback hands it out, as soon as now
+    if (stream_mode == 'r')
+        __atomic_store_n(&gap_frames, audioio_gap_frames(&lost, stream_rate), __ATOMIC_RELEASE);
+    return true;
+}
+
+// Wait for the ring buffer to have something in it (or room in it), or for
+// the stream to fail.  If it goes quiet, look for news from the backend.
+static void wait_ring(bool for_space)
+{
+    pthread_mutex_lock(&ringbuffer_mutex);
+    while(!stream_error &&
+          (for_space ? soundio_ring_buffer_free_count(ring_buffer)
+                     : soundio_ring_buffer_fill_count(ring_buffer)) == 0){
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += WAIT_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_nsec -= 1000000000L;
+            ++deadline.tv_sec;
+        }
+        if(pthread_cond_timedwait(&ringbuffer_cond, &ringbuffer_mutex, &deadline)){
+            pthread_mutex_unlock(&ringbuffer_mutex);
+            soundio_flush_events(soundio);
+            pthread_mutex_lock(&ringbuffer_mutex);
         }
     }
+    pthread_mutex_unlock(&ringbuffer_mutex);
+}
+
+bool audioio_alsa_init(const char* device, int rate, int audio_latency, char mode, int channels)
+{
+
+    if(soundio){
+        panic("Audio device is already initialized");
+    }
+
+    if (mode != 'r' && mode != 'w'){
+        fprintf(stderr, "Invalid mode specified (%c)\n", mode);
+        return false;
+    }
+
+    soundio = soundio_create();
+    if (!soundio)
+        panic("out of memory");
+    soundio->on_backend_disconnect = backend_disconnect_callback;
+    int err = soundio_connect(soundio);
+    if (err)
+        panic("error connecting: %s", soundio_strerror(err));
+
+    stream_device = device ? strdup(device) : NULL;
+    stream_mode = mode;
+    stream_rate = rate;
+    stream_latency = audio_latency;
+    stream_channels = channels;
+    stream_error = 0;
+    backend_lost = false;
+    gap_frames = 0;
 
-    int capacity = audio_latency * 2 * rate * sizeof(int16_t) / 1000;
+    // The ring buffer has to be there before the stream calls back.  A
+    // handler doesn't use it, so there's no need to prefill it.
+    int frame_bytes = channels * sizeof(int16_t);
+    int capacity = audio_latency * 2 * rate / 1000 * frame_bytes;
+    int prefill = (audioio_handler.capture || audioio_handler.render) ? 0 :
+                  capacity / 2 / frame_bytes * frame_bytes;
     ring_buffer = soundio_ring_buffer_create(soundio, capacity);
     if (!ring_buffer)
         panic("unable to create ring buffer: out of memory");
     char *buf = soundio_ring_buffer_write_ptr(ring_buffer);
-    memset(buf, 0, capacity / 2);
-    soundio_ring_buffer_advance_write_ptr(ring_buffer, capacity / 2);
+    memset(buf, 0, prefill);
+    soundio_ring_buffer_advance_write_ptr(ring_buffer, prefill);
+
+    if (!open_stream(true)) {
+        audioio_alsa_stop();
+        return false;
+    }
     return true;
 }
 
 size_t audioio_alsa_getsamples(int16_t *buf, size_t n)
 {
-    pthread_mutex_lock(&ringbuffer_mutex);
-    while(soundio_ring_buffer_fill_count(ring_buffer) == 0){
-    	pthread_cond_wait(&ringbuffer_cond, &ringbuffer_mutex);
+    for(;;){
+        // Silence for what was lost while the device was away
+        if(gap_frames > 0){
+            size_t frames = n / stream_channels;
+            if(frames > gap_frames) frames = gap_frames;
+            memset(buf, 0, frames * stream_channels * sizeof(buf[0]));
+            gap_frames -= frames;
+            __atomic_add_fetch(&audioio_stats.gap_frames, frames, __ATOMIC_RELAXED);
+            return frames * stream_channels;
+        }
+
+        wait_ring(false);
+        if(soundio_ring_buffer_fill_count(ring_buffer) > 0)
+            break;
+
+        // Only once what came before the failure has been read
+        if(!reopen())
+            return 0;
     }
-    pthread_mutex_unlock(&ringbuffer_mutex);
     char *read_ptr = soundio_ring_buffer_read_ptr(ring_buffer);
     int fill_count = soundio_ring_buffer_fill_count(ring_buffer) / sizeof(buf[0]);
-    fill_count = fill_count > n ? n : fill_count;
+    fill_count = (size_t)fill_count > n ? (int)n : fill_count;
     memcpy(buf, read_ptr, fill_count * sizeof(buf[0]));
     soundio_ring_buffer_advance_read_ptr(ring_buffer, fill_count * sizeof(buf[0]));
     return fill_count;
@@ -266,36 +609,94 @@ size_t audioio_alsa_getsamples(int16_t *buf, size_t n)
 size_t audioio_alsa_putsamples(int16_t *buf, size_t n)
 {
     //fprintf(stderr, "putsamples: start\n");
-    pthread_mutex_lock(&ringbuffer_mutex);
-    while(soundio_ring_buffer_free_count(ring_buffer) == 0){
-        pthread_cond_wait(&ringbuffer_cond, &ringbuffer_mutex);
+    for(;;){
+        wait_ring(true);
+        if(!stream_error)
+            break;
+        if(!reopen())
+            return 0;
     }
-    pthread_mutex_unlock(&ringbuffer_mutex);
     char *write_ptr = soundio_ring_buffer_write_ptr(ring_buffer);
     int free_count = soundio_ring_buffer_free_count(ring_buffer) / sizeof(buf[0]);
-    free_count = free_count > n ? n : free_count;
+    free_count = (size_t)free_count > n ? (int)n : free_count;
     memcpy(write_ptr, buf, free_count * sizeof(buf[0]));
     soundio_ring_buffer_advance_write_ptr(ring_buffer, free_count * sizeof(buf[0]));
     return free_count;
 }
 
+// With a handler: sleep until the stream fails or the time is up, and then
+// re-open it if it has failed
+bool audioio_alsa_wait(int timeout_ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_nsec -= 1000000000L;
+        ++deadline.tv_sec;
+    }
+
+    pthread_mutex_lock(&ringbuffer_mutex);
+    while (!stream_error) {
+        if (pthread_cond_timedwait(&ringbuffer_cond, &ringbuffer_mutex, &deadline))
+            break;
+    }
+    pthread_mutex_unlock(&ringbuffer_mutex);
+
+    soundio_flush_events(soundio);
+    if (stream_error)
+        return reopen();
+    return true;
+}
+
+// Only the capture ring can overflow, and a handler doesn't use it
+float audioio_alsa_fill()
+{
+    if (stream_mode != 'r' || audioio_handler.capture || !ring_buffer)
+        return -1;
+    return (float)soundio_ring_buffer_fill_count(ring_buffer) /
+           soundio_ring_buffer_capacity(ring_buffer);
+}
+
+// Once what is already queued has played, output silence without waiting
+// for any more samples
+void audioio_alsa_idle(bool idle)
+{
+    output_idle = idle;
+}
+
 void audioio_alsa_stop()
 {
-    if(outstream){
-        soundio_outstream_destroy(outstream);
-        outstream = NULL;
+    if(outstream && !stream_error && audioio_handler.render){
+        // What the handler has rendered is in the device's buffer
+        struct timespec ts = { 0, 0 };
+        double latency = outstream->software_latency;
+        ts.tv_sec = (time_t)latency;
+        ts.tv_nsec = (long)((latency - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
     }
-    if(instream){
-        soundio_instream_destroy(instream);
-        instream = NULL;
+    else if(outstream && !stream_error){
+        // Give what's queued a chance to play out
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        pthread_mutex_lock(&ringbuffer_mutex);
+        while(soundio_ring_buffer_fill_count(ring_buffer) > 0 && !stream_error){
+            if(pthread_cond_timedwait(&ringbuffer_cond, &ringbuffer_mutex, &deadline))
+                break;
+        }
+        pthread_mutex_unlock(&ringbuffer_mutex);
     }
-    if(soundio_device){
-        soundio_device_unref(soundio_device);
-        soundio_device = NULL;
+    close_stream();
+    if(ring_buffer){
+        soundio_ring_buffer_destroy(ring_buffer);
+        ring_buffer = NULL;
     }
     if(soundio){
         soundio_destroy(soundio);
         soundio = NULL;
     }
+    free(stream_device);
+    stream_device = NULL;
 }
-
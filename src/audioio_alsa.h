@@ -5,10 +5,13 @@
 extern "C" {
 #endif
 
-bool audioio_alsa_init(const char* device, int rate, int audio_latency, char mode);
+bool audioio_alsa_init(const char* device, int rate, int audio_latency, char mode, int channels);
 size_t audioio_alsa_getsamples(int16_t *buf, size_t n);
 size_t audioio_alsa_putsamples(int16_t *buf, size_t n);
+void audioio_alsa_idle(bool idle);
 void audioio_alsa_stop();
+bool audioio_alsa_wait(int timeout_ms);
+float audioio_alsa_fill();
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,383 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <alsa/asoundlib.h>
+
+#include "audioio.h"
+#include "audioio_mmap.h"
+
+// ALSA without libsoundio in between: samples are read and written straight
+// from the mmap'd hardware buffer, and we sleep in poll on the PCM until a
+// period is ready.  No extra thread, ring buffer or lock.
+
+static snd_pcm_t *pcm = NULL;
+static char *pcm_name = NULL;   // Kept for re-opening
+static int pcm_rate, pcm_latency;
+static bool capture;
+static int channels;
+static snd_pcm_uframes_t period_size;
+static snd_pcm_uframes_t buffer_size;
+static struct pollfd *pfds = NULL;
+static int n_pfds;
+
+// Area handed out by capture_begin, to be committed by capture_end
+static snd_pcm_uframes_t mmap_offset;
+static snd_pcm_uframes_t mmap_frames;
+
+// Set while the modulator has dropped its carrier
+static volatile bool output_idle = false;
+
+// Silence still to hand out for capture lost while re-opening, and whether
+// capture_begin handed out silence rather than the device's memory
+static size_t gap_frames = 0;
+static bool gap_out = false;
+
+static bool set_hw_params(int rate, int audio_latency, bool verbose)
+{
+    snd_pcm_hw_params_t *hw;
+    snd_pcm_hw_params_alloca(&hw);
+    unsigned int actual_rate = rate;
+    unsigned int buffer_time = audio_latency * 1000;
+    unsigned int period_time = buffer_time / 4;
+    int err;
+
+    if ((err = snd_pcm_hw_params_any(pcm, hw)) < 0 ||
+        (err = snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_MMAP_INTERLEAVED)) < 0 ||
+        (err = snd_pcm_hw_params_set_format(pcm, hw, SND_PCM_FORMAT_S16)) < 0 ||
+        (err = snd_pcm_hw_params_set_channels(pcm, hw, channels)) < 0 ||
+        (err = snd_pcm_hw_params_set_rate_near(pcm, hw, &actual_rate, NULL)) < 0 ||
+        (err = snd_pcm_hw_params_set_buffer_time_near(pcm, hw, &buffer_time, NULL)) < 0 ||
+        (err = snd_pcm_hw_params_set_period_time_near(pcm, hw, &period_time, NULL)) < 0 ||
+        (err = snd_pcm_hw_params(pcm, hw)) < 0) {
+        if (verbose)
+            fprintf(stderr, "Unable to configure audio device: %s\n", snd_strerror(err));
+        return false;
+    }
+
+    // The modem frequencies are worked out for the rate asked for
+    if (actual_rate != (unsigned int)rate) {
+        fprintf(stderr, "Audio device can't do %d Hz (nearest is %u Hz)\n", rate, actual_rate);
+        return false;
+    }
+
+    snd_pcm_hw_params_get_period_size(hw, &period_size, NULL);
+    snd_pcm_hw_params_get_buffer_size(hw, &buffer_size);
+    return true;
+}
+
+static bool set_sw_params()
+{
+    snd_pcm_sw_params_t *sw;
+    snd_pcm_sw_params_alloca(&sw);
+    snd_pcm_uframes_t boundary;
+    int err;
+
+    if ((err = snd_pcm_sw_params_current(pcm, sw)) < 0) {
+        fprintf(stderr, "Unable to get software parameters: %s\n", snd_strerror(err));
+        return false;
+    }
+    snd_pcm_sw_params_get_boundary(sw, &boundary);
+
+    // Wake up once per period
+    snd_pcm_sw_params_set_avail_min(pcm, sw, period_size);
+
+    if (!capture) {
+        // Start playing once the buffer is full.  Never stop on an underrun:
+        // ALSA fills what has been played with silence, so the device keeps
+        // running while the carrier is off.
+        snd_pcm_sw_params_set_start_threshold(pcm, sw, buffer_size);
+        snd_pcm_sw_params_set_stop_threshold(pcm, sw, boundary);
+        snd_pcm_sw_params_set_silence_threshold(pcm, sw, 0);
+        snd_pcm_sw_params_set_silence_size(pcm, sw, boundary);
+    }
+
+    if ((err = snd_pcm_sw_params(pcm, sw)) < 0) {
+        fprintf(stderr, "Unable to set software parameters: %s\n", snd_strerror(err));
+        return false;
+    }
+    return true;
+}
+
+static void close_pcm()
+{
+    if (pcm) {
+        snd_pcm_close(pcm);
+        pcm = NULL;
+    }
+    free(pfds);
+    pfds = NULL;
+}
+
+// Open and set up the device, and start it if capturing
+static bool open_pcm(bool verbose)
+{
+    int err;
+
+    if ((err = snd_pcm_open(&pcm, pcm_name,
+                            capture ? SND_PCM_STREAM_CAPTURE : SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
+        if (verbose)
+            fprintf(stderr, "Unable to open %s: %s\n", pcm_name, snd_strerror(err));
+        pcm = NULL;
+        return false;
+    }
+
+    if (!set_hw_params(pcm_rate, pcm_latency, verbose) || !set_sw_params()) {
+        close_pcm();
+        return false;
+    }
+
+    n_pfds = snd_pcm_poll_descriptors_count(pcm);
+    pfds = calloc(n_pfds, sizeof(struct pollfd));
+    if (!pfds || snd_pcm_poll_descriptors(pcm, pfds, n_pfds) != n_pfds) {
+        fprintf(stderr, "Unable to get poll descriptors for %s\n", pcm_name);
+        close_pcm();
+        return false;
+    }
+
+    if (capture && (err = snd_pcm_start(pcm)) < 0) {
+        if (verbose)
+            fprintf(stderr, "Unable to start %s: %s\n", pcm_name, snd_strerror(err));
+        close_pcm();
+        return false;
+    }
+    return true;
+}
+
+// The device has gone away: keep trying to open it again until it's back
+static bool reopen()
+{
+    struct timespec lost;
+    clock_gettime(CLOCK_MONOTONIC, &lost);
+    close_pcm();
+
+    for (int attempt = 0; ; ++attempt) {
+        if (!audioio_retry_wait(attempt))
+            return false;
+        if (open_pcm(attempt == 0))
+            break;
+    }
+
+    __atomic_add_fetch(&audioio_stats.reopens, 1, __ATOMIC_RELAXED);
+    fprintf(stderr, "Re-opened %s\n", pcm_name);
+
+    if (capture)
+        gap_frames = audioio_gap_frames(&lost, pcm_rate);
+    return true;
+}
+
+static bool recover(int err)
+{
+    if (err == -EPIPE)
+        fprintf(stderr, "%s %lu\n", capture ? "overflow" : "underflow",
+                __atomic_add_fetch(&audioio_stats.xruns, 1, __ATOMIC_RELAXED));
+
+    // After an xrun or a suspend, restarting the stream is enough
+    if (err == -EPIPE || err == -ESTRPIPE || err == -EINTR) {
+        if ((err = snd_pcm_recover(pcm, err, 1)) >= 0 &&
+            (!capture || (err = snd_pcm_start(pcm)) >= 0))
+            return true;
+    }
+
+    fprintf(stderr, "Audio device error: %s - re-opening it\n", snd_strerror(err));
+    __atomic_add_fetch(&audioio_stats.errors, 1, __ATOMIC_RELAXED);
+    return reopen();
+}
+
+// Sleep until the device wants attention.  A signal just wakes us up early.
+static bool wait_ready()
+{
+    if (poll(pfds, n_pfds, -1) < 0 && errno != EINTR) {
+        perror("poll");
+        return false;
+    }
+
+    unsigned short revents;
+    snd_pcm_poll_descriptors_revents(pcm, pfds, n_pfds, &revents);
+    return true;
+}
+
+bool audioio_mmap_init(const char* device, int rate, int audio_latency, char mode, int n_channels)
+{
+    if (pcm) {
+        fprintf(stderr, "Audio device is already initialized\n");
+        return false;
+    }
+
+    if (mode != 'r' && mode != 'w') {
+        fprintf(stderr, "Invalid mode specified (%c)\n", mode);
+        return false;
+    }
+    capture = (mode == 'r');
+    channels = n_channels;
+    pcm_rate = rate;
+    pcm_latency = audio_latency;
+    gap_frames = 0;
+    gap_out = false;
+
+    pcm_name = strdup((device && *device) ? device : "default");
+    if (!pcm_name || !open_pcm(true)) {
+        audioio_mmap_stop();
+        return false;
+    }
+
+    fprintf(stderr, "Device: %s (mmap, %lu frame periods, %lu frame buffer)\n",
+            pcm_name, (unsigned long)period_size, (unsigned long)buffer_size);
+    return true;
+}
+
+// Counts are in samples, but the device works in frames of all the channels
+size_t audioio_mmap_capture_begin(int16_t **buf, size_t n)
+{
+    n /= channels;
+
+    // Wait for a whole period, unless we've asked for less than that
+    snd_pcm_uframes_t want = (n < period_size) ? n : period_size;
+
+    for (;;) {
+        // Silence for what was lost while the device was away, ahead of
+        // anything from the re-opened one
+        if (gap_frames > 0) {
+            size_t frames = (n < gap_frames) ? n : gap_frames;
+            memset(*buf, 0, frames * channels * sizeof(int16_t));
+            gap_frames -= frames;
+            __atomic_add_fetch(&audioio_stats.gap_frames, frames, __ATOMIC_RELAXED);
+            gap_out = true;
+            return frames * channels;
+        }
+
+        snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm);
+        if (avail < 0) {
+            if (!recover(avail))
+                return 0;
+            continue;
+        }
+        if ((snd_pcm_uframes_t)avail < want) {
+            if (!wait_ready())
+                return 0;
+            continue;
+        }
+
+        const snd_pcm_channel_area_t *areas;
+        mmap_frames = n;
+        int err = snd_pcm_mmap_begin(pcm, &areas, &mmap_offset, &mmap_frames);
+        if (err < 0) {
+            if (!recover(err))
+                return 0;
+            continue;
+        }
+
+        *buf = (int16_t *)((char *)areas[0].addr +
+                           (areas[0].first + mmap_offset * areas[0].step) / 8);
+        return mmap_frames * channels;
+    }
+}
+
+void audioio_mmap_capture_end(size_t n)
+{
+    if (gap_out) {
+        gap_out = false;
+        return;
+    }
+    n /= channels;
+
+    snd_pcm_sframes_t r = snd_pcm_mmap_commit(pcm, mmap_offset, n);
+    if (r < 0 || (size_t)r != n)
+        recover(r < 0 ? r : -EPIPE);
+}
+
+size_t audioio_mmap_getsamples(int16_t *buf, size_t n)
+{
+    int16_t *area = buf;
+    size_t got = audioio_mmap_capture_begin(&area, n);
+    if (got == 0)
+        return 0;
+
+    if (area != buf)
+        memcpy(buf, area, got * sizeof(buf[0]));
+    audioio_mmap_capture_end(got);
+    return got;
+}
+
+size_t audioio_mmap_putsamples(int16_t *buf, size_t n)
+{
+    n /= channels;
+
+    for (;;) {
+        snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm);
+        if (avail < 0) {
+            if (!recover(avail))
+                return 0;
+            continue;
+        }
+
+        // Fallen behind the hardware, which has played silence meanwhile -
+        // catch up rather than writing where it has already been
+        if ((snd_pcm_uframes_t)avail > buffer_size) {
+            if (!output_idle)
+                fprintf(stderr, "underflow %lu\n",
+                        __atomic_add_fetch(&audioio_stats.xruns, 1, __ATOMIC_RELAXED));
+            snd_pcm_forward(pcm, avail - buffer_size);
+            continue;
+        }
+
+        if (avail == 0) {
+            if (!wait_ready())
+                return 0;
+            continue;
+        }
+
+        const snd_pcm_channel_area_t *areas;
+        snd_pcm_uframes_t offset;
+        snd_pcm_uframes_t frames = n;
+        int err = snd_pcm_mmap_begin(pcm, &areas, &offset, &frames);
+        if (err < 0) {
+            if (!recover(err))
+                return 0;
+            continue;
+        }
+
+        memcpy((char *)areas[0].addr + (areas[0].first + offset * areas[0].step) / 8,
+               buf, frames * channels * sizeof(buf[0]));
+
+        snd_pcm_sframes_t r = snd_pcm_mmap_commit(pcm, offset, frames);
+        if (r < 0 || (snd_pcm_uframes_t)r != frames) {
+            if (!recover(r < 0 ? r : -EPIPE))
+                return 0;
+            continue;
+        }
+        return frames * channels;
+    }
+}
+
+// Captured frames waiting, against the hardware buffer they overrun
+float audioio_mmap_fill()
+{
+    if (!capture || !pcm)
+        return -1;
+    snd_pcm_sframes_t avail = snd_pcm_avail(pcm);
+    if (avail < 0)
+        return -1;
+    return (float)avail / buffer_size;
+}
+
+// The device plays silence by itself once it runs out, so this just stops
+// that being reported
+void audioio_mmap_idle(bool idle)
+{
+    output_idle = idle;
+}
+
+void audioio_mmap_stop()
+{
+    // Give what's queued a chance to play out
+    if (pcm && !capture)
+        snd_pcm_drain(pcm);
+    close_pcm();
+
+    free(pcm_name);
+    pcm_name = NULL;
+}
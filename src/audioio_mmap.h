@@ -0,0 +1,21 @@
+#ifndef _AUDIO_MMAP_H_
+#define _AUDIO_MMAP_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool audioio_mmap_init(const char* device, int rate, int audio_latency, char mode, int channels);
+size_t audioio_mmap_getsamples(int16_t *buf, size_t n);
+size_t audioio_mmap_putsamples(int16_t *buf, size_t n);
+size_t audioio_mmap_capture_begin(int16_t **buf, size_t n);
+void audioio_mmap_capture_end(size_t n);
+void audioio_mmap_idle(bool idle);
+void audioio_mmap_stop();
+float audioio_mmap_fill();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
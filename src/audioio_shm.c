@@ -0,0 +1,599 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "audioio.h"
+#include "audioio_shm.h"
+
+// A virtual cable between v23 processes: a named shared-memory object that
+// transmitters write into and receivers read from, with no audio hardware.
+// Each transmitter has a ring of its own, and receivers mix all of them as
+// they read, so several transmitters can share one line.
+//
+// Positions are in frames since the line was created.  Free-running lines
+// go as fast as the slowest peer: receivers wait for every transmitter, and
+// transmitters wait for every receiver.  Real-time lines follow the clock,
+// like a sound card would: transmitters can be up to the latency ahead of
+// it, and receivers get what has been sent up to now.
+
+#define SHM_MAGIC       0x76323373  // "v23s"
+#define SHM_MAX_PEERS   16          // Of each kind
+#define SHM_RING_FRAMES 65536       // Per transmitter
+#define SHM_WAIT_MS     50          // Longest wait before checking for dead peers
+
+struct shm_peer {
+    _Atomic int32_t pid;        // 0 if the slot is free
+    _Atomic int32_t idle;       // Transmitter has dropped its carrier
+    _Atomic int32_t closing;    // Transmitter is done, and waiting to drain
+    _Atomic uint64_t start;     // Transmitter: first frame with data
+    _Atomic uint64_t pos;       // Next frame to write or read
+};
+
+struct shm_line {
+    _Atomic uint32_t magic;     // Set last, once the rest is filled in
+    int32_t rate;
+    int32_t channels;
+    int32_t realtime;
+    uint64_t epoch_ns;          // CLOCK_MONOTONIC time of frame 0, if real-time
+
+    _Atomic int32_t users;
+    _Atomic uint64_t head;      // Furthest frame any transmitter has reached
+    _Atomic int32_t tx_seen;    // A transmitter has joined since the line was idle
+    _Atomic int32_t rx_seen;
+
+    // Bumped on every change, for futex waits
+    _Atomic uint32_t seq;
+    _Atomic uint32_t waiters;
+
+    struct shm_peer tx[SHM_MAX_PEERS];
+    struct shm_peer rx[SHM_MAX_PEERS];
+    int16_t rings[];            // [SHM_MAX_PEERS][SHM_RING_FRAMES * channels]
+};
+
+static struct shm_line *line = NULL;
+static size_t line_size;
+static char line_name[NAME_MAX];
+static struct shm_peer *self = NULL;
+static bool capture;
+static int channels;
+static uint64_t latency;        // Frames a real-time transmitter may lead by
+static int16_t *ring;           // Our own, if transmitting
+static int32_t *mix = NULL;     // Scratch for mixing the transmitters
+
+// Set while the modulator has dropped its carrier
+static bool output_idle = false;
+static bool input_ended = false;  // Every transmitter has left
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Where the clock is, on a real-time line
+static uint64_t line_now()
+{
+    return (now_ns() - line->epoch_ns) * line->rate / 1000000000;
+}
+
+static void sleep_frames(uint64_t frames)
+{
+    uint64_t ns = frames * 1000000000 / line->rate;
+    if (ns > SHM_WAIT_MS * 1000000ULL)
+        ns = SHM_WAIT_MS * 1000000ULL;
+    struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+    nanosleep(&ts, NULL);
+}
+
+static bool pid_alive(int32_t pid)
+{
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+// Free the slots of peers that have gone away without saying
+static void reap_peers()
+{
+    int32_t me = getpid();
+    for (int i = 0; i < 2 * SHM_MAX_PEERS; ++i) {
+        struct shm_peer *p = (i < SHM_MAX_PEERS) ? &line->tx[i] : &line->rx[i - SHM_MAX_PEERS];
+        int32_t pid = atomic_load(&p->pid);
+        if (pid != 0 && pid != me && !pid_alive(pid))
+            atomic_compare_exchange_strong(&p->pid, &pid, 0);
+    }
+}
+
+static void line_kick()
+{
+    atomic_fetch_add(&line->seq, 1);
+    if (atomic_load(&line->waiters) > 0)
+        syscall(SYS_futex, &line->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Sleep until a peer changes something after seq was read, or a while passes
+static void line_wait(uint32_t seq)
+{
+    struct timespec ts = { 0, SHM_WAIT_MS * 1000000 };
+
+    atomic_fetch_add(&line->waiters, 1);
+    int r = syscall(SYS_futex, &line->seq, FUTEX_WAIT, seq, &ts, NULL, 0);
+    atomic_fetch_sub(&line->waiters, 1);
+
+    if (r < 0 && errno == ETIMEDOUT)
+        reap_peers();
+}
+
+static bool peers_any(struct shm_peer *peers)
+{
+    for (int i = 0; i < SHM_MAX_PEERS; ++i)
+        if (atomic_load(&peers[i].pid))
+            return true;
+    return false;
+}
+
+// Where the slowest receiver has got to
+static uint64_t rx_min_pos(bool *any)
+{
+    uint64_t m = UINT64_MAX;
+    *any = false;
+    for (int i = 0; i < SHM_MAX_PEERS; ++i)
+        if (atomic_load(&line->rx[i].pid)) {
+            uint64_t p = atomic_load_explicit(&line->rx[i].pos, memory_order_acquire);
+            if (p < m)
+                m = p;
+            *any = true;
+        }
+    return m;
+}
+
+static int16_t *tx_ring(int i)
+{
+    return line->rings + (size_t)i * SHM_RING_FRAMES * channels;
+}
+
+static bool claim_slot(struct shm_peer *peers)
+{
+    int32_t me = getpid();
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 0; i < SHM_MAX_PEERS; ++i) {
+            int32_t zero = 0;
+            if (atomic_compare_exchange_strong(&peers[i].pid, &zero, me)) {
+                self = &peers[i];
+                if (peers == line->tx)
+                    ring = tx_ring(i);
+                return true;
+            }
+        }
+        reap_peers();
+    }
+    return false;
+}
+
+// Map the line, creating it if we're the first
+static bool open_line(const char *name, int rate, bool realtime)
+{
+    snprintf(line_name, sizeof(line_name), "/v23-%s", name);
+    line_size = sizeof(struct shm_line) +
+                (size_t)SHM_MAX_PEERS * SHM_RING_FRAMES * channels * sizeof(int16_t);
+
+    bool created = true;
+    int fd = shm_open(line_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        created = false;
+        fd = shm_open(line_name, O_RDWR, 0600);
+    }
+    if (fd < 0) {
+        perror(line_name);
+        return false;
+    }
+
+    if (created && ftruncate(fd, line_size) < 0) {
+        perror(line_name);
+        close(fd);
+        shm_unlink(line_name);
+        return false;
+    }
+
+    // Whoever created it may not have sized it yet
+    struct stat st;
+    for (int tries = 0; !created && fstat(fd, &st) == 0 && (size_t)st.st_size < sizeof(struct shm_line); ++tries) {
+        if (tries == 100) {
+            fprintf(stderr, "Line %s was never set up\n", name);
+            close(fd);
+            return false;
+        }
+        usleep(10000);
+    }
+    if (!created && (size_t)st.st_size != line_size) {
+        fprintf(stderr, "Line %s is set up for a different number of channels\n", name);
+        close(fd);
+        return false;
+    }
+
+    line = mmap(NULL, line_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (line == MAP_FAILED) {
+        perror(line_name);
+        line = NULL;
+        return false;
+    }
+
+    if (created) {
+        line->rate = rate;
+        line->channels = channels;
+        line->realtime = realtime;
+        line->epoch_ns = now_ns();
+        atomic_store_explicit(&line->magic, SHM_MAGIC, memory_order_release);
+    } else {
+        for (int tries = 0; atomic_load_explicit(&line->magic, memory_order_acquire) != SHM_MAGIC; ++tries) {
+            if (tries == 100) {
+                fprintf(stderr, "Line %s was never set up\n", name);
+                return false;
+            }
+            usleep(10000);
+        }
+        if (line->rate != rate || line->channels != channels || line->realtime != realtime) {
+            fprintf(stderr, "Line %s is %d Hz, %d channels, %s - not what was asked for\n", name,
+                    line->rate, line->channels, line->realtime ? "real-time" : "free-running");
+            return false;
+        }
+    }
+
+    atomic_fetch_add(&line->users, 1);
+    return true;
+}
+
+// device is NAME, optionally followed by ",rt" for a real-time line
+bool audioio_shm_init(const char* device, int rate, int audio_latency, char mode, int n_channels)
+{
+    if (line) {
+        fprintf(stderr, "Audio device is already initialized\n");
+        return false;
+    }
+
+    if (mode != 'r' && mode != 'w') {
+        fprintf(stderr, "Invalid mode specified (%c)\n", mode);
+        return false;
+    }
+    capture = (mode == 'r');
+    channels = n_channels;
+    output_idle = false;
+    input_ended = false;
+
+    char name[NAME_MAX - 8];
+    bool realtime = false;
+    snprintf(name, sizeof(name), "%s", (device && *device) ? device : "default");
+    char *opt = strchr(name, ',');
+    if (opt) {
+        *opt++ = '\0';
+        if (!strcmp(opt, "rt"))
+            realtime = true;
+        else if (strcmp(opt, "free")) {
+            fprintf(stderr, "Unknown line option %s: use rt or free\n", opt);
+            return false;
+        }
+    }
+    if (!*name || strchr(name, '/')) {
+        fprintf(stderr, "Invalid line name %s\n", name);
+        return false;
+    }
+
+    latency = (uint64_t)audio_latency * rate / 1000;
+    if (latency > SHM_RING_FRAMES / 2)
+        latency = SHM_RING_FRAMES / 2;
+
+    mix = calloc((size_t)SHM_RING_FRAMES * channels, sizeof(int32_t));
+    if (!mix || !open_line(name, rate, realtime)) {
+        audioio_shm_stop();
+        return false;
+    }
+
+    // Nobody else is here: start a fresh session on the line.  Peers that
+    // crashed never dropped their count of users or moved head back, so
+    // both are set afresh too - there's only us now.
+    reap_peers();
+    if (!peers_any(line->tx) && !peers_any(line->rx)) {
+        atomic_store(&line->users, 1);
+        atomic_store(&line->head, 0);
+        atomic_store(&line->tx_seen, 0);
+        atomic_store(&line->rx_seen, 0);
+    }
+
+    if (!claim_slot(capture ? line->rx : line->tx)) {
+        fprintf(stderr, "Line %s already has %d %s\n", name, SHM_MAX_PEERS,
+                capture ? "receivers" : "transmitters");
+        audioio_shm_stop();
+        return false;
+    }
+
+    uint64_t pos;
+    if (realtime) {
+        // A transmitter starts half its latency ahead, as if the buffer had been primed
+        pos = line_now() + (capture ? 0 : latency / 2);
+    } else if (capture) {
+        // From the oldest sample any transmitter still holds
+        pos = atomic_load(&line->head);
+        for (int i = 0; i < SHM_MAX_PEERS; ++i)
+            if (atomic_load(&line->tx[i].pid)) {
+                uint64_t p = atomic_load(&line->tx[i].pos);
+                uint64_t s = atomic_load(&line->tx[i].start);
+                uint64_t oldest = (p - s > SHM_RING_FRAMES) ? p - SHM_RING_FRAMES : s;
+                if (oldest < pos)
+                    pos = oldest;
+            }
+    } else {
+        // Join where the receivers have got to
+        bool any;
+        pos = atomic_load(&line->head);
+        uint64_t rx = rx_min_pos(&any);
+        if (any && rx > pos)
+            pos = rx;
+    }
+
+    atomic_store(&self->idle, 0);
+    atomic_store(&self->closing, 0);
+    atomic_store(&self->start, pos);
+    atomic_store_explicit(&self->pos, pos, memory_order_release);
+    atomic_store(capture ? &line->rx_seen : &line->tx_seen, 1);
+    line_kick();
+
+    fprintf(stderr, "Device: shm line %s (%s, %d channel%s)\n", name,
+            realtime ? "real-time" : "free-running", channels, channels > 1 ? "s" : "");
+    return true;
+}
+
+// Mix what every transmitter has for frames [from, from + n) into buf
+static void mix_frames(int16_t *buf, uint64_t from, size_t n)
+{
+    size_t ns = n * channels;
+    memset(mix, 0, ns * sizeof(int32_t));
+
+    for (int i = 0; i < SHM_MAX_PEERS; ++i) {
+        struct shm_peer *t = &line->tx[i];
+        if (!atomic_load(&t->pid))
+            continue;
+
+        uint64_t end = atomic_load_explicit(&t->pos, memory_order_acquire);
+        uint64_t begin = atomic_load(&t->start);
+        if (end > SHM_RING_FRAMES && end - SHM_RING_FRAMES > begin)
+            begin = end - SHM_RING_FRAMES;
+        if (begin < from)
+            begin = from;
+        if (end > from + n)
+            end = from + n;
+
+        const int16_t *r = tx_ring(i);
+        for (uint64_t f = begin; f < end; ++f) {
+            const int16_t *src = r + (f % SHM_RING_FRAMES) * channels;
+            int32_t *dst = mix + (f - from) * channels;
+            for (int c = 0; c < channels; ++c)
+                dst[c] += src[c];
+        }
+    }
+
+    for (size_t i = 0; i < ns; ++i)
+        buf[i] = (mix[i] > INT16_MAX) ? INT16_MAX : (mix[i] < INT16_MIN) ? INT16_MIN : mix[i];
+}
+
+// How far receivers can read on a free-running line, and whether the line
+// has ended: every transmitter that joined has left, and we've read it all
+static uint64_t free_readable(uint64_t pos, bool *ended)
+{
+    uint64_t live = UINT64_MAX, draining = pos;
+    bool any = false;
+
+    for (int i = 0; i < SHM_MAX_PEERS; ++i) {
+        struct shm_peer *t = &line->tx[i];
+        if (!atomic_load(&t->pid))
+            continue;
+        any = true;
+
+        uint64_t p = atomic_load_explicit(&t->pos, memory_order_acquire);
+        if (atomic_load(&t->closing) || atomic_load(&t->idle)) {
+            if (p > draining)
+                draining = p;
+        } else if (p < live)
+            live = p;
+    }
+
+    *ended = !any && atomic_load(&line->tx_seen);
+    return (live != UINT64_MAX) ? live : draining;
+}
+
+size_t audioio_shm_getsamples(int16_t *buf, size_t n)
+{
+    n /= channels;
+    if (n > SHM_RING_FRAMES / 2)
+        n = SHM_RING_FRAMES / 2;
+
+    uint64_t pos = atomic_load(&self->pos);
+    uint64_t end;
+
+    for (;;) {
+        uint32_t seq = atomic_load(&line->seq);
+
+        if (line->realtime) {
+            // Wait for a quarter of the latency, unless we've asked for less
+            uint64_t want = (n < latency / 4) ? n : latency / 4;
+            if (want < 1)
+                want = 1;
+            end = line_now();
+
+            // Fallen so far behind that the transmitters have moved on
+            if (end - pos > SHM_RING_FRAMES - latency) {
+                fprintf(stderr, "overflow %lu\n",
+                        __atomic_add_fetch(&audioio_stats.xruns, 1, __ATOMIC_RELAXED));
+                pos = end - latency;
+            }
+
+            bool ended;
+            free_readable(pos, &ended);
+            if (ended) {
+                input_ended = true;
+                return 0;
+            }
+
+            if (end >= pos + want)
+                break;
+            sleep_frames(pos + want - end);
+        } else {
+            bool ended;
+            end = free_readable(pos, &ended);
+            if (end > pos)
+                break;
+            if (ended) {
+                input_ended = true;
+                return 0;
+            }
+            line_wait(seq);
+        }
+    }
+
+    if (end - pos < n)
+        n = end - pos;
+    mix_frames(buf, pos, n);
+
+    atomic_store_explicit(&self->pos, pos + n, memory_order_release);
+    line_kick();
+    return n * channels;
+}
+
+size_t audioio_shm_putsamples(int16_t *buf, size_t n)
+{
+    n /= channels;
+
+    uint64_t pos = atomic_load(&self->pos);
+    uint64_t limit;
+
+    for (;;) {
+        uint32_t seq = atomic_load(&line->seq);
+
+        if (line->realtime) {
+            uint64_t now = line_now();
+            if (pos < now) {
+                // Fallen behind the clock: what we missed went out as silence
+                if (!output_idle)
+                    fprintf(stderr, "underflow %lu\n",
+                            __atomic_add_fetch(&audioio_stats.xruns, 1, __ATOMIC_RELAXED));
+                pos = now;
+                atomic_store(&self->start, pos);
+            }
+            limit = now + latency;
+            if (limit > pos)
+                break;
+            sleep_frames(pos - limit + 1);
+        } else {
+            // Never get more than a ring ahead of the slowest receiver.
+            // Until one turns up, hold on to what we've sent; once they've
+            // all gone, it goes nowhere.
+            bool any;
+            uint64_t rx = rx_min_pos(&any);
+            if (any)
+                limit = rx + SHM_RING_FRAMES;
+            else if (!atomic_load(&line->rx_seen))
+                limit = atomic_load(&self->start) + SHM_RING_FRAMES;
+            else
+                limit = UINT64_MAX;
+            if (limit > pos)
+                break;
+            line_wait(seq);
+        }
+    }
+
+    if (limit - pos < n)
+        n = limit - pos;
+    if (n > SHM_RING_FRAMES - pos % SHM_RING_FRAMES)
+        n = SHM_RING_FRAMES - pos % SHM_RING_FRAMES;
+
+    memcpy(ring + (pos % SHM_RING_FRAMES) * channels, buf, n * channels * sizeof(int16_t));
+    atomic_store_explicit(&self->pos, pos + n, memory_order_release);
+
+    uint64_t head = atomic_load(&line->head);
+    while (head < pos + n && !atomic_compare_exchange_weak(&line->head, &head, pos + n))
+        ;
+    line_kick();
+    return n * channels;
+}
+
+// While the carrier is off we stop writing.  On a free-running line the
+// receivers then stop waiting for us, so we pick up where they've got to.
+void audioio_shm_idle(bool idle)
+{
+    output_idle = idle;
+    if (!line || capture)
+        return;
+
+    if (!idle && !line->realtime) {
+        bool any;
+        uint64_t rx = rx_min_pos(&any);
+        uint64_t pos = atomic_load(&self->pos);
+        if (any && rx > pos) {
+            atomic_store(&self->start, rx);
+            atomic_store_explicit(&self->pos, rx, memory_order_release);
+        }
+    }
+    atomic_store(&self->idle, idle);
+    line_kick();
+}
+
+bool audioio_shm_ended()
+{
+    return input_ended;
+}
+
+void audioio_shm_stop()
+{
+    if (line && self) {
+        if (!capture) {
+            // Give what's queued a chance to be received
+            atomic_store(&self->closing, 1);
+            line_kick();
+
+            // Give up if the receivers stop reading for a second
+            uint64_t pos = atomic_load(&self->pos);
+            uint64_t last = 0;
+            int stalled = 0;
+            while (stalled < 1000 / SHM_WAIT_MS) {
+                uint32_t seq = atomic_load(&line->seq);
+                bool any = true;
+                uint64_t done = line->realtime ? line_now() : rx_min_pos(&any);
+                if (done >= pos || !any)
+                    break;
+
+                stalled = (done == last) ? stalled + 1 : 0;
+                last = done;
+                if (line->realtime)
+                    sleep_frames(pos - done);
+                else
+                    line_wait(seq);
+            }
+        }
+
+        atomic_store(&self->pid, 0);
+        self = NULL;
+        line_kick();
+    }
+
+    if (line) {
+        if (atomic_fetch_sub(&line->users, 1) == 1)
+            shm_unlink(line_name);
+        munmap(line, line_size);
+        line = NULL;
+    }
+
+    free(mix);
+    mix = NULL;
+}
@@ -0,0 +1,19 @@
+#ifndef _AUDIO_SHM_H_
+#define _AUDIO_SHM_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool audioio_shm_init(const char* device, int rate, int audio_latency, char mode, int channels);
+size_t audioio_shm_getsamples(int16_t *buf, size_t n);
+size_t audioio_shm_putsamples(int16_t *buf, size_t n);
+void audioio_shm_idle(bool idle);
+void audioio_shm_stop();
+bool audioio_shm_ended();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
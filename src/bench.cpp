@@ -0,0 +1,354 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "audioio.h"
+#include "modem.h"
+#include "bench.h"
+
+#define BENCH_MAX_CHARS     10000
+#define BENCH_MAX_VALUES    16      // In each list
+#define BENCH_SETTLE_MS     500     // After the leader, before the first keystroke
+#define BENCH_GAP_MS        50      // Least time between keystrokes, plus up to as much again
+
+// Where each character is timed, in CLOCK_MONOTONIC ns
+enum {
+    T_KEY,          // Keystroke
+    T_READ,         // Modulator picks it up, at the next bit boundary
+    T_QUEUED,       // Frame handed to the audio device
+    T_CAPTURED,     // Demodulator got the block it finished in
+    T_DECODED,      // Character out of the demodulator
+    T_STAMPS
+};
+
+static const char *stage_names[] = {
+    "input wait", "modulator", "line", "decoder"
+};
+
+// Shared between the modulator (parent) and demodulator (child)
+struct benchshared {
+    volatile int done;
+    uint64_t t[BENCH_MAX_CHARS][T_STAMPS];
+};
+
+static benchshared *sh = NULL;
+static int n_chars;
+
+// Only printable characters, in a cycle, so lost ones can be spotted
+static unsigned char bench_char(int i)
+{
+    return 0x21 + i % 94;
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int parse_list(const char *s, int *values)
+{
+    int n = 0;
+    while(n < BENCH_MAX_VALUES)
+    {
+        char *end;
+        long v = strtol(s, &end, 10);
+        if(end == s || v < 1)
+            return 0;
+        values[n++] = v;
+        if(*end != ',')
+            return *end ? 0 : n;
+        s = end + 1;
+    }
+    return 0;
+}
+
+// Demodulator side: the last character matched, and the block time
+struct benchrx {
+    int next;
+    uint64_t captured;
+};
+
+static void bench_put_char(void *ctx, char c)
+{
+    benchrx *rx = (benchrx*)ctx;
+    uint64_t now = now_ns();
+
+    // Skip over any that were lost, but not past what has been sent
+    for(int i = rx->next; i < n_chars && i < rx->next + 94; ++i)
+    {
+        if(__atomic_load_n(&sh->t[i][T_QUEUED], __ATOMIC_ACQUIRE) == 0)
+            break;
+        if(bench_char(i) == (unsigned char)c)
+        {
+            sh->t[i][T_CAPTURED] = rx->captured;
+            __atomic_store_n(&sh->t[i][T_DECODED], now, __ATOMIC_RELEASE);
+            rx->next = i + 1;
+            return;
+        }
+    }
+}
+
+static void bench_demodulate(const char *device, const modemcfg& m, int latency, size_t N)
+{
+    if(!audioio_init(device, m.sample_rate, latency, 'r', 1))
+        _exit(1);
+
+    dspbufs bufs;
+    demod d;
+    int16_t *bufIn = make_buffer(N);
+    if(!bufIn || !dspbufs_init(bufs, N) || !demod_init(d, m, &bufs))
+        _exit(1);
+
+    benchrx rx;
+    rx.next = 0;
+    d.put_char = bench_put_char;
+    d.ctx = &rx;
+
+    while(!sh->done && !quit)
+    {
+        int16_t *in = bufIn;
+        size_t n = audioio_capture_begin(&in, N);
+        if(n == 0) break;
+
+        rx.captured = now_ns();
+        demod_process(d, in, n);
+        audioio_capture_end(n);
+    }
+
+    audioio_stop();
+    _exit(0);
+}
+
+static void bench_output(int16_t *buf, size_t n)
+{
+    while(n > 0)
+    {
+        size_t done = audioio_putsamples(buf, n);
+        if(done == 0) exit(1);
+        buf += done;
+        n -= done;
+    }
+}
+
+// Type the characters one at a time, waiting for each to come out the far
+// end (or be given up on) before the next
+static void bench_modulate(const modemcfg& m)
+{
+    wavecache wc;
+    bool cached = wavecache_init(wc, m);
+    mod md;
+    mod_init(md, m, cached ? &wc : NULL);
+
+    size_t N = m.samples_per_bit;
+    size_t frame_samples = m.ff.frame_size * N;
+    int16_t *bufBit = make_buffer(N);
+    int16_t *bufFrame = make_buffer(frame_samples);
+    if(!bufBit || !bufFrame)
+    {
+        fprintf(stderr, "Failed to allocate buffers\n");
+        exit(1);
+    }
+
+    // Give up on a character after a couple of seconds on top of its frame
+    uint64_t frame_ns = (uint64_t)frame_samples * 1000000000 / m.sample_rate;
+    uint64_t timeout = 2000000000ULL + 4 * frame_ns;
+
+    int leader = m.leader;
+    uint64_t next_key = 0;
+    bool in_flight = false;
+    int cur = 0;
+
+    while(cur < n_chars && !quit)
+    {
+        uint64_t now = now_ns();
+        if(leader > 0)
+        {
+            if(--leader == 0)
+                next_key = now + BENCH_SETTLE_MS * 1000000ULL;
+        }
+        else if(in_flight)
+        {
+            if(__atomic_load_n(&sh->t[cur][T_DECODED], __ATOMIC_ACQUIRE) ||
+               now - sh->t[cur][T_QUEUED] > timeout)
+            {
+                in_flight = false;
+                ++cur;
+                next_key = now + (BENCH_GAP_MS + rand() % BENCH_GAP_MS) * 1000000ULL;
+            }
+        }
+        else if(now >= next_key)
+        {
+            sh->t[cur][T_KEY]  = next_key;
+            sh->t[cur][T_READ] = now;
+            mod_get_frame_samples(md, bench_char(cur), bufFrame);
+            bench_output(bufFrame, frame_samples);
+            __atomic_store_n(&sh->t[cur][T_QUEUED], now_ns(), __ATOMIC_RELEASE);
+            in_flight = true;
+            continue;
+        }
+
+        mod_get_bit_samples(md, bufBit);
+        bench_output(bufBit, N);
+    }
+
+    free(bufBit);
+    free(bufFrame);
+    if(cached)
+        wavecache_free(wc);
+}
+
+static int by_value(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void print_stats(const char *name, double *ms, int n)
+{
+    qsort(ms, n, sizeof(double), by_value);
+    printf("  %-11s p50 %8.2f ms   p99 %8.2f ms   max %8.2f ms\n", name,
+           ms[n / 2], ms[(n * 99) / 100 < n ? (n * 99) / 100 : n - 1], ms[n - 1]);
+}
+
+static void report(int rate, int latency, size_t N, const modemcfg& m)
+{
+    double *ms = (double*)calloc(n_chars, sizeof(double));
+    if(!ms)
+        return;
+
+    int got = 0;
+    for(int i = 0; i < n_chars; ++i)
+        if(sh->t[i][T_DECODED])
+            ++got;
+
+    double frame_ms = 1000.0 * m.ff.frame_size * m.samples_per_bit / rate;
+    double filter_ms = 1000.0 * ((rate / m.first_null - 1) + (m.samples_per_bit - 1)) / 2 / rate;
+    printf("%d Hz, -L%d, -N%zu: %d of %d characters (frame %.2f ms, filter delay %.2f ms)\n",
+           rate, latency, N, got, n_chars, frame_ms, filter_ms);
+    if(got == 0)
+    {
+        free(ms);
+        return;
+    }
+
+    for(int s = -1; s < T_STAMPS - 1; ++s)
+    {
+        int n = 0;
+        for(int i = 0; i < n_chars; ++i)
+        {
+            const uint64_t *t = sh->t[i];
+            if(!t[T_DECODED])
+                continue;
+            ms[n++] = (s < 0 ? t[T_DECODED] - t[T_KEY] : t[s + 1] - t[s]) / 1e6;
+        }
+        print_stats(s < 0 ? "total" : stage_names[s], ms, n);
+    }
+    fflush(stdout);
+    free(ms);
+}
+
+static bool bench_one(const benchcfg& cfg, int rate, int latency, size_t N, int run)
+{
+    modemcfg m;
+    if(!init_framefmt(m.ff, cfg.frame_format, 1))
+    {
+        fprintf(stderr, "Failed to initialize frame format\n");
+        return false;
+    }
+    init_channel(m, cfg.forward, rate);
+
+    if(!sin_init(32767.0, rate))
+    {
+        fprintf(stderr, "Failed to initialize sine buffer\n");
+        return false;
+    }
+
+    // Without a device, a private real-time virtual line
+    char line[64];
+    const char *device = cfg.device;
+    if(!device)
+    {
+        snprintf(line, sizeof(line), "shm:bench-%d-%d,rt", (int)getpid(), run);
+        device = line;
+    }
+
+    memset(sh, 0, sizeof(*sh));
+    fflush(NULL);
+    pid_t child = fork();
+    if(child < 0)
+    {
+        perror("fork");
+        return false;
+    }
+    if(child == 0)
+        bench_demodulate(device, m, latency, N);
+
+    bool ok = audioio_init(device, rate, latency, 'w', 1);
+    if(ok)
+    {
+        bench_modulate(m);
+        audioio_stop();
+    }
+
+    sh->done = 1;
+    int status;
+    waitpid(child, &status, 0);
+    free(sinebuf);
+    sinebuf = NULL;
+
+    if(!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        fprintf(stderr, "Benchmark failed at %d Hz, -L%d, -N%zu\n", rate, latency, N);
+        return false;
+    }
+
+    report(rate, latency, N, m);
+    return true;
+}
+
+bool bench_run(const benchcfg& cfg)
+{
+    int rates[BENCH_MAX_VALUES], latencies[BENCH_MAX_VALUES], blocks[BENCH_MAX_VALUES];
+    int n_rates     = parse_list(cfg.rates, rates);
+    int n_latencies = parse_list(cfg.latencies, latencies);
+    int n_blocks    = parse_list(cfg.blocks, blocks);
+    if(!n_rates || !n_latencies || !n_blocks)
+    {
+        fprintf(stderr, "Error: -r, -L and -N take up to %d comma-separated values when benchmarking\n",
+                BENCH_MAX_VALUES);
+        return false;
+    }
+
+    n_chars = cfg.chars;
+    if(n_chars < 1 || n_chars > BENCH_MAX_CHARS)
+    {
+        fprintf(stderr, "Error: benchmark between 1 and %d characters\n", BENCH_MAX_CHARS);
+        return false;
+    }
+
+    sh = (benchshared*)mmap(NULL, sizeof(benchshared), PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(sh == MAP_FAILED)
+    {
+        perror("mmap");
+        return false;
+    }
+
+    srand(getpid());
+    bool ok = true;
+    int run = 0;
+    for(int r = 0; r < n_rates && ok && !quit; ++r)
+        for(int l = 0; l < n_latencies && ok && !quit; ++l)
+            for(int b = 0; b < n_blocks && ok && !quit; ++b)
+                ok = bench_one(cfg, rates[r], latencies[l], blocks[b], run++);
+
+    munmap(sh, sizeof(benchshared));
+    return ok;
+}
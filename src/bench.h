@@ -0,0 +1,18 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+struct benchcfg {
+    const char *device;         // NULL for a real-time virtual line
+    const char *rates;          // Comma-separated lists to run every combination of
+    const char *latencies;
+    const char *blocks;
+    bool forward;
+    const char *frame_format;
+    int chars;                  // Keystrokes to time for each combination
+};
+
+// Time characters from entering the modulator to leaving the demodulator,
+// with the two running as separate processes on the same line
+bool bench_run(const benchcfg& cfg);
+
+#endif
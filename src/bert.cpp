@@ -0,0 +1,151 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+
+#include "modem.h"
+#include "bert.h"
+
+bool bert_init(bert& b, int order, const modemcfg& m)
+{
+    switch(order)
+    {
+        case 9:  b.tap = 5;  break;
+        case 15: b.tap = 14; break;
+        default:
+            fprintf(stderr, "Error: the bit error rate tester does PRBS9 or PRBS15, not %d\n", order);
+            return false;
+    }
+    b.order = order;
+    b.lfsr = (1 << order) - 1;
+    b.data_bits = m.ff.data_size;
+    b.frame_samples = (uint64_t)m.ff.frame_size * m.samples_per_bit;
+
+    b.locked = false;
+    b.loaded = 0;
+    b.window = 0;
+    b.seen = false;
+    b.last_time = 0;
+    b.bits = b.errors = 0;
+    b.frames = b.frames_lost = b.frames_bad = b.slips = 0;
+    return true;
+}
+
+// The generator's state is the last `order` bits of the sequence, newest in
+// bit 0, so loading it from what was received is just shifting it in
+static int prbs_next(bert& b)
+{
+    int bit = ((b.lfsr >> (b.order - 1)) ^ (b.lfsr >> (b.tap - 1))) & 1;
+    b.lfsr = ((b.lfsr << 1) | bit) & ((1 << b.order) - 1);
+    return bit;
+}
+
+unsigned char bert_tx(bert& b)
+{
+    unsigned char c = 0;
+    for(int i = 0; i < b.data_bits; ++i)
+        c |= prbs_next(b) << i;
+    return c;
+}
+
+static void bert_bit(bert& b, int bit)
+{
+    uint32_t mask = (1 << b.order) - 1;
+
+    if(!b.locked)
+    {
+        if(b.loaded < b.order)
+        {
+            b.lfsr = ((b.lfsr << 1) | bit) & mask;
+            ++b.loaded;
+        }
+        else if(b.lfsr != 0 && prbs_next(b) == bit)
+        {
+            if(++b.loaded >= b.order + BERT_LOCK_BITS)
+            {
+                b.locked = true;
+                b.window = 0;
+                if(!quiet)
+                    fprintf(stderr, "BERT: in sync\n");
+            }
+        }
+        else
+        {
+            // Carry on from what was actually received.  prbs_next has
+            // shifted in the bit it expected - unless the register was all
+            // zero, when it didn't run (and a non-zero one never steps to zero)
+            if(b.lfsr == 0)
+                b.lfsr = ((b.lfsr << 1) | bit) & mask;
+            else
+                b.lfsr = (b.lfsr & ~1u) | bit;
+            b.loaded = b.order;
+        }
+        return;
+    }
+
+    int err = prbs_next(b) != bit;
+    ++b.bits;
+    b.errors += err;
+    b.window = (b.window << 1) | err;
+
+    if(__builtin_popcountll(b.window) > BERT_LOSS_ERRORS)
+    {
+        // Too many to be noise: a frame came or went that we didn't see
+        b.locked = false;
+        b.loaded = 0;
+        ++b.slips;
+        if(!quiet)
+            fprintf(stderr, "BERT: lost sync\n");
+    }
+}
+
+// Step the generator over frames whose bits can't be checked
+static void bert_skip(bert& b, unsigned long frames)
+{
+    if(b.locked)
+        for(unsigned long i = 0; i < frames * b.data_bits; ++i)
+            prbs_next(b);
+}
+
+void bert_rx(bert& b, const frameinfo& fi)
+{
+    // Frames are sent back to back, so a gap is frames missed altogether
+    if(b.seen && fi.time > b.last_time)
+    {
+        uint64_t n = (fi.time - b.last_time + b.frame_samples / 2) / b.frame_samples;
+        if(n > 1)
+        {
+            b.frames_lost += n - 1;
+            bert_skip(b, n - 1);
+        }
+    }
+    b.seen = true;
+    b.last_time = fi.time;
+    ++b.frames;
+
+    if(fi.status == FRAME_SKEW)
+    {
+        // Found, but not decoded
+        ++b.frames_bad;
+        bert_skip(b, 1);
+        return;
+    }
+    if(fi.status == FRAME_PARITY)
+        ++b.frames_bad;
+
+    for(int i = 0; i < b.data_bits; ++i)
+        bert_bit(b, (fi.c >> i) & 1);
+}
+
+void bert_report(FILE *f, const bert& b, bert& last, double secs)
+{
+    unsigned long long bits = b.bits - last.bits, errors = b.errors - last.errors;
+    const char *state = (b.frames == last.frames) ? "no signal" : b.locked ? "sync" : "hunting";
+
+    fprintf(f, "%8.1fs %-9s BER %.2e (%.2e overall), %llu errors in %llu bits, "
+               "%lu frames, %lu lost, %lu bad, %lu slips\n",
+            secs, state, bits ? (double)errors / bits : 0.0,
+            b.bits ? (double)b.errors / b.bits : 0.0, b.errors, b.bits,
+            b.frames, b.frames_lost, b.frames_bad, b.slips);
+    fflush(f);
+    last = b;
+}
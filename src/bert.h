@@ -0,0 +1,48 @@
+#ifndef _BERT_H_
+#define _BERT_H_
+
+#include <cstdint>
+#include <cstdio>
+
+#include "modem.h"
+
+#define BERT_LOCK_BITS      64      // Matching bits to be sure of sync
+#define BERT_WINDOW_BITS    64      // Bits the error rate is watched over...
+#define BERT_LOSS_ERRORS    16      // ...and errors in them that mean sync is lost
+
+// Bit error rate tester.  The modulator sends a pseudo-random bit sequence,
+// PRBS9 (x^9 + x^5 + 1) or PRBS15 (x^15 + x^14 + 1), as the data bits of
+// ordinary frames sent back to back.  The receiver loads its own generator
+// from what arrives, and once it is in step checks every bit against it.
+struct bert {
+    int order;              // 9 or 15
+    int tap;
+    uint32_t lfsr;
+    int data_bits;          // Of the sequence in each frame
+    uint64_t frame_samples; // Between frames that follow each other
+
+    // Receiver
+    bool locked;
+    int loaded;             // Bits into the generator, or matched when locking
+    uint64_t window;        // The last BERT_WINDOW_BITS bits, set where in error
+    bool seen;              // A frame has arrived
+    uint64_t last_time;     // Sample clock of the last frame
+
+    unsigned long long bits, errors;
+    unsigned long frames, frames_lost, slips;
+    unsigned long frames_bad;   // Bad parity, or found but not decoded
+};
+
+bool bert_init(bert& b, int order, const modemcfg& m);
+
+// Transmitter: the next frame's worth of the sequence, as the data
+unsigned char bert_tx(bert& b);
+
+// Receiver: every frame the demodulator finds
+void bert_rx(bert& b, const frameinfo& fi);
+
+// One line of counts at secs into the line, with the error rate since the
+// last report, which is then updated
+void bert_report(FILE *f, const bert& b, bert& last, double secs);
+
+#endif
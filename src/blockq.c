@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "blockq.h"
+
+struct blockq {
+    size_t slot_size;
+    size_t n_slots;
+    char *slots;
+    size_t *lens;
+
+    // Free-running counters, only ever written by one side each
+    _Atomic size_t head;        // Next slot to write (producer)
+    _Atomic size_t tail;        // Next slot to read (consumer)
+
+    _Atomic int sleeping;       // Consumer is (about to be) in poll
+    int efd;
+
+    _Atomic int writer_sleeping;    // Producer is waiting for a free slot
+    int space_efd;
+};
+
+struct blockq *blockq_create(size_t slot_size, size_t n_slots)
+{
+    struct blockq *q = calloc(1, sizeof(struct blockq));
+    if (!q)
+        return NULL;
+
+    q->slot_size = slot_size;
+    q->n_slots = n_slots;
+    q->slots = malloc(slot_size * n_slots);
+    q->lens = calloc(n_slots, sizeof(size_t));
+    q->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    q->space_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->sleeping, 0);
+    atomic_init(&q->writer_sleeping, 0);
+
+    if (!q->slots || !q->lens || q->efd < 0 || q->space_efd < 0) {
+        blockq_destroy(q);
+        return NULL;
+    }
+    return q;
+}
+
+void blockq_destroy(struct blockq *q)
+{
+    if (!q)
+        return;
+    if (q->efd >= 0)
+        close(q->efd);
+    if (q->space_efd >= 0)
+        close(q->space_efd);
+    free(q->slots);
+    free(q->lens);
+    free(q);
+}
+
+size_t blockq_slot_size(struct blockq *q)
+{
+    return q->slot_size;
+}
+
+void *blockq_write_slot(struct blockq *q)
+{
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (head - tail >= q->n_slots)
+        return NULL;
+    return q->slots + (head % q->n_slots) * q->slot_size;
+}
+
+void blockq_commit(struct blockq *q, size_t len)
+{
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    q->lens[head % q->n_slots] = len;
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+
+    // Only pay for the syscall if the consumer has gone to sleep
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_exchange_explicit(&q->sleeping, 0, memory_order_seq_cst))
+        blockq_wake(q);
+}
+
+void *blockq_read_slot(struct blockq *q, size_t *len)
+{
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (head == tail)
+        return NULL;
+    if (len)
+        *len = q->lens[tail % q->n_slots];
+    return q->slots + (tail % q->n_slots) * q->slot_size;
+}
+
+void blockq_release(struct blockq *q)
+{
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+
+    // As for commit, only wake a producer that is waiting for space
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_exchange_explicit(&q->writer_sleeping, 0, memory_order_seq_cst)) {
+        uint64_t one = 1;
+        if (write(q->space_efd, &one, sizeof(one)) < 0) {
+            // Counter saturated - the producer is already due to wake
+        }
+    }
+}
+
+void blockq_wait(struct blockq *q, int timeout_ms)
+{
+    atomic_store_explicit(&q->sleeping, 1, memory_order_seq_cst);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    // Re-check, in case a block was committed before the flag was seen
+    if (blockq_fill(q) == 0) {
+        struct pollfd pfd;
+        pfd.fd = q->efd;
+        pfd.events = POLLIN;
+        poll(&pfd, 1, timeout_ms);
+    }
+
+    atomic_store_explicit(&q->sleeping, 0, memory_order_relaxed);
+
+    uint64_t v;
+    if (read(q->efd, &v, sizeof(v)) < 0) {
+        // Nothing pending - fine
+    }
+}
+
+void blockq_wait_space(struct blockq *q, int timeout_ms)
+{
+    atomic_store_explicit(&q->writer_sleeping, 1, memory_order_seq_cst);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    // Re-check, in case a slot was released before the flag was seen
+    if (blockq_fill(q) >= q->n_slots) {
+        struct pollfd pfd;
+        pfd.fd = q->space_efd;
+        pfd.events = POLLIN;
+        poll(&pfd, 1, timeout_ms);
+    }
+
+    atomic_store_explicit(&q->writer_sleeping, 0, memory_order_relaxed);
+
+    uint64_t v;
+    if (read(q->space_efd, &v, sizeof(v)) < 0) {
+        // Nothing pending - fine
+    }
+}
+
+void blockq_wake(struct blockq *q)
+{
+    uint64_t one = 1;
+    if (write(q->efd, &one, sizeof(one)) < 0) {
+        // Counter saturated - the consumer is already due to wake
+    }
+}
+
+size_t blockq_fill(struct blockq *q)
+{
+    return atomic_load_explicit(&q->head, memory_order_acquire) -
+           atomic_load_explicit(&q->tail, memory_order_acquire);
+}
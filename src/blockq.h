@@ -0,0 +1,40 @@
+#ifndef _BLOCKQ_H_
+#define _BLOCKQ_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Single-producer, single-consumer queue of fixed-size blocks.  Neither side
+// ever takes a lock; the consumer can optionally sleep until a block arrives.
+struct blockq;
+
+struct blockq *blockq_create(size_t slot_size, size_t n_slots);
+void blockq_destroy(struct blockq *q);
+size_t blockq_slot_size(struct blockq *q);
+
+// Producer: get the next free slot (NULL if full), then publish it
+void *blockq_write_slot(struct blockq *q);
+void blockq_commit(struct blockq *q, size_t len);
+
+// Consumer: get the oldest block (NULL if empty), then hand it back
+void *blockq_read_slot(struct blockq *q, size_t *len);
+void blockq_release(struct blockq *q);
+
+// Consumer: sleep until there may be a block, or the timeout passes
+void blockq_wait(struct blockq *q, int timeout_ms);
+// Producer: sleep until there may be a free slot, or the timeout passes
+void blockq_wait_space(struct blockq *q, int timeout_ms);
+// Wake a sleeping consumer, e.g. to shut it down
+void blockq_wake(struct blockq *q);
+
+size_t blockq_fill(struct blockq *q);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,602 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "modem.h"
+#include "daemon.h"
+
+#define DAEMON_BLOCK        1024    // Samples demodulated at once
+#define DAEMON_MAX_EVENTS   64
+#define DAEMON_HEADER_MAX   256
+#define DAEMON_DEMOD_OUT    1024    // Output space for a demodulating session
+#define DAEMON_MAX_FRAME    32      // Longest frame we can modulate, in bits
+#define DAEMON_MAX_CACHES   16      // Waveform caches shared between sessions
+
+enum session_state {
+    SESSION_FREE,
+    SESSION_HEADER,     // Waiting for the option line
+    SESSION_DEMOD,      // PCM in, characters out
+    SESSION_MOD         // Characters in, PCM out
+};
+
+struct worker;
+
+struct session {
+    int id;
+    int fd;
+    session_state state;
+    worker *w;
+
+    char header[DAEMON_HEADER_MAX];
+    size_t header_len;
+
+    pool mem;           // Filters and output buffer come from here
+    demod d;
+    mod md;
+
+    uint8_t carry;      // First byte of a sample split across reads
+    bool have_carry;
+
+    char *outbuf;       // Output waiting to go back to the client
+    size_t out_len;
+    size_t out_pos;
+    size_t out_cap;
+    bool out_dropped;
+
+    session *next_free;
+};
+
+struct worker {
+    pthread_t thread;
+    int epfd;
+    dspbufs bufs;       // Shared by all of this worker's demodulators
+    int16_t *bufIn;
+    uint8_t *bufRead;
+};
+
+static daemoncfg cfg;
+static session *sessions = NULL;
+static session *free_sessions = NULL;
+static pthread_mutex_t sessions_mutex = PTHREAD_MUTEX_INITIALIZER;
+static worker *workers = NULL;
+static int session_count = 0;
+
+// One waveform cache per channel and frame format in use
+struct cache_slot {
+    bool forward;
+    char format[DAEMON_HEADER_MAX];
+    wavecache wc;
+};
+
+static cache_slot caches[DAEMON_MAX_CACHES];
+static int cache_count = 0;
+static pthread_mutex_t caches_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static wavecache* cache_get(bool forward, const char *format, const modemcfg& m)
+{
+    wavecache *wc = NULL;
+
+    pthread_mutex_lock(&caches_mutex);
+    for(int i=0; i<cache_count && !wc; ++i)
+        if(caches[i].forward == forward && strcmp(caches[i].format, format) == 0)
+            wc = &caches[i].wc;
+
+    if(!wc && cache_count < DAEMON_MAX_CACHES && wavecache_init(caches[cache_count].wc, m))
+    {
+        caches[cache_count].forward = forward;
+        snprintf(caches[cache_count].format, DAEMON_HEADER_MAX, "%s", format);
+        wc = &caches[cache_count++].wc;
+    }
+    pthread_mutex_unlock(&caches_mutex);
+
+    return wc;
+}
+
+static session* session_get()
+{
+    pthread_mutex_lock(&sessions_mutex);
+    session *s = free_sessions;
+    if(s)
+    {
+        free_sessions = s->next_free;
+        ++session_count;
+    }
+    pthread_mutex_unlock(&sessions_mutex);
+    return s;
+}
+
+static void session_put(session *s)
+{
+    pthread_mutex_lock(&sessions_mutex);
+    s->next_free = free_sessions;
+    free_sessions = s;
+    --session_count;
+    pthread_mutex_unlock(&sessions_mutex);
+}
+
+static void session_close(session *s)
+{
+    if(!quiet)
+        fprintf(stderr, "Session %d: closed\n", s->id);
+
+    epoll_ctl(s->w->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+    close(s->fd);
+
+    if(s->state == SESSION_DEMOD)
+        demod_free(s->d);
+
+    s->state = SESSION_FREE;
+    s->fd = -1;
+    session_put(s);
+}
+
+static void session_watch(session *s, uint32_t events)
+{
+    epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = s;
+    epoll_ctl(s->w->epfd, EPOLL_CTL_MOD, s->fd, &ev);
+}
+
+static void session_put_char(void *ctx, char c)
+{
+    session *s = (session*)ctx;
+
+    if(s->out_len >= s->out_cap)
+    {
+        if(!s->out_dropped)
+            fprintf(stderr, "Session %d: client not reading, dropping output\n", s->id);
+        s->out_dropped = true;
+        return;
+    }
+    s->outbuf[s->out_len++] = c;
+}
+
+static void session_carrier(void *ctx, bool on)
+{
+    session *s = (session*)ctx;
+    if(debug > 0)
+        fprintf(stderr, "Session %d: carrier %s\n", s->id, on ? "detected" : "lost");
+}
+
+// Send what we can; returns false if the session has gone
+static bool session_flush(session *s)
+{
+    while(s->out_pos < s->out_len)
+    {
+        ssize_t n = send(s->fd, s->outbuf + s->out_pos, s->out_len - s->out_pos,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(n < 0)
+        {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // Stop reading until the client catches up
+                session_watch(s, EPOLLOUT);
+                return true;
+            }
+            return false;
+        }
+        s->out_pos += n;
+    }
+
+    if(s->out_len > 0)
+    {
+        s->out_len = 0;
+        s->out_pos = 0;
+        s->out_dropped = false;
+        session_watch(s, EPOLLIN);
+    }
+    return true;
+}
+
+static void session_error(session *s, const char *msg)
+{
+    fprintf(stderr, "Session %d: %s\n", s->id, msg);
+    char buf[DAEMON_HEADER_MAX];
+    int n = snprintf(buf, sizeof(buf), "Error: %s\n", msg);
+    send(s->fd, buf, n, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+// The option line uses the same flags as the command line, e.g.
+//   -md -cf -f10dddddddP1 -e?
+static bool session_start(session *s, char *line)
+{
+    bool demodulate = true;
+    bool forward = false;
+    char errchar = cfg.errchar;
+    const char *frame_format = cfg.frame_format;
+
+    char *save;
+    for(char *arg = strtok_r(line, " \t\r\n", &save); arg; arg = strtok_r(NULL, " \t\r\n", &save))
+    {
+        if(arg[0] != '-')
+        {
+            session_error(s, "options must start with '-'");
+            return false;
+        }
+        switch(arg[1])
+        {
+            case 'm':
+                if(arg[2] != 'm' && arg[2] != 'd')
+                {
+                    session_error(s, "use -mm to modulate or -md to demodulate");
+                    return false;
+                }
+                demodulate = (arg[2] == 'd');
+                break;
+            case 'c':
+                if(arg[2] != 'f' && arg[2] != 'b')
+                {
+                    session_error(s, "use -cf for forward or -cb for backward channel");
+                    return false;
+                }
+                forward = (arg[2] == 'f');
+                break;
+            case 'f':
+                frame_format = &arg[2];
+                break;
+            case 'e':
+                errchar = arg[2];
+                break;
+            default:
+                session_error(s, "unknown session option");
+                return false;
+        }
+    }
+
+    modemcfg m;
+    if(!init_framefmt(m.ff, frame_format, 1) || m.ff.frame_size > DAEMON_MAX_FRAME)
+    {
+        session_error(s, "invalid frame format");
+        return false;
+    }
+    init_channel(m, forward, cfg.sample_rate, &cfg.prof->chan[forward ? 1 : 0]);
+    m.errchar = errchar;
+    m.gate_level = cfg.gate_level;
+
+    pool_reset(s->mem);
+    if(demodulate)
+    {
+        if(!demod_init(s->d, m, &s->w->bufs, &s->mem))
+        {
+            session_error(s, "failed to set up the demodulator");
+            return false;
+        }
+        s->d.put_char = session_put_char;
+        s->d.ctx = s;
+        s->d.carrier_event = session_carrier;
+        s->state = SESSION_DEMOD;
+    }
+    else
+    {
+        mod_init(s->md, m, cache_get(forward, frame_format, m));
+        s->state = SESSION_MOD;
+    }
+
+    // Whatever is left of the pool buffers the output
+    s->outbuf  = s->mem.base + s->mem.used;
+    s->out_cap = s->mem.size - s->mem.used;
+    s->out_len = 0;
+    s->out_pos = 0;
+    s->out_dropped = false;
+    s->have_carry = false;
+
+    if(!quiet)
+        fprintf(stderr, "Session %d: %s the %s channel, format %s\n", s->id,
+                demodulate ? "demodulating" : "modulating",
+                forward ? "FORWARD" : "BACKWARD", frame_format);
+    return true;
+}
+
+// Read the option line a byte at a time, so none of the stream behind it
+// is consumed
+static bool session_read_header(session *s)
+{
+    for(;;)
+    {
+        char c;
+        ssize_t n = recv(s->fd, &c, 1, 0);
+        if(n == 0) return false;
+        if(n < 0) return errno == EAGAIN || errno == EINTR;
+
+        if(c == '\n')
+        {
+            s->header[s->header_len] = '\0';
+            return session_start(s, s->header);
+        }
+
+        if(s->header_len >= sizeof(s->header) - 1)
+        {
+            session_error(s, "option line too long");
+            return false;
+        }
+        s->header[s->header_len++] = c;
+    }
+}
+
+static bool session_read(session *s)
+{
+    worker *w = s->w;
+
+    if(s->state == SESSION_HEADER)
+        return session_read_header(s);
+
+    size_t cap;
+    if(s->state == SESSION_DEMOD)
+        cap = DAEMON_BLOCK * sizeof(int16_t) - (s->have_carry ? 1 : 0);
+    else
+    {
+        // Only take as many characters as we have room to modulate
+        size_t frame_bytes = s->md.m.ff.frame_size * s->md.m.samples_per_bit * sizeof(int16_t);
+        cap = (s->out_cap - s->out_len) / frame_bytes;
+        if(cap == 0) return true;
+    }
+
+    ssize_t n = recv(s->fd, w->bufRead, cap, 0);
+    if(n == 0) return false;
+    if(n < 0) return errno == EAGAIN || errno == EINTR;
+
+    if(s->state == SESSION_DEMOD)
+    {
+        uint8_t *p = w->bufRead;
+        size_t left = n;
+        uint8_t *dst = (uint8_t*)w->bufIn;
+
+        if(s->have_carry)
+        {
+            *dst++ = s->carry;
+            s->have_carry = false;
+        }
+        memcpy(dst, p, left);
+        size_t bytes = (dst - (uint8_t*)w->bufIn) + left;
+        if(bytes & 1)
+        {
+            s->carry = ((uint8_t*)w->bufIn)[bytes - 1];
+            s->have_carry = true;
+        }
+
+        demod_process(s->d, w->bufIn, bytes / sizeof(int16_t));
+    }
+    else
+    {
+        size_t frame_bytes = s->md.m.ff.frame_size * s->md.m.samples_per_bit * sizeof(int16_t);
+        for(ssize_t i=0; i<n; ++i)
+        {
+            mod_get_frame_samples(s->md, w->bufRead[i], (int16_t*)(s->outbuf + s->out_len));
+            s->out_len += frame_bytes;
+        }
+    }
+
+    return session_flush(s);
+}
+
+static void* worker_run(void *arg)
+{
+    worker *w = (worker*)arg;
+    epoll_event events[DAEMON_MAX_EVENTS];
+
+    while(!quit)
+    {
+        int n = epoll_wait(w->epfd, events, DAEMON_MAX_EVENTS, 200);
+        if(n < 0)
+        {
+            if(errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for(int i=0; i<n; ++i)
+        {
+            session *s = (session*)events[i].data.ptr;
+            bool ok = true;
+
+            if(events[i].events & EPOLLOUT)
+                ok = session_flush(s);
+            else if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                ok = session_read(s);
+
+            if(!ok)
+                session_close(s);
+        }
+    }
+
+    return NULL;
+}
+
+// Largest pool any one session can need
+static size_t session_pool_size(int sample_rate)
+{
+    modemcfg f, b;
+    init_channel(f, true,  sample_rate, &cfg.prof->chan[1]);
+    init_channel(b, false, sample_rate, &cfg.prof->chan[0]);
+
+    f.gate_level = b.gate_level = cfg.gate_level;
+    size_t filters = demod_size(f, DAEMON_BLOCK) > demod_size(b, DAEMON_BLOCK) ?
+                     demod_size(f, DAEMON_BLOCK) : demod_size(b, DAEMON_BLOCK);
+    size_t frame = DAEMON_MAX_FRAME * b.samples_per_bit * sizeof(int16_t);
+    return filters + (frame > DAEMON_DEMOD_OUT ? frame : DAEMON_DEMOD_OUT);
+}
+
+static int listen_unix(const char *path)
+{
+    sockaddr_un addr;
+    if(strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if(bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0)
+    {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void daemon_free()
+{
+    if(workers)
+    {
+        for(int i=0; i<cfg.workers; ++i)
+        {
+            if(workers[i].epfd >= 0) close(workers[i].epfd);
+            dspbufs_free(workers[i].bufs);
+            free(workers[i].bufIn);
+            free(workers[i].bufRead);
+        }
+        free(workers);
+        workers = NULL;
+    }
+    for(int i=0; i<cache_count; ++i)
+        wavecache_free(caches[i].wc);
+    cache_count = 0;
+
+    if(sessions)
+    {
+        for(int i=0; i<cfg.max_sessions; ++i)
+            pool_free(sessions[i].mem);
+        free(sessions);
+        sessions = NULL;
+    }
+}
+
+bool daemon_run(const daemoncfg& c)
+{
+    cfg = c;
+    if(cfg.workers < 1)
+        cfg.workers = 1;
+
+    // Sessions are allocated up front, so a busy daemon never goes to malloc
+    size_t pool_size = session_pool_size(cfg.sample_rate);
+    sessions = (session*)calloc(cfg.max_sessions, sizeof(session));
+    workers  = (worker*)calloc(cfg.workers, sizeof(worker));
+    if(!sessions || !workers)
+    {
+        fprintf(stderr, "Failed to allocate sessions\n");
+        daemon_free();
+        return false;
+    }
+    for(int i=cfg.max_sessions-1; i>=0; --i)
+    {
+        session *s = &sessions[i];
+        s->id = i;
+        s->fd = -1;
+        s->state = SESSION_FREE;
+        if(!pool_init(s->mem, pool_size))
+        {
+            fprintf(stderr, "Failed to allocate session pool\n");
+            daemon_free();
+            return false;
+        }
+        s->next_free = free_sessions;
+        free_sessions = s;
+    }
+    for(int i=0; i<cfg.workers; ++i)
+    {
+        worker *w = &workers[i];
+        w->epfd    = epoll_create1(0);
+        w->bufIn   = make_buffer(DAEMON_BLOCK);
+        w->bufRead = (uint8_t*)malloc(DAEMON_BLOCK * sizeof(int16_t));
+        if(w->epfd < 0 || !w->bufIn || !w->bufRead || !dspbufs_init(w->bufs, DAEMON_BLOCK))
+        {
+            fprintf(stderr, "Failed to set up worker %d\n", i);
+            daemon_free();
+            return false;
+        }
+    }
+
+    int lfd = listen_unix(cfg.sock_path);
+    if(lfd < 0)
+    {
+        daemon_free();
+        return false;
+    }
+
+    for(int i=0; i<cfg.workers; ++i)
+        pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+
+    if(!quiet)
+        fprintf(stderr, "Listening on %s: %d workers, %d sessions, %ld bytes per session\n",
+                cfg.sock_path, cfg.workers, cfg.max_sessions, pool_size);
+
+    int next_worker = 0;
+    while(!quit)
+    {
+        pollfd pfd;
+        pfd.fd = lfd;
+        pfd.events = POLLIN;
+        if(poll(&pfd, 1, 200) <= 0)
+            continue;
+
+        int fd = accept(lfd, NULL, NULL);
+        if(fd < 0)
+            continue;
+
+        session *s = session_get();
+        if(!s)
+        {
+            fprintf(stderr, "Session pool exhausted, refusing connection\n");
+            close(fd);
+            continue;
+        }
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        s->fd = fd;
+        s->state = SESSION_HEADER;
+        s->header_len = 0;
+        s->w = &workers[next_worker];
+        next_worker = (next_worker + 1) % cfg.workers;
+
+        if(debug > 0)
+            fprintf(stderr, "Session %d: connected (%d active)\n", s->id, session_count);
+
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = s;
+        if(epoll_ctl(s->w->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        {
+            perror("epoll_ctl");
+            close(fd);
+            s->state = SESSION_FREE;
+            session_put(s);
+        }
+    }
+
+    for(int i=0; i<cfg.workers; ++i)
+        pthread_join(workers[i].thread, NULL);
+
+    for(int i=0; i<cfg.max_sessions; ++i)
+        if(sessions[i].state != SESSION_FREE)
+            session_close(&sessions[i]);
+
+    close(lfd);
+    unlink(cfg.sock_path);
+    daemon_free();
+
+    return true;
+}
@@ -0,0 +1,19 @@
+#ifndef _DAEMON_H_
+#define _DAEMON_H_
+
+#include "profile.h"
+
+struct daemoncfg {
+    const char *sock_path;      // Unix socket to listen on
+    int sample_rate;
+    int workers;                // Worker threads sessions are spread across
+    int max_sessions;           // Size of the session pool
+    const char *frame_format;   // Defaults for sessions that don't say
+    char errchar;
+    int gate_level;             // Carrier detect level, 0 for none
+    const profile *prof;        // Tuning for each channel
+};
+
+bool daemon_run(const daemoncfg& cfg);
+
+#endif
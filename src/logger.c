@@ -0,0 +1,408 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "blockq.h"
+#include "logger.h"
+
+#define LOG_MAX_THREADS 64
+#define LOG_QUEUE_LEN   16384   // Records each thread can have waiting
+#define LOG_POLL_MS     10      // Writer's sleep when every queue is empty
+#define LOG_OUT_BYTES   65536   // Formatted text gathered for each write
+#define LOG_RT_QUEUES   4       // Made up front, for real-time threads
+
+union logarg {
+    long long i;
+    double f;
+};
+
+struct logrec {
+    uint64_t seq;               // Keeps the threads' messages in order
+    const struct logsite *site;
+    uint32_t suppressed;
+    union logarg args[LOG_MAX_ARGS];
+};
+
+static struct blockq *_Atomic queues[LOG_MAX_THREADS];
+static atomic_int n_queues;
+static _Thread_local struct blockq *my_queue = NULL;
+static _Thread_local bool my_queue_failed = false;
+static _Thread_local bool my_realtime = false;
+
+// Real-time threads take one of these rather than allocating their own
+static struct blockq *rt_queues[LOG_RT_QUEUES];
+static atomic_int n_rt_queues;
+
+static atomic_bool log_running = false;
+static atomic_bool log_quit;
+static atomic_ulong log_seq;
+static atomic_ulong log_dropped;    // Records a full queue couldn't take
+static atomic_ulong log_suppressed; // Messages over the rate limit
+static int log_rate;
+static pthread_t log_thread;
+
+static char out[LOG_OUT_BYTES];
+static size_t out_len = 0;
+
+static void flush_out()
+{
+    const char *p = out;
+    while (out_len > 0) {
+        ssize_t n = write(2, p, out_len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;      // Nowhere to report it
+        }
+        p += n;
+        out_len -= n;
+    }
+    out_len = 0;
+}
+
+static void put_text(const char *fmt, ...)
+{
+    if (out_len > LOG_OUT_BYTES / 2)
+        flush_out();
+
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(out + out_len, LOG_OUT_BYTES - out_len, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        out_len += ((size_t)n < LOG_OUT_BYTES - out_len) ? (size_t)n : LOG_OUT_BYTES - out_len - 1;
+}
+
+// Length of the conversion at fmt[0] == '%', and the kind of argument it
+// takes: 'i' int, 'l' long, 'L' long long, 'f' double, '%' none, 0 if it
+// isn't one that can be logged
+static size_t conversion(const char *fmt, char *kind)
+{
+    size_t i = 1;
+    while (fmt[i] && strchr("-+ #0", fmt[i]))
+        ++i;
+    while (fmt[i] >= '0' && fmt[i] <= '9')
+        ++i;
+    if (fmt[i] == '.') {
+        ++i;
+        while (fmt[i] >= '0' && fmt[i] <= '9')
+            ++i;
+    }
+
+    char size = 'i';
+    if (fmt[i] == 'h') {
+        ++i;
+        if (fmt[i] == 'h')
+            ++i;
+    } else if (fmt[i] == 'l') {
+        ++i;
+        size = 'l';
+        if (fmt[i] == 'l') {
+            ++i;
+            size = 'L';
+        }
+    } else if (fmt[i] && strchr("zjt", fmt[i])) {
+        ++i;
+        size = 'l';
+    }
+
+    char c = fmt[i];
+    if (c == '%' && i == 1)
+        *kind = '%';
+    else if (c && strchr("diouxXc", c))
+        *kind = size;
+    else if (c && strchr("eEfFgGaA", c) && size == 'i')
+        *kind = 'f';
+    else
+        *kind = 0;
+    return c ? i + 1 : i;
+}
+
+// Work out the arguments a format takes, once for each site
+static void site_init(struct logsite *site, const char *fmt)
+{
+    int n = 0;
+    for (const char *p = fmt; *p; ) {
+        if (*p != '%') {
+            ++p;
+            continue;
+        }
+        char kind;
+        p += conversion(p, &kind);
+        if (kind == '%')
+            continue;
+        if (kind == 0 || n == LOG_MAX_ARGS) {
+            n = -1;     // Logged as just the format
+            break;
+        }
+        site->kinds[n++] = kind;
+    }
+    site->n_args = n;
+    site->fmt = fmt;
+    __atomic_store_n(&site->ready, 1, __ATOMIC_RELEASE);
+}
+
+static void format_rec(const struct logrec *r)
+{
+    const struct logsite *site = r->site;
+    const char *fmt = site->fmt;
+
+    if (r->suppressed)
+        put_text("(%u more like the next suppressed)\n", r->suppressed);
+
+    if (site->n_args < 0) {
+        put_text("%s", fmt);
+        return;
+    }
+
+    // Each conversion on its own, with the argument as the type it wants
+    int a = 0;
+    const char *p = fmt;
+    while (*p) {
+        const char *pc = strchr(p, '%');
+        if (!pc) {
+            put_text("%s", p);
+            break;
+        }
+        if (pc > p)
+            put_text("%.*s", (int)(pc - p), p);
+
+        char kind, spec[32];
+        size_t len = conversion(pc, &kind);
+        if (len >= sizeof(spec))
+            len = sizeof(spec) - 1;
+        memcpy(spec, pc, len);
+        spec[len] = 0;
+
+        switch (kind) {
+            case '%': put_text("%%"); break;
+            case 'i': put_text(spec, (int)r->args[a++].i); break;
+            case 'l': put_text(spec, (long)r->args[a++].i); break;
+            case 'L': put_text(spec, r->args[a++].i); break;
+            case 'f': put_text(spec, r->args[a++].f); break;
+        }
+        p = pc + len;
+    }
+}
+
+// Oldest waiting record over all the queues, by sequence number
+static struct blockq *oldest(struct logrec **rec)
+{
+    struct blockq *best = NULL;
+    int n = atomic_load(&n_queues);
+    if (n > LOG_MAX_THREADS)
+        n = LOG_MAX_THREADS;
+
+    for (int i = 0; i < n; ++i) {
+        struct blockq *q = atomic_load(&queues[i]);
+        if (!q)
+            continue;
+        struct logrec *r = blockq_read_slot(q, NULL);
+        if (r && (!best || r->seq < (*rec)->seq)) {
+            best = q;
+            *rec = r;
+        }
+    }
+    return best;
+}
+
+static void *log_writer(void *arg)
+{
+    (void)arg;
+    unsigned long reported = 0;
+    bool quitting = false;
+
+    for (;;) {
+        struct logrec *r = NULL;
+        struct blockq *q = oldest(&r);
+        if (!q) {
+            flush_out();
+
+            unsigned long dropped = atomic_load(&log_dropped);
+            if (dropped != reported) {
+                fprintf(stderr, "Log: dropped %lu debug messages (%lu in total)\n",
+                        dropped - reported, dropped);
+                reported = dropped;
+            }
+
+            // Once log_quit is seen, one more pass over the queues picks up
+            // anything committed just before it was set
+            if (quitting)
+                break;
+            if (atomic_load(&log_quit)) {
+                quitting = true;
+                continue;
+            }
+            struct timespec ts = { 0, LOG_POLL_MS * 1000000 };
+            nanosleep(&ts, NULL);
+            continue;
+        }
+
+        format_rec(r);
+        blockq_release(q);
+    }
+    return NULL;
+}
+
+// A forked child has no writer thread: it prints its messages itself
+static void logger_forked()
+{
+    atomic_store(&log_running, false);
+}
+
+bool logger_start(int max_rate)
+{
+    log_rate = max_rate;
+    atomic_init(&log_quit, false);
+    atomic_init(&log_seq, 0);
+    atomic_init(&log_dropped, 0);
+    atomic_init(&log_suppressed, 0);
+    atomic_init(&n_rt_queues, 0);
+
+    for (int i = 0; i < LOG_RT_QUEUES; ++i)
+        rt_queues[i] = blockq_create(sizeof(struct logrec), LOG_QUEUE_LEN);
+
+    if (pthread_create(&log_thread, NULL, log_writer, NULL))
+        return false;
+
+    atomic_store(&log_running, true);
+    pthread_atfork(NULL, NULL, logger_forked);
+    atexit(logger_stop);
+    return true;
+}
+
+void logger_realtime()
+{
+    my_realtime = true;
+}
+
+// This thread's queue, made on its first message - or for a real-time thread,
+// one of those made up front
+static struct blockq *get_queue()
+{
+    if (my_queue || my_queue_failed)
+        return my_queue;
+
+    struct blockq *q = NULL;
+    if (my_realtime) {
+        int k = atomic_fetch_add(&n_rt_queues, 1);
+        if (k < LOG_RT_QUEUES)
+            q = rt_queues[k];
+    }
+
+    int i = atomic_fetch_add(&n_queues, 1);
+    if (i < LOG_MAX_THREADS)
+        my_queue = my_realtime ? q : blockq_create(sizeof(struct logrec), LOG_QUEUE_LEN);
+    if (!my_queue) {
+        my_queue_failed = true;
+        if (!my_realtime)
+            fprintf(stderr, "Log: no queue for a thread, its debug messages are lost\n");
+        return NULL;
+    }
+    atomic_store(&queues[i], my_queue);
+    return my_queue;
+}
+
+// Lets through max_rate messages a second from a site, and counts the rest.
+// Threads sharing a site may race on the counts, which only makes the limit
+// approximate.
+static bool rate_ok(struct logsite *site, uint32_t *suppressed)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+    uint64_t now = ts.tv_sec;
+    if (__atomic_load_n(&site->window, __ATOMIC_RELAXED) != now) {
+        __atomic_store_n(&site->window, now, __ATOMIC_RELAXED);
+        __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+    }
+    if (__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED) > (uint32_t)log_rate) {
+        __atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+        atomic_fetch_add_explicit(&log_suppressed, 1, memory_order_relaxed);
+        return false;
+    }
+    *suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+    return true;
+}
+
+void logger_put(struct logsite *site, const char *fmt, ...)
+{
+    va_list ap;
+
+    // Before the writer starts or after it stops, just print it
+    if (!atomic_load_explicit(&log_running, memory_order_acquire)) {
+        va_start(ap, fmt);
+        vfprintf(stderr, fmt, ap);
+        va_end(ap);
+        return;
+    }
+
+    if (!__atomic_load_n(&site->ready, __ATOMIC_ACQUIRE))
+        site_init(site, fmt);
+
+    uint32_t suppressed = 0;
+    if (log_rate > 0 && !rate_ok(site, &suppressed))
+        return;
+
+    struct blockq *q = get_queue();
+    struct logrec *r = q ? blockq_write_slot(q) : NULL;
+
+    // Without a rate limit every message counts, so wait for the writer -
+    // unless this thread mustn't be held up
+    while (!r && q && log_rate == 0 && !my_realtime) {
+        blockq_wait_space(q, LOG_POLL_MS);
+        r = blockq_write_slot(q);
+    }
+    if (!r) {
+        atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    r->seq = atomic_fetch_add_explicit(&log_seq, 1, memory_order_relaxed);
+    r->site = site;
+    r->suppressed = suppressed;
+
+    va_start(ap, fmt);
+    for (int i = 0; i < site->n_args; ++i) {
+        switch (site->kinds[i]) {
+            case 'i': r->args[i].i = va_arg(ap, int); break;
+            case 'l': r->args[i].i = va_arg(ap, long); break;
+            case 'L': r->args[i].i = va_arg(ap, long long); break;
+            case 'f': r->args[i].f = va_arg(ap, double); break;
+        }
+    }
+    va_end(ap);
+
+    blockq_commit(q, sizeof(*r));
+}
+
+// Write out whatever is queued, then stop
+void logger_stop()
+{
+    if (!atomic_exchange(&log_running, false))
+        return;
+
+    atomic_store(&log_quit, true);
+    pthread_join(log_thread, NULL);
+
+    unsigned long suppressed = atomic_load(&log_suppressed);
+    if (suppressed)
+        fprintf(stderr, "Log: %lu debug messages over the rate limit in total\n", suppressed);
+
+    int n = atomic_load(&n_queues);
+    for (int i = 0; i < n && i < LOG_MAX_THREADS; ++i) {
+        blockq_destroy(atomic_load(&queues[i]));
+        atomic_store(&queues[i], NULL);
+    }
+
+    // Those never taken
+    for (int i = atomic_load(&n_rt_queues); i < LOG_RT_QUEUES; ++i)
+        blockq_destroy(rt_queues[i]);
+}
@@ -0,0 +1,66 @@
+#ifndef _LOGGER_H_
+#define _LOGGER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Debug messages from the hot paths.  Rather than formatting and writing each
+// one where it happens, the format and its arguments go as a binary record
+// into a lock-free queue of the calling thread's own, and a background thread
+// formats them and writes them to STDERR.  A queue only fills up if messages
+// come faster than they can be written for a good while: then the thread waits
+// for room, unless there's a rate limit, when they are dropped and counted so
+// that decoding is never held up.
+//
+// Arguments are integers (int, char, long, size_t...) or doubles, as given by
+// the conversions in the format - up to LOG_MAX_ARGS of them, and no strings.
+
+#define LOG_MAX_ARGS    4
+
+// Messages above this level are compiled out altogether - see LOG_LEVEL in
+// the Makefile
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL   4
+#endif
+
+// Filled in from the format on first use, and where the rate limit is kept
+struct logsite {
+    const char *fmt;
+    int ready;
+    int n_args;
+    char kinds[LOG_MAX_ARGS];
+    uint64_t window;        // Second the count is for
+    uint32_t count;         // Messages in it
+    uint32_t suppressed;    // Held back since the last one that went out
+};
+
+// Log a message at a debug level: shown with that many -d options (debug,
+// from modem.h)
+#define LOG(level, ...) do { \
+    if ((level) <= LOG_MAX_LEVEL && debug >= (level)) { \
+        static struct logsite log_site_; \
+        logger_put(&log_site_, __VA_ARGS__); \
+    } \
+} while (0)
+
+// max_rate limits each message to that many a second, 0 for no limit (and no
+// dropping)
+bool logger_start(int max_rate);
+void logger_put(struct logsite *site, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void logger_stop();
+
+// Mark the calling thread as real-time, such as an audio callback: its
+// messages never wait for room or allocate a queue, and are dropped and
+// counted instead
+void logger_realtime();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,1721 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+
+#include "modem.h"
+#include "logger.h"
+
+#define EDGE_BLOCK  16      // Samples checked at once for timing edges
+
+int16_t *sinebuf;
+size_t sinelen;
+
+bool pool_init(pool& p, size_t size)
+{
+  p.base = (char*)calloc(size, 1);
+  if(!p.base) return false;
+
+  p.size = size;
+  p.used = 0;
+
+  return true;
+}
+
+void pool_reset(pool& p)
+{
+  p.used = 0;
+}
+
+void pool_free(pool& p)
+{
+  free(p.base);
+  p.base = NULL;
+  p.size = 0;
+  p.used = 0;
+}
+
+// Round up so every pool allocation stays nicely aligned
+static size_t pool_round(size_t bytes)
+{
+  return (bytes + 15) & ~(size_t)15;
+}
+
+int16_t* make_buffer(size_t N, pool *p)
+{
+  if(!p)
+    return (int16_t*)calloc(N, sizeof(int16_t));
+
+  size_t bytes = pool_round(N * sizeof(int16_t));
+  if(p->used + bytes > p->size) return NULL;
+
+  int16_t *buf = (int16_t*)(p->base + p->used);
+  memset(buf, 0, bytes);
+  p->used += bytes;
+
+  return buf;
+}
+
+bool sin_init(float amplitude, size_t N)
+{
+  sinebuf = make_buffer(N);
+  if(!sinebuf) return false;
+
+  sinelen = N;
+
+  for(size_t i=0; i<N; ++i)
+  {
+    double x = 2.0 * M_PI * (double)i / (double)N;
+    sinebuf[i] = (int16_t)(amplitude * sin(x));
+  }
+
+  return true;
+}
+
+void sin_get_samples(int& p, int freqhz, int16_t *samples_out, size_t n_samples)
+{
+  for(size_t i=0; i<n_samples; ++i)
+  {
+    samples_out[i] = sinebuf[p];
+
+    p += freqhz;
+    while((size_t)p >= sinelen) p -= sinelen;
+  }
+}
+
+void maf_process(maf& maf, int16_t *samples_in, int16_t *samples_out,
+  size_t n_samples, bool nodivide)
+{
+  for(size_t i=0; i<n_samples; ++i)
+  {
+    maf.sum        -= maf.buf[maf.p];
+    maf.buf[maf.p] =  samples_in[i];
+    maf.sum        += maf.buf[maf.p];
+
+    if(nodivide)
+    {
+        if(maf.sum > 32767) samples_out[i]=32767;
+        else if(maf.sum < -32767) samples_out[i]=-32767;
+        else samples_out[i] = maf.sum;
+    }
+    else
+        samples_out[i] = ( maf.sum + (int32_t)maf.N/2 ) / (int32_t)maf.N;
+
+    ++maf.p;
+    if(maf.p >= maf.N) maf.p -= maf.N;
+  }
+}
+
+void osc_get_samples(osc& o, int16_t *samples_out, size_t n_samples)
+{
+    // Note: getting samples increments the phase variable
+    sin_get_samples(o.p, o.freqhz, samples_out, n_samples);
+}
+
+void osc_get_complex_samples(osc& o, int16_t *i_samples_out, int16_t *q_samples_out,
+  size_t n_samples)
+{
+  int& q=o.p;                  // This is the Q phase variable (sine)
+  int  i=(o.p + sinelen / 4) % sinelen;    // The I phase variable is always a quarter wave ahead of Q (cosine)
+
+  // Note: getting samples increments the phase variable
+  sin_get_samples(i, o.freqhz, i_samples_out, n_samples);
+  sin_get_samples(q, o.freqhz, q_samples_out, n_samples);
+}
+
+bool maf_init(maf& maf, size_t N, pool *p)
+{
+  maf.buf = make_buffer(N, p);
+  if(!maf.buf) return false;
+
+  maf.N   = N;
+  maf.p   = 0;
+  maf.sum = 0;
+
+  return true;
+}
+
+void mul_samples(int16_t *samples_a, int16_t *samples_b,
+  int16_t *samples_out, size_t n_samples)
+{
+  for(size_t i=0; i<n_samples; ++i)
+  {
+    int32_t product = ((int32_t)samples_a[i] * (int32_t)samples_b[i]) / (int32_t)32768;
+    if(product >  32767)
+    {
+        fprintf(stderr, "mul: clipped\n");
+        product =  32767;
+    }
+    else if(product < -32767)
+    {
+        fprintf(stderr, "mul: clipped\n");
+        product = -32767;
+    }
+    samples_out[i] = (int16_t)product;
+  }
+}
+
+//NB: Halves magnitude
+void sub_samples(int16_t *samples_a, int16_t *samples_b,
+  int16_t *samples_out, size_t n_samples)
+{
+  for(size_t i=0; i<n_samples; ++i)
+  {
+    samples_out[i] = ( samples_a[i]/2 - samples_b[i]/2 );
+  }
+}
+
+void deriv_samples(differentiator& d, int16_t *samples_in, int16_t *samples_out, size_t n_samples)
+{
+    int16_t last = d.last;
+    for(size_t i=0; i<n_samples; ++i)
+    {
+        samples_out[i] = samples_in[i] - last;
+        last = samples_in[i];
+    }
+    d.last = last;
+}
+
+void sgn_samples(int16_t *samples_in, int16_t *samples_out, size_t n_samples)
+{
+  for(size_t i=0; i<n_samples; ++i)
+  {
+    samples_out[i] = ( samples_in[i] > 0 ) - ( samples_in[i] < 0 );
+  }
+}
+
+void mag_complex_samples(int16_t *samples_i, int16_t *samples_q,
+  int16_t *samples_out, size_t n_samples)
+{
+  for(size_t i=0; i<n_samples; ++i)
+  {
+    // Fast vector magnitude calculation
+    // http://www.embedded.com/design/real-time-and-performance/4007218/Digital-Signal-Processing-Tricks--High-speed-vector-magnitude-approximation
+    int32_t x, y, max, min, mag;
+    x = samples_i[i];
+    y = samples_q[i];
+
+    x = (x < 0) ? -x : x;
+    y = (y < 0) ? -y : y;
+
+    max = (x > y) ? x : y;
+    min = (x < y) ? x : y;
+
+    mag = ( 15 * (max + min / 2) ) / 16;
+
+    if(mag >  32767)
+    {
+        fprintf(stderr, "mag: clipped\n");
+        samples_out[i] = 32767;
+    }
+    else
+        samples_out[i] = mag;
+  }
+}
+
+void ang_complex_samples(int16_t *samples_i, int16_t *samples_q,
+  int16_t *samples_out, size_t n_samples)
+{
+    for(size_t i=0; i<n_samples; ++i)
+    {
+        // Hacky inverse tangent approximation
+        // Taken from my Wheeliebot guidance code
+        int32_t x, y, abs_x, abs_y, angle;
+        x = samples_i[i];
+        y = samples_q[i];
+
+        if(x==0 && y==0)
+        {
+            samples_out[i] = 0;
+            continue;
+        }
+
+        // NOTE: Output phase units are 1/65536 revolution,
+        // i.e. output variable overflows once per cycle
+        abs_x = (x < 0) ? -x : x;
+        abs_y = (y < 0) ? -y : y;
+
+        if(abs_x > abs_y)
+        {
+            angle = (8192 * y) / x;
+            if(x < 0) angle += 32768;
+        }
+        else
+        {
+            angle = 16384 - (8192 * x) / y;
+            if(y < 0) angle += 32768;
+        }
+
+        samples_out[i] = angle;
+    }
+}
+
+void disc_complex_samples(discriminator& d, int16_t *samples_i, int16_t *samples_q,
+  int16_t *samples_out, size_t n_samples)
+{
+    int32_t last_i = d.last_i, last_q = d.last_q;
+    for(size_t i=0; i<n_samples; ++i)
+    {
+        int32_t x = samples_i[i], y = samples_q[i];
+        int64_t cross = (int64_t)last_i * y - (int64_t)last_q * x;
+        samples_out[i] = (cross > 0) ? d.step : (cross < 0) ? -d.step : 0;
+        last_i = x;
+        last_q = y;
+    }
+    d.last_i = last_i;
+    d.last_q = last_q;
+}
+
+// Parity of some data - returns true if an odd number of bits are set
+bool parity(unsigned int v){
+    // http://graphics.stanford.edu/~seander/bithacks.html#ParityWith64Bits
+    v ^= v >> 1;
+    v ^= v >> 2;
+    v = (v & 0x11111111U) * 0x11111111U;
+    return ((v >> 28) & 1) != 0;
+}
+
+// Note: Overlap of 1 allows checking for previous stop / idle bit
+bool init_framefmt(framefmt& ff, const char* fmt, int overlap)
+{
+    // Set up frame constants
+    ff.frame_pattern = 0;
+    ff.frame_mask    = 0;
+    ff.parity_mask   = 0;
+    ff.parity_enable = false;
+    ff.parity_even   = false;
+    ff.data_offset = 0;
+    ff.data_mask  = 0;
+    ff.data_size  = 0;
+    ff.frame_size = -overlap;
+    ff.lsb_first  = true;
+    for(size_t i=0; fmt[i] != '\0'; ++i)
+    {
+        char c = fmt[i];
+        ff.frame_mask    <<= 1;
+        ff.frame_pattern <<= 1;
+        ff.parity_mask   <<= 1;
+        ff.data_mask     <<= 1;
+        ++ff.data_offset;
+        ++ff.frame_size;
+
+        switch(c)
+        {
+            case '1':
+                ff.frame_mask    |= 1;
+                ff.frame_pattern |= 1;
+                break;
+            case '0':
+                ff.frame_mask    |= 1;
+                ff.frame_pattern |= 0;
+                break;
+            case 'd':
+            case 'D':
+                ff.data_mask   |= 1;
+                ff.data_offset = 0;
+                ++ff.data_size;
+                ff.lsb_first = (c == 'd');
+                break;
+            case 'p':
+            case 'P':
+                ff.parity_mask   |= 1;
+                ff.parity_enable = true;
+                ff.parity_even = (c == 'P');
+                break;
+            default:
+                fprintf(stderr, "Invalid frame format specifier in %s: %c\n", fmt, c);
+                return false;
+        }
+    }
+
+    return true;
+}
+
+// Note: This is a nasty function
+uint64_t bin_as_octal(uint32_t w)
+{
+    uint64_t d=0;
+
+    for(int i=0; i<32; ++i)
+    {
+        d <<= 3;
+        if(w & 0x80000000) ++d;
+        w <<= 1;
+    }
+
+    return d;
+}
+
+void init_modemcfg(modemcfg& m, int mark, int space, int firstnull, int samplerate, int baudrate, float skew_limit) {
+    m.sample_rate     = samplerate;
+    m.mark_freqhz     = mark;
+    m.space_freqhz    = space;
+    m.samples_per_bit = samplerate / baudrate;
+    m.max_skew        = (float)samplerate * skew_limit / (float)baudrate;
+    m.errchar         = 0;
+    m.gate_level      = 0;
+    m.leader          = baudrate;   // At least 1s leader tone
+    m.trailer         = 0;
+    m.idle_timeout    = 0;
+    m.fast_acquire    = false;
+    m.first_null      = firstnull;
+    m.skew_correct    = SKEW_CORRECT_FACTOR;
+    m.error_limit     = ERROR_LIMIT;
+}
+
+void tuning_defaults(tuning& t, bool forward) {
+    // Forward:  Place the first null in the middle of the backward channel
+    // Backward: Place the first null just outside the band
+    t.first_null   = forward ? F_FIRST_NULL : B_FIRST_NULL;
+    t.skew_limit   = SKEW_LIMIT;
+    t.skew_correct = SKEW_CORRECT_FACTOR;
+    t.error_limit  = ERROR_LIMIT;
+}
+
+// With no tuning given, the built-in defaults are used
+void init_channel(modemcfg& m, bool forward, int samplerate, const tuning *t) {
+    tuning def;
+    if(!t)
+    {
+        tuning_defaults(def, forward);
+        t = &def;
+    }
+
+    if(forward)
+        init_modemcfg(m, F_MARK_FREQ, F_SPACE_FREQ, t->first_null, samplerate, F_BIT_RATE, t->skew_limit);
+    else
+        init_modemcfg(m, B_MARK_FREQ, B_SPACE_FREQ, t->first_null, samplerate, B_BIT_RATE, t->skew_limit);
+
+    m.skew_correct = t->skew_correct;
+    m.error_limit  = t->error_limit;
+}
+
+// Pool space needed for a set of scratch buffers
+size_t dspbufs_size(size_t N)
+{
+    return 7 * pool_round(N * sizeof(int16_t));
+}
+
+bool dspbufs_init(dspbufs& b, size_t N, pool *p)
+{
+    b.N         = N;
+    b.bufI      = make_buffer(N, p);
+    b.bufQ      = make_buffer(N, p);
+    b.bufAng    = make_buffer(N, p);
+    b.bufWork   = make_buffer(N, p);
+    b.bufOut    = make_buffer(N, p);
+    b.bufSign   = make_buffer(N, p);
+    b.bufTiming = make_buffer(N, p);
+
+    return b.bufI && b.bufQ && b.bufAng && b.bufWork && b.bufOut && b.bufSign && b.bufTiming;
+}
+
+void dspbufs_free(dspbufs& b)
+{
+    free(b.bufI);
+    free(b.bufQ);
+    free(b.bufAng);
+    free(b.bufWork);
+    free(b.bufOut);
+    free(b.bufSign);
+    free(b.bufTiming);
+    b.bufI = b.bufQ = b.bufAng = b.bufWork = b.bufOut = b.bufSign = b.bufTiming = NULL;
+}
+
+// Pool space needed for the filters of one demodulator taking N samples at once
+size_t demod_size(const modemcfg& m, size_t N)
+{
+    size_t input_maf_samples = m.sample_rate / m.first_null;
+    size_t size = 2 * pool_round(input_maf_samples * sizeof(int16_t)) +
+                  2 * pool_round(m.samples_per_bit * sizeof(int16_t));
+    if(m.gate_level > 0)
+        size += pool_round(N * sizeof(int16_t));
+    return size;
+}
+
+// Framing as after a long silence
+static void demod_reset_framing(demod& d)
+{
+    d.errcount = 0;
+    d.errtimeout = 0;
+    d.out_shift = -1;
+    d.frame_hold = d.m.ff.frame_size;
+    d.num_transitions = 0;
+    d.total_skew = 0;
+    d.line_idle = true;
+}
+
+// Put the filters and timing back to how they'd be after a long silence
+static void demod_reset(demod& d)
+{
+    maf* mafs[] = {&d.mafI, &d.mafQ, &d.mafOut, &d.mafBit};
+    for(size_t i=0; i<4; ++i)
+    {
+        memset(mafs[i]->buf, 0, mafs[i]->N * sizeof(int16_t));
+        mafs[i]->p   = 0;
+        mafs[i]->sum = 0;
+    }
+    d.diffAng.last = 0;
+
+    d.bit_wait = d.m.samples_per_bit;
+    d.state = 0;
+    demod_reset_framing(d);
+    for(int k = 0; k < d.n_framers; ++k)
+        demod_reset_framing(d.framers[k]);
+}
+
+// Everything but the filters: bit timing, framing and where output goes
+static void demod_init_framing(demod& d, const modemcfg& m)
+{
+    d.m = m;
+
+    d.errcount = 0;
+    d.errtimeout = 0;
+    d.out_shift = -1;
+    d.frame_hold = m.ff.frame_size;
+
+    d.num_transitions = 0;
+    d.total_skew = 0;
+    d.frames_ok = d.frames_bad = d.frames_held = 0;
+
+    d.bit_wait = m.samples_per_bit;
+    d.clock = 0;
+
+    d.state = 0;
+    d.line_idle = true;
+    d.mark_run = 0;
+    d.space_run = 0;
+    d.start_wait = 0;
+    d.out_last = 0;
+
+    d.put_char = NULL;
+    d.ctx = NULL;
+    d.carrier_event = NULL;
+    d.error_event = NULL;
+    d.frame_event = NULL;
+    d.monitor = NULL;
+    d.reconfig = 0;
+    d.framers = NULL;
+    d.n_framers = 0;
+
+    // Set the meaning of +ve / -ve phase change
+    // Note this will only change if the frequencies are adjusted
+    if(m.mark_freqhz > m.space_freqhz)
+    {
+        d.phase_pos = 0;
+        d.phase_neg = 1;
+    }
+    else    // v.23 frequencies are always like this...
+    {
+        d.phase_pos = 1;
+        d.phase_neg = 0;
+    }
+}
+
+bool demod_init(demod& d, const modemcfg& m, dspbufs *bufs, pool *p)
+{
+    d.m    = m;
+    d.bufs = bufs;
+    d.pooled = (p != NULL);
+
+    d.o.p = 0;
+    d.diffAng.last = 0;
+
+    // The phase change of each tone, in the angle's units of 1/65536 revolution
+    int shift = (m.space_freqhz - m.mark_freqhz) / 2;
+    d.disc.last_i = d.disc.last_q = 0;
+    d.disc.step = (int64_t)((shift < 0) ? -shift : shift) * 65536 / m.sample_rate;
+    if(d.disc.step < 1) d.disc.step = 1;
+    d.cheap_disc = false;
+
+    demod_init_framing(d, m);
+
+    // Goertzel coefficients for the carrier detector
+    d.gate_coeff_mark  = 2.0 * cos(2.0 * M_PI * m.mark_freqhz  / m.sample_rate);
+    d.gate_coeff_space = 2.0 * cos(2.0 * M_PI * m.space_freqhz / m.sample_rate);
+    d.carrier = (m.gate_level <= 0);
+    d.gate_hang = 0;
+    d.gate_prev = NULL;
+    d.gate_prev_n = 0;
+
+    // Set up the oscillators, filters etc
+    d.o.freqhz = (m.mark_freqhz + m.space_freqhz) / 2;
+
+    // Place the first null for the input MAF
+    int input_maf_samples = m.sample_rate / m.first_null;
+    if(debug > 0)
+    {
+        fprintf(stderr, "LO centre freq: %d Hz\n", d.o.freqhz);
+        fprintf(stderr, "IQ MAF:         %d samples\n", input_maf_samples);
+        fprintf(stderr, "Null placed at: %d Hz\n", m.first_null);
+    }
+
+    d.mafI.buf = d.mafQ.buf = d.mafOut.buf = d.mafBit.buf = NULL;
+    if(! (
+        maf_init(d.mafI,  input_maf_samples, p)     &&
+        maf_init(d.mafQ,  input_maf_samples, p)     &&
+        maf_init(d.mafOut,    m.samples_per_bit, p) &&
+        maf_init(d.mafBit,    m.samples_per_bit, p) )) {
+
+        fprintf(stderr, "Failed to initialize MAFs\n");
+        demod_free(d);
+        return false;
+    }
+
+    if(m.gate_level > 0 && !(d.gate_prev = make_buffer(bufs->N, p)))
+    {
+        fprintf(stderr, "Failed to allocate carrier detect buffer\n");
+        demod_free(d);
+        return false;
+    }
+
+    return true;
+}
+
+void demod_free(demod& d)
+{
+    if(!d.pooled)
+    {
+        free(d.mafI.buf);
+        free(d.mafQ.buf);
+        free(d.mafOut.buf);
+        free(d.mafBit.buf);
+        free(d.gate_prev);
+    }
+    d.mafI.buf = d.mafQ.buf = d.mafOut.buf = d.mafBit.buf = NULL;
+    d.gate_prev = NULL;
+}
+
+bool demod_same_filters(const modemcfg& a, const modemcfg& b)
+{
+    return a.sample_rate == b.sample_rate && a.first_null == b.first_null &&
+           a.mark_freqhz == b.mark_freqhz && a.space_freqhz == b.space_freqhz &&
+           a.samples_per_bit == b.samples_per_bit && a.gate_level == b.gate_level;
+}
+
+// May be called from another thread than the one running the demodulator
+bool demod_reconfigure(demod& d, const modemcfg& m)
+{
+    if(__atomic_load_n(&d.reconfig, __ATOMIC_ACQUIRE))
+        return false;
+
+    d.next_m = m;
+    __atomic_store_n(&d.reconfig, 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void demod_init_framer(demod& d, const modemcfg& m)
+{
+    demod_init_framing(d, m);
+}
+
+void demod_adopt_framer(demod& d, const demod& f)
+{
+    d.m.ff           = f.m.ff;
+    d.m.errchar      = f.m.errchar;
+
+    d.errcount        = f.errcount;
+    d.errtimeout      = f.errtimeout;
+    d.out_shift       = f.out_shift;
+    d.frame_hold      = f.frame_hold;
+    d.line_idle       = f.line_idle;
+    d.num_transitions = f.num_transitions;
+    d.total_skew      = f.total_skew;
+    d.frames_ok       = f.frames_ok;
+    d.frames_bad      = f.frames_bad;
+    d.frames_held     = f.frames_held;
+
+    d.framers = NULL;
+    d.n_framers = 0;
+}
+
+void demod_cheap_discriminator(demod& d, bool on)
+{
+    __atomic_store_n(&d.cheap_disc, on, __ATOMIC_RELAXED);
+}
+
+#define DEMOD_STATE_MAGIC   0x76323364  // "v23d"
+
+// Everything in a saved state but the filter delay lines, which follow it
+struct demod_state {
+    uint32_t magic;
+    int32_t sample_rate, first_null, mark_freqhz, space_freqhz, samples_per_bit;
+    int32_t osc_p;
+    int16_t diff_last;
+    int32_t maf_p[4], maf_sum[4];
+    int32_t errcount, errtimeout, out_shift, frame_hold;
+    int32_t num_transitions, total_skew, bit_wait, state;
+    uint8_t line_idle, carrier;
+    int32_t gate_hang;
+};
+
+bool demod_save(const demod& d, FILE *f)
+{
+    const maf* mafs[] = {&d.mafI, &d.mafQ, &d.mafOut, &d.mafBit};
+    demod_state st;
+    memset(&st, 0, sizeof(st));
+
+    st.magic           = DEMOD_STATE_MAGIC;
+    st.sample_rate     = d.m.sample_rate;
+    st.first_null      = d.m.first_null;
+    st.mark_freqhz     = d.m.mark_freqhz;
+    st.space_freqhz    = d.m.space_freqhz;
+    st.samples_per_bit = d.m.samples_per_bit;
+    st.osc_p           = d.o.p;
+    st.diff_last       = d.diffAng.last;
+    for(int i=0; i<4; ++i)
+    {
+        st.maf_p[i]   = mafs[i]->p;
+        st.maf_sum[i] = mafs[i]->sum;
+    }
+    st.errcount        = d.errcount;
+    st.errtimeout      = d.errtimeout;
+    st.out_shift       = d.out_shift;
+    st.frame_hold      = d.frame_hold;
+    st.num_transitions = d.num_transitions;
+    st.total_skew      = d.total_skew;
+    st.bit_wait        = d.bit_wait;
+    st.state           = d.state;
+    st.line_idle       = d.line_idle;
+    st.carrier         = d.carrier;
+    st.gate_hang       = d.gate_hang;
+
+    if(fwrite(&st, sizeof(st), 1, f) != 1)
+        return false;
+    for(int i=0; i<4; ++i)
+        if(fwrite(mafs[i]->buf, sizeof(int16_t), mafs[i]->N, f) != mafs[i]->N)
+            return false;
+    return true;
+}
+
+// The demodulator must already be set up, for the same channel and rate
+bool demod_load(demod& d, FILE *f)
+{
+    maf* mafs[] = {&d.mafI, &d.mafQ, &d.mafOut, &d.mafBit};
+    demod_state st;
+
+    if(fread(&st, sizeof(st), 1, f) != 1 || st.magic != DEMOD_STATE_MAGIC)
+    {
+        fprintf(stderr, "Not a saved demodulator state\n");
+        return false;
+    }
+    if(st.sample_rate != d.m.sample_rate || st.first_null != d.m.first_null ||
+       st.mark_freqhz != d.m.mark_freqhz || st.space_freqhz != d.m.space_freqhz ||
+       st.samples_per_bit != d.m.samples_per_bit)
+    {
+        fprintf(stderr, "Saved demodulator state is for a different channel or sample rate\n");
+        return false;
+    }
+
+    for(int i=0; i<4; ++i)
+        if(fread(mafs[i]->buf, sizeof(int16_t), mafs[i]->N, f) != mafs[i]->N ||
+           st.maf_p[i] < 0 || (size_t)st.maf_p[i] >= mafs[i]->N)
+        {
+            fprintf(stderr, "Saved demodulator state is damaged\n");
+            demod_reset(d);
+            return false;
+        }
+
+    d.o.p = st.osc_p;
+    d.diffAng.last = st.diff_last;
+    for(int i=0; i<4; ++i)
+    {
+        mafs[i]->p   = st.maf_p[i];
+        mafs[i]->sum = st.maf_sum[i];
+    }
+    d.errcount        = st.errcount;
+    d.errtimeout      = st.errtimeout;
+    d.out_shift       = st.out_shift;
+    d.frame_hold      = st.frame_hold;
+    d.num_transitions = st.num_transitions;
+    d.total_skew      = st.total_skew;
+    d.bit_wait        = st.bit_wait;
+    d.state           = st.state;
+    d.line_idle       = st.line_idle;
+    d.carrier         = st.carrier;
+    d.gate_hang       = st.gate_hang;
+    return true;
+}
+
+// Count a bad frame
+static void demod_error(demod& d)
+{
+    ++d.errcount;
+    ++d.frames_bad;
+    d.errtimeout = 10*d.m.ff.frame_size;
+
+    if(d.errcount == d.m.error_limit && d.error_event)
+        d.error_event(d.ctx);
+}
+
+static void demod_put_char(demod& d, char c)
+{
+    if(d.put_char)
+        d.put_char(d.ctx, c);
+}
+
+static void demod_frame(demod& d, uint64_t time, unsigned char c, int status, int avg_skew)
+{
+    if(!d.frame_event)
+        return;
+
+    frameinfo fi;
+    fi.time = time;
+    fi.c = c;
+    fi.status = status;
+    fi.avg_skew = avg_skew;
+    d.frame_event(d.ctx, fi);
+}
+
+// Level of the stronger of the mark and space tones in a block, as a peak
+// amplitude.  Two Goertzel bins are far cheaper than the demodulator, and
+// unlike the block RMS they ignore the other channel on the same line.
+static float gate_level(demod& d, int16_t *samples, size_t n)
+{
+    float m1 = 0, m2 = 0, s1 = 0, s2 = 0;
+    for(size_t i=0; i<n; ++i)
+    {
+        float x  = samples[i];
+        float m0 = x + d.gate_coeff_mark  * m1 - m2;
+        float s0 = x + d.gate_coeff_space * s1 - s2;
+        m2 = m1; m1 = m0;
+        s2 = s1; s1 = s0;
+    }
+
+    float pm = m1 * m1 + m2 * m2 - d.gate_coeff_mark  * m1 * m2;
+    float ps = s1 * s1 + s2 * s2 - d.gate_coeff_space * s1 * s2;
+    float p  = (pm > ps) ? pm : ps;
+
+    return 2.0 * sqrtf(p) / n;
+}
+
+static void demod_run(demod& d, int16_t *bufIn, size_t n);
+
+// Carrier detect - returns false if the block should be skipped
+static bool demod_gate(demod& d, int16_t *bufIn, size_t n)
+{
+    modemcfg& m = d.m;
+    float level = gate_level(d, bufIn, n);
+
+    // Long enough to let the last frame and the filters run out
+    int hang = (m.ff.frame_size + 4) * m.samples_per_bit + m.sample_rate / m.first_null;
+
+    if(!d.carrier)
+    {
+        if(level < m.gate_level)
+        {
+            // Still silent.  Keep the LO running, and hang on to the block in
+            // case the carrier started part way through it.
+            d.o.p = (d.o.p + (int64_t)d.o.freqhz * n) % sinelen;
+            d.clock += n;
+            memcpy(d.gate_prev, bufIn, n * sizeof(int16_t));
+            d.gate_prev_n = n;
+            return false;
+        }
+
+        d.carrier = true;
+        d.gate_hang = hang;
+        if(debug > 1)
+            fprintf(stderr, "Carrier level %d\n", (int)level);
+        if(d.carrier_event)
+            d.carrier_event(d.ctx, true);
+
+        // Start from the state the filters would have after silence, and
+        // run the block before this one through to warm them up
+        demod_reset(d);
+        d.clock -= d.gate_prev_n;   // Counted once already
+        if(d.gate_prev_n > 0)
+            demod_run(d, d.gate_prev, d.gate_prev_n);
+        d.gate_prev_n = 0;
+        return true;
+    }
+
+    if(level >= m.gate_level * GATE_HYSTERESIS)
+        d.gate_hang = hang;
+    else if((d.gate_hang -= n) <= 0)
+    {
+        d.carrier = false;
+        if(debug > 1)
+            fprintf(stderr, "Carrier level %d\n", (int)level);
+        if(d.carrier_event)
+            d.carrier_event(d.ctx, false);
+        d.clock += n;
+        return false;
+    }
+
+    return true;
+}
+
+// Demodulate a block of at most bufs->N samples
+void demod_process(demod& d, int16_t *bufIn, size_t n)
+{
+    if(d.m.gate_level > 0 && !demod_gate(d, bufIn, n))
+        return;
+
+    demod_run(d, bufIn, n);
+}
+
+// First sample in [i, end) where the timing sign differs from state, or end.
+// Edges are rare, so whole blocks are checked with a branch-free reduction
+// the compiler can vectorize, and only a block with an edge is scanned.
+static size_t find_edge(const int16_t *timing, size_t i, size_t end, int state)
+{
+    while(i + EDGE_BLOCK <= end)
+    {
+        int diff = 0;
+        for(int k=0; k<EDGE_BLOCK; ++k)
+            diff |= (timing[i+k] > 0) ^ state;
+        if(diff) break;
+        i += EDGE_BLOCK;
+    }
+
+    while(i < end && ((timing[i] > 0) ^ state) == 0)
+        ++i;
+    return i;
+}
+
+// Edge in the timing buffer - re-align
+static void demod_edge(demod& d)
+{
+    modemcfg& m = d.m;
+
+    int adj;
+
+    // Which way?
+    if(d.bit_wait > (m.samples_per_bit / 2))
+        // We are ahead (e.g. we just sampled)
+        adj = m.samples_per_bit - d.bit_wait;
+    else
+        // We are behind (e.g. we're about to sample)
+        adj = -d.bit_wait;
+
+    LOG(3, "Transition, skew: %d samples\n", adj);
+
+    // Don't count the first correction, and correct completely
+    if(d.line_idle)
+        d.line_idle = false;
+    else
+    {
+        d.total_skew += (adj >= 0) ? adj : -adj;
+        ++d.num_transitions;
+
+        // Figure out the adjustment to make
+        // ALWAYS adjust in the correct direction
+        // ALWAYS correct by at least one, unless the error is zero
+        if(adj > 0) {
+            adj /= m.skew_correct;
+            adj += 1;
+        }
+        else if(adj < 0) {
+            adj /= m.skew_correct;
+            adj -= 1;
+        }
+    }
+    LOG(3, "Adjusting by %d samples\n", adj);
+
+    d.bit_wait += adj;
+}
+
+// Swap in the framing from demod_reconfigure
+static void demod_apply_config(demod& d)
+{
+    modemcfg& m = d.m;
+    const modemcfg& n = d.next_m;
+
+    m.ff           = n.ff;
+    m.errchar      = n.errchar;
+    m.max_skew     = n.max_skew;
+    m.skew_correct = n.skew_correct;
+    m.error_limit  = n.error_limit;
+    m.fast_acquire = n.fast_acquire;
+
+    d.errcount = 0;
+    d.errtimeout = 0;
+
+    if(debug > 0)
+        fprintf(stderr, "New framing in effect\n");
+    __atomic_store_n(&d.reconfig, 0, __ATOMIC_RELEASE);
+}
+
+// Time to read a bit, given the filtered phase change at sample pos of the block
+static void demod_bit(demod& d, int16_t out, size_t pos)
+{
+    modemcfg& m = d.m;
+    framefmt& f = m.ff;
+
+    int outbit = (out > 0) ? d.phase_pos : d.phase_neg;
+    LOG(4, "Read bit '%d'\n", outbit);
+    d.out_shift <<= 1;
+    d.out_shift += outbit;
+
+    // If the shift register is all ones or all zeros, the line is idle
+    if((!d.line_idle && d.out_shift == -1) || d.out_shift == 0)
+    {
+        d.line_idle = true;
+        LOG(2, "Line idle (%04x)\n", d.out_shift);
+    }
+
+    if(d.line_idle);  //Nothing
+    else if(--d.frame_hold > 0)                                  // Frame Hold-off
+    {
+        LOG(3, "Frame hold (%d left)\n", d.frame_hold);
+    }
+    else if((d.out_shift & f.frame_mask) == f.frame_pattern)    // Frame is valid
+    {
+        int avg_skew = 0;   // We can't measure skew of a frame with no observed transitions
+        if(d.num_transitions > 0) avg_skew = d.total_skew / d.num_transitions;
+
+        // Set line idle as we don't want to rehandle this frame
+        d.line_idle = true;
+
+        // Check the quality
+        if(avg_skew > m.max_skew)
+        {
+            LOG(2, "Dropping frame with high skew of %d\n", avg_skew);
+            demod_error(d);
+            demod_frame(d, d.clock + pos, 0, FRAME_SKEW, avg_skew);
+        }
+        else
+        {
+            uint32_t frame_data = d.out_shift & ((1 << (f.frame_size+1)) - 1);
+            LOG(2, "Processing frame: %lo, skew %d\n",
+                   bin_as_octal(frame_data), avg_skew);
+
+            bool parity_bit = (frame_data & f.parity_mask) != 0;
+            uint32_t data =   (frame_data & f.data_mask  ) >> f.data_offset;
+            bool data_parity = parity(data);
+
+            LOG(2, "Data: 0x%02x Parity: %c Data parity: %c\n", (int)data,
+                   parity_bit ? '1' : '0', data_parity ? '1' : '0');
+
+            if(f.lsb_first)
+            {
+                // Assume we're working with no more than 8 data bits!
+                data <<= (8 - f.data_size);
+
+                // Reverse bits in byte (LSB is first transmitted)
+                // http://graphics.stanford.edu/~seander/bithacks.html#ReverseByteWith64BitsDiv
+                data = (data * 0x0202020202ULL & 0x010884422010ULL) % 1023;
+            }
+
+            data &= 0xff;
+
+            // Check parity
+            if(!f.parity_even) data_parity = !data_parity;
+
+            // Parity check
+            if(!f.parity_enable || (data_parity == parity_bit))
+            {
+                if(d.errcount > 0) --d.errcount;
+
+                if(d.errcount < m.error_limit)
+                {
+                    ++d.frames_ok;
+
+                    LOG(2, "Got byte: 0x%02x\n", data);
+
+                    demod_put_char(d, (char)data);
+                    demod_frame(d, d.clock + pos, data, FRAME_OK, avg_skew);
+                }
+                else
+                {
+                    ++d.frames_held;
+                    LOG(2, "Dropping apparently valid frame due to errors\n");
+                    demod_frame(d, d.clock + pos, data, FRAME_HELD, avg_skew);
+                }
+            }
+            else
+            {
+                LOG(2, "Dropping frame with bad parity\n");
+                demod_error(d);
+                if(d.errcount < m.error_limit && m.errchar)
+                    demod_put_char(d, m.errchar);
+                demod_frame(d, d.clock + pos, data, FRAME_PARITY, avg_skew);
+            }
+        }
+    }
+    else if(!d.line_idle)
+    {
+        LOG(3, "Waiting for a valid frame\n");
+    }
+
+    // If the line is in idle state, reset the skew and transition count
+    if(d.line_idle)
+    {
+        // Between frames - the time to change the framing
+        if(__atomic_load_n(&d.reconfig, __ATOMIC_ACQUIRE))
+            demod_apply_config(d);
+
+        d.out_shift &= (2 << f.frame_size) - 1;
+        d.total_skew = 0;
+        d.num_transitions = 0;
+        d.frame_hold = f.frame_size - 1;
+        if(d.errtimeout > 0) --d.errtimeout;
+        else d.errcount=0;
+    }
+
+    d.bit_wait += m.samples_per_bit;
+}
+
+static inline bool is_space(const demod& d, int16_t out)
+{
+    return ((out > 0) ? d.phase_pos : d.phase_neg) == 0;
+}
+
+// Should a change to space, with bit_wait samples to the next bit, restart
+// the bit timing?  After idle, the timing edge lines it up just as well.  In
+// a frame, a change near where the bit timing expects one is just data, give
+// or take the jitter.  One that would have the bits read outside their middle
+// half means the frame was made out of noise before the carrier came, and
+// this is the real start bit.
+static bool is_start(const demod& d, int bit_wait)
+{
+    const modemcfg& m = d.m;
+    int off = bit_wait - m.samples_per_bit / 2;
+    int limit = m.samples_per_bit / 4;
+    return !d.line_idle && (off > limit || off < -limit);
+}
+
+// The start bit is confirmed: start the frame as if the line had been idle
+static void demod_acquire(demod& d)
+{
+    framefmt& f = d.m.ff;
+
+    d.bit_wait = d.start_wait;
+    LOG(3, "Start bit, reading it in %d samples\n", d.bit_wait);
+
+    // At least a bit of mark went before it
+    d.out_shift = (2 << f.frame_size) - 1;
+    d.line_idle = false;
+    d.total_skew = 0;
+    d.num_transitions = 0;
+    d.frame_hold = f.frame_size - 1;
+
+    for(int k = 0; k < d.n_framers; ++k)
+    {
+        d.framers[k].start_wait = d.start_wait;
+        demod_acquire(d.framers[k]);
+    }
+}
+
+// One sample of the filtered phase change, looking for a start bit: a change
+// from a bit or more of steady mark to space.  The timing signal would only
+// show it half a bit later, after the bit MAF, and the first correction of a
+// frame that hasn't seen the line idle is partial - so the edge is taken
+// straight from here, placed between the two samples.  It only counts once
+// the space has lasted a quarter of a bit, which is still well before the
+// start bit is read.  Returns true when the bit timing has been set from it.
+static bool demod_hunt(demod& d, int16_t out, int bit_wait)
+{
+    const modemcfg& m = d.m;
+    int16_t last = d.out_last;
+    d.out_last = out;
+
+    if(!is_space(d, out))
+    {
+        // A glitch, if there was a start bit in the making
+        d.space_run = 0;
+        if(d.mark_run < m.samples_per_bit) ++d.mark_run;
+        return false;
+    }
+
+    if(d.space_run == 0)
+    {
+        if(d.mark_run < m.samples_per_bit || !is_start(d, bit_wait))
+        {
+            d.mark_run = 0;
+            return false;
+        }
+
+        // Where the zero crossing falls after the last sample, as num / den.
+        // The bits are read half a bit after their edges in this signal.
+        int32_t num = (last >= 0) ? last : -last;
+        int32_t den = num + ((out >= 0) ? out : -out);
+        if(den == 0) den = num = 1;
+        d.start_wait = (m.samples_per_bit * den + 2 * num + den) / (2 * den);
+    }
+    else
+        --d.start_wait;
+
+    if(++d.space_run < m.samples_per_bit / 4)
+        return false;
+
+    d.space_run = 0;
+    d.mark_run = 0;
+    demod_acquire(d);
+    return true;
+}
+// The stages of demod_run.  Each only touches its own part of the
+// demodulator, so they can run on separate threads given their own buffers.
+
+// Mix and filter the local oscillator, into bufI and bufQ
+void demod_mix(demod& d, dspbufs& b, int16_t *bufIn, size_t n)
+{
+    osc_get_complex_samples(d.o, b.bufI, b.bufQ, n);
+    mul_samples(bufIn, b.bufI, b.bufWork, n);
+    maf_process(d.mafI, b.bufWork, b.bufI, n);
+    mul_samples(bufIn, b.bufQ, b.bufWork, n);
+    maf_process(d.mafQ, b.bufWork, b.bufQ, n);
+}
+
+// From bufI and bufQ to the filtered phase change in bufOut and the timing
+// signal in bufTiming
+void demod_phase(demod& d, dspbufs& b, size_t n)
+{
+    // Determine the phase, phase change, then filter it.  The engine not in
+    // use is kept up to date with the last sample, so switching between blocks
+    // carries on from where the other left off.
+    if(__atomic_load_n(&d.cheap_disc, __ATOMIC_RELAXED))
+    {
+        disc_complex_samples(d.disc, b.bufI, b.bufQ, b.bufWork, n);
+        if(n > 0)
+            ang_complex_samples(&b.bufI[n - 1], &b.bufQ[n - 1], &d.diffAng.last, 1);
+    }
+    else
+    {
+        ang_complex_samples(b.bufI, b.bufQ, b.bufAng, n);
+        deriv_samples(d.diffAng, b.bufAng, b.bufWork, n);
+        if(n > 0)
+        {
+            d.disc.last_i = b.bufI[n - 1];
+            d.disc.last_q = b.bufQ[n - 1];
+        }
+    }
+    maf_process(d.mafOut, b.bufWork, b.bufOut, n);
+
+    // Sign sampling and filtering to inform timing
+    sgn_samples(b.bufOut, b.bufSign, n);
+    maf_process(d.mafBit, b.bufSign, b.bufTiming, n, true);
+}
+
+// Bit timing and framing
+void demod_timing(demod& d, int16_t *bufOut, int16_t *bufTiming, size_t n)
+{
+    // Run through the output samples.  Between edges in the timing buffer
+    // and bit sampling instants nothing happens but bit_wait counting down,
+    // so skip straight to whichever comes next.
+    int last;
+    size_t i = 0;
+    size_t hunted = 0;  // Samples looked at for a start bit
+    while(i < n)
+    {
+        size_t sample = i + ((d.bit_wait > 1) ? d.bit_wait - 1 : 0);
+        size_t end = (sample < n) ? sample : n;
+
+        size_t next = find_edge(bufTiming, i, end, d.state);
+
+        // Every sample up to and including the next event has to be looked
+        // at for a start bit, in order, before the event is handled
+        if(d.m.fast_acquire)
+        {
+            size_t from = (hunted > i) ? hunted : i;
+            size_t stop = (next < n) ? next + 1 : n;
+            int bit_wait = d.bit_wait - (from - i);
+            for(hunted = from; hunted < stop; ++hunted, --bit_wait)
+                if(demod_hunt(d, bufOut[hunted], bit_wait))
+                    break;
+
+            if(hunted < stop)
+            {
+                // The bit timing is now from the start bit at this sample
+                i = hunted++;
+                continue;
+            }
+        }
+
+        if(next >= n)
+        {
+            d.bit_wait -= n - i;
+            break;
+        }
+        d.bit_wait -= next - i;
+        i = next;
+
+        last = d.state;
+        d.state = (bufTiming[i] > 0) ? 1 : 0;
+
+        if(last != d.state)
+        {
+            for(int k = 0; k < d.n_framers; ++k)
+            {
+                d.framers[k].bit_wait = d.bit_wait;
+                demod_edge(d.framers[k]);
+            }
+            demod_edge(d);
+        }
+
+        if(--d.bit_wait <= 0)
+        {
+            for(int k = 0; k < d.n_framers; ++k)
+            {
+                d.framers[k].clock = d.clock;
+                demod_bit(d.framers[k], bufOut[i], i);
+            }
+            demod_bit(d, bufOut[i], i);
+        }
+
+        ++i;
+    }
+    d.clock += n;
+}
+
+static void demod_run(demod& d, int16_t *bufIn, size_t n)
+{
+    dspbufs& b  = *d.bufs;
+
+    demod_mix(d, b, bufIn, n);
+    demod_phase(d, b, n);
+
+    if(d.monitor)
+    {
+      int16_t *bufs[] = {bufIn, b.bufI, b.bufQ, b.bufAng, b.bufWork, b.bufOut, b.bufSign, b.bufTiming};
+      d.monitor(d.ctx, bufs, 8, n);
+    }
+
+    demod_timing(d, b.bufOut, b.bufTiming, n);
+}
+
+// The bank runs each stage of the demodulator one sample at a time, but for
+// BANK_LANES lines at once.  The loops over the lanes have a fixed count, no
+// branches and work on local arrays, so the compiler turns each of them into
+// a few vector operations.  The results are exactly those of the single-line
+// versions above.
+
+// a / b, rounded toward zero like the integer divide - which has no vector
+// form.  For quotients below 2^16 the float divide is out by at most one,
+// which the remainder puts right.
+static inline int32_t lane_div(int32_t a, int32_t b)
+{
+    int32_t abs_a = (a < 0) ? -a : a;
+    int32_t abs_b = (b < 0) ? -b : b;
+    int32_t q = (int32_t)((float)abs_a / (float)abs_b);
+    int32_t r = abs_a - q * abs_b;
+    q += (r >= abs_b) - (r < 0);
+    return ((a < 0) != (b < 0)) ? -q : q;
+}
+
+static bool bankmaf_init(bankmaf& maf, size_t N)
+{
+    maf.buf = make_buffer(N * BANK_LANES);
+    if(!maf.buf) return false;
+
+    maf.N = N;
+    maf.p = 0;
+    for(int l=0; l<BANK_LANES; ++l)
+        maf.sum[l] = 0;
+
+    return true;
+}
+
+static void bankmaf_step(bankmaf& maf, const int16_t *in, int16_t *out, bool nodivide = false)
+{
+    int16_t x[BANK_LANES];
+    int32_t sum[BANK_LANES];
+    int16_t *tap = &maf.buf[maf.p * BANK_LANES];
+
+    for(int l=0; l<BANK_LANES; ++l)
+        x[l] = in[l];
+    for(int l=0; l<BANK_LANES; ++l)
+        sum[l] = maf.sum[l] + x[l] - tap[l];
+    for(int l=0; l<BANK_LANES; ++l)
+        tap[l] = x[l];
+    for(int l=0; l<BANK_LANES; ++l)
+        maf.sum[l] = sum[l];
+
+    if(nodivide)
+    {
+        for(int l=0; l<BANK_LANES; ++l)
+            out[l] = (sum[l] > 32767) ? 32767 : (sum[l] < -32767) ? -32767 : sum[l];
+    }
+    else
+    {
+        int32_t N = maf.N;
+        for(int l=0; l<BANK_LANES; ++l)
+            out[l] = lane_div(sum[l] + N/2, N);
+    }
+
+    if(++maf.p >= maf.N) maf.p = 0;
+}
+
+bool demodbank_init(demodbank& b, const modemcfg& m, int n_lines, size_t N)
+{
+    b.m = m;
+    b.N = N;
+    b.n_lines = n_lines;
+
+    b.o.p = 0;
+    b.o.freqhz = (m.mark_freqhz + m.space_freqhz) / 2;
+
+    for(int l=0; l<BANK_LANES; ++l)
+    {
+        demod_init_framing(b.lines[l], m);
+        b.lines[l].mafI.buf = b.lines[l].mafQ.buf = NULL;
+        b.lines[l].mafOut.buf = b.lines[l].mafBit.buf = NULL;
+        b.lines[l].gate_prev = NULL;
+
+        b.diff_last[l] = 0;
+        b.bit_wait[l] = m.samples_per_bit;
+        b.state[l] = 0;
+        b.active[l] = (l < n_lines);
+    }
+
+    int input_maf_samples = m.sample_rate / m.first_null;
+
+    b.mafI.buf = b.mafQ.buf = b.mafOut.buf = b.mafBit.buf = NULL;
+    b.loI = make_buffer(N);
+    b.loQ = make_buffer(N);
+
+    if(! (
+        bankmaf_init(b.mafI,  input_maf_samples) &&
+        bankmaf_init(b.mafQ,  input_maf_samples) &&
+        bankmaf_init(b.mafOut,    m.samples_per_bit) &&
+        bankmaf_init(b.mafBit,    m.samples_per_bit) &&
+        b.loI && b.loQ )) {
+
+        fprintf(stderr, "Failed to allocate demodulator bank\n");
+        demodbank_free(b);
+        return false;
+    }
+
+    return true;
+}
+
+// Bit timing for the lanes with an edge or a bit to read.  The line's own
+// state is brought up to date for the single-line code to work on.
+static void demodbank_events(demodbank& b, const int16_t *out, const int16_t *timing, size_t pos)
+{
+    for(int l=0; l<b.n_lines; ++l)
+    {
+        demod& d = b.lines[l];
+        d.bit_wait = b.bit_wait[l];
+
+        int last = b.state[l];
+        d.state = (timing[l] > 0) ? 1 : 0;
+
+        if(last != d.state)
+            demod_edge(d);
+
+        if(--d.bit_wait <= 0)
+            demod_bit(d, out[l], pos);
+
+        b.bit_wait[l] = d.bit_wait;
+        b.state[l] = d.state;
+    }
+}
+
+// Demodulate a block of n samples per lane, interleaved [n][BANK_LANES]
+void demodbank_process(demodbank& b, int16_t *bufIn, size_t n)
+{
+    const int L = BANK_LANES;
+
+    osc_get_complex_samples(b.o, b.loI, b.loQ, n);
+
+    for(size_t i=0; i<n; ++i)
+    {
+        int16_t x[L], sI[L], sQ[L], ang[L], dang[L], out[L], sgn[L], timing[L];
+
+        for(int l=0; l<L; ++l)
+            x[l] = bufIn[i * L + l];
+
+        // Mix and filter the local oscillator
+        int32_t loI = b.loI[i], loQ = b.loQ[i];
+        for(int l=0; l<L; ++l)
+        {
+            int32_t pI = (x[l] * loI) / 32768, pQ = (x[l] * loQ) / 32768;
+            sI[l] = (pI > 32767) ? 32767 : (pI < -32767) ? -32767 : pI;
+            sQ[l] = (pQ > 32767) ? 32767 : (pQ < -32767) ? -32767 : pQ;
+        }
+        bankmaf_step(b.mafI, sI, sI);
+        bankmaf_step(b.mafQ, sQ, sQ);
+
+        // Determine the phase, as ang_complex_samples with the branches
+        // turned into selects
+        for(int l=0; l<L; ++l)
+        {
+            int32_t x = sI[l], y = sQ[l];
+            int32_t abs_x = (x < 0) ? -x : x;
+            int32_t abs_y = (y < 0) ? -y : y;
+            bool x_major = abs_x > abs_y;
+
+            int32_t ratio = lane_div(8192 * (x_major ? y : x), (x_major ? x : y) | (x == 0 && y == 0));
+            int32_t angle = x_major ? ratio + ((x < 0) ? 32768 : 0)
+                                    : 16384 - ratio + ((y < 0) ? 32768 : 0);
+            ang[l] = (x == 0 && y == 0) ? 0 : (int16_t)angle;
+        }
+
+        // Phase change, then filter it
+        for(int l=0; l<L; ++l)
+            dang[l] = ang[l] - b.diff_last[l];
+        for(int l=0; l<L; ++l)
+            b.diff_last[l] = ang[l];
+        bankmaf_step(b.mafOut, dang, out);
+
+        // Sign sampling and filtering to inform timing
+        for(int l=0; l<L; ++l)
+            sgn[l] = (out[l] > 0) - (out[l] < 0);
+        bankmaf_step(b.mafBit, sgn, timing, true);
+
+        // Looking for start bits comes first, as in demod_timing.  It isn't
+        // done in lockstep, but only runs with fast acquisition.
+        if(b.m.fast_acquire)
+            for(int l=0; l<b.n_lines; ++l)
+                if(demod_hunt(b.lines[l], out[l], b.bit_wait[l]))
+                    b.bit_wait[l] = b.lines[l].bit_wait;
+
+        // Most of the time no lane has an edge or a bit to read, and all
+        // there is to do is count down
+        int event = 0;
+        for(int l=0; l<L; ++l)
+            event |= b.active[l] & (((timing[l] > 0) != b.state[l]) | (b.bit_wait[l] <= 1));
+
+        if(event)
+            demodbank_events(b, out, timing, i);
+        else
+            for(int l=0; l<L; ++l)
+                b.bit_wait[l] -= b.active[l];
+    }
+
+    for(int l=0; l<b.n_lines; ++l)
+        b.lines[l].clock += n;
+}
+
+void demodbank_free(demodbank& b)
+{
+    free(b.mafI.buf);
+    free(b.mafQ.buf);
+    free(b.mafOut.buf);
+    free(b.mafBit.buf);
+    free(b.loI);
+    free(b.loQ);
+    b.mafI.buf = b.mafQ.buf = b.mafOut.buf = b.mafBit.buf = NULL;
+    b.loI = b.loQ = NULL;
+}
+
+void mod_init(mod& md, const modemcfg& m, wavecache *cache)
+{
+    md.m = m;
+    md.o.p = 0;
+    md.o.freqhz = m.mark_freqhz;
+    md.out_shift = -1;
+    md.bits_in_buffer = 0;
+    md.cache = cache;
+}
+
+// The bits of the frame for a character, last bit sent in the lsb
+static int32_t frame_bits(const framefmt& f, unsigned char c_in)
+{
+    // Set up the frame
+    int32_t out_shift = f.frame_pattern;
+
+    // Truncate data if needed
+    uint32_t data = (int)c_in & (( 1 << f.data_size ) - 1);
+
+    // Work out parity
+    if( f.parity_enable && ( parity(data) == f.parity_even ) )
+    {
+        // Set all parity bits if needed
+        out_shift |= f.parity_mask;
+    }
+
+    // Sort out the data order
+    if(f.lsb_first)
+    {
+        // Assume we're working with no more than 8 data bits!
+        data <<= (8 - f.data_size);
+
+        // Reverse bits in byte (LSB is first transmitted)
+        // http://graphics.stanford.edu/~seander/bithacks.html#ReverseByteWith64BitsDiv
+        data = (data * 0x0202020202ULL & 0x010884422010ULL) % 1023;
+    }
+
+    // Manipulate the data bits into the right position
+    data <<= f.data_offset;
+    data &=  f.data_mask;  // Probably not necessary... just in case
+
+    // Set the data bits
+    out_shift |= data;
+
+    return out_shift;
+}
+
+// Set up the frame for the next character
+void mod_load_byte(mod& md, unsigned char c_in)
+{
+    framefmt& f = md.m.ff;
+
+    md.out_shift = frame_bits(f, c_in);
+    md.bits_in_buffer = f.frame_size;
+
+    LOG(2, "Frame for input 0x%02x: %lo\n", (int)c_in, bin_as_octal(md.out_shift));
+
+    // One last manipulation: shift the data to the top of the word
+    md.out_shift <<= (32 - f.frame_size);
+}
+
+// Get the samples for a whole frame, frame_size * samples_per_bit of them
+void mod_get_frame_samples(mod& md, unsigned char c_in, int16_t *samples_out)
+{
+    if(md.cache && wavecache_get_frame(*md.cache, md.o.p, c_in, samples_out))
+    {
+        LOG(2, "Frame for input 0x%02x: cached\n", (int)c_in);
+        return;
+    }
+
+    mod_load_byte(md, c_in);
+    while(md.bits_in_buffer > 0)
+    {
+        mod_get_bit_samples(md, samples_out);
+        samples_out += md.m.samples_per_bit;
+    }
+}
+
+// Get one bit period of samples - idle (mark) if there is no frame loaded
+void mod_get_bit_samples(mod& md, int16_t *samples_out)
+{
+    if( md.bits_in_buffer > 0 )
+    {
+        int i_out = 0;
+        // Get next bit
+        if(md.out_shift & 0x80000000) i_out = 1;
+
+        LOG(3, "State '%d'\n", i_out);
+
+        if(i_out)
+            md.o.freqhz = md.m.mark_freqhz;
+        else
+            md.o.freqhz = md.m.space_freqhz;
+
+        md.out_shift <<= 1;
+        --md.bits_in_buffer;
+    }
+    else
+        md.o.freqhz = md.m.mark_freqhz;   // Idle
+
+    osc_get_samples(md.o, samples_out, md.m.samples_per_bit);
+}
+
+// How far the oscillator's phase moves on over the frame for a character
+int mod_frame_advance(const modemcfg& m, unsigned char c_in)
+{
+    int mark_step  = ((int64_t)m.mark_freqhz  * m.samples_per_bit) % sinelen;
+    int space_step = ((int64_t)m.space_freqhz * m.samples_per_bit) % sinelen;
+
+    int32_t bits = frame_bits(m.ff, c_in);
+    int64_t delta = 0;
+    for(int i=0; i<m.ff.frame_size; ++i)
+        delta += (bits & (1 << i)) ? mark_step : space_step;
+    return delta % sinelen;
+}
+
+static int gcd(int a, int b)
+{
+    while(b)
+    {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Every frame for a character sounds the same, given the phase the oscillator
+// starts it at.  The phase only ever moves in whole multiples of the bit
+// advance of the mark and space tones, so there are usually only a handful of
+// phases a frame can start at, and the cache can be exact.  If there are too
+// many, the start phase is quantised instead.
+bool wavecache_init(wavecache& wc, const modemcfg& m)
+{
+    wc.m = m;
+    wc.samples = NULL;
+    wc.state = NULL;
+    wc.frame_samples = (size_t)m.ff.frame_size * m.samples_per_bit;
+
+    int mark_step  = ((int64_t)m.mark_freqhz  * m.samples_per_bit) % sinelen;
+    int space_step = ((int64_t)m.space_freqhz * m.samples_per_bit) % sinelen;
+    wc.phase_step = gcd(gcd(mark_step, space_step), sinelen);
+    wc.n_phases   = sinelen / wc.phase_step;
+    wc.exact      = true;
+
+    size_t entry_bytes = wc.frame_samples * sizeof(int16_t) * 256;
+    int max_phases = WAVECACHE_MAX_BYTES / entry_bytes;
+    if(max_phases > WAVECACHE_MAX_PHASES) max_phases = WAVECACHE_MAX_PHASES;
+
+    if(wc.n_phases > max_phases)
+    {
+        if(max_phases < WAVECACHE_MIN_PHASES)
+        {
+            if(debug > 0)
+                fprintf(stderr, "Waveform cache: frames too long, not caching\n");
+            return false;
+        }
+        wc.n_phases   = max_phases;
+        wc.phase_step = (sinelen + max_phases - 1) / max_phases;
+        wc.n_phases   = (sinelen + wc.phase_step - 1) / wc.phase_step;
+        wc.exact      = false;
+    }
+
+    // Phase advance over each frame
+    for(int c=0; c<256; ++c)
+        wc.delta[c] = mod_frame_advance(m, c);
+
+    // Entries are filled in on first use - untouched pages cost nothing
+    wc.samples = (int16_t*)calloc(256 * wc.n_phases * wc.frame_samples, sizeof(int16_t));
+    wc.state   = (uint8_t*)calloc(256 * wc.n_phases, sizeof(uint8_t));
+    if(!wc.samples || !wc.state)
+    {
+        wavecache_free(wc);
+        return false;
+    }
+
+    if(debug > 0)
+        fprintf(stderr, "Waveform cache: %d %s phases, %ld samples per frame\n",
+                wc.n_phases, wc.exact ? "exact" : "quantised", wc.frame_samples);
+    return true;
+}
+
+void wavecache_free(wavecache& wc)
+{
+    free(wc.samples);
+    free(wc.state);
+    wc.samples = NULL;
+    wc.state = NULL;
+}
+
+// Copy out the frame for a character starting at phase p, and move p on.
+// Safe to share between threads: returns false if another thread is busy
+// filling the entry, and the caller should synthesize the frame itself.
+bool wavecache_get_frame(wavecache& wc, int& p, unsigned char c_in, int16_t *samples_out)
+{
+    int c = c_in & (( 1 << wc.m.ff.data_size ) - 1);
+    int q = ((p + wc.phase_step / 2) / wc.phase_step) % wc.n_phases;
+    size_t idx = (size_t)c * wc.n_phases + q;
+    int16_t *entry = wc.samples + idx * wc.frame_samples;
+
+    if(__atomic_load_n(&wc.state[idx], __ATOMIC_ACQUIRE) != WAVECACHE_READY)
+    {
+        uint8_t expect = WAVECACHE_EMPTY;
+        if(!__atomic_compare_exchange_n(&wc.state[idx], &expect, WAVECACHE_FILLING,
+                                        false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            if(expect != WAVECACHE_READY)
+                return false;
+        }
+        else
+        {
+            mod md;
+            mod_init(md, wc.m);
+            md.o.p = ((int64_t)q * wc.phase_step) % sinelen;
+            md.out_shift = frame_bits(wc.m.ff, c) << (32 - wc.m.ff.frame_size);
+            md.bits_in_buffer = wc.m.ff.frame_size;
+            for(int16_t *out = entry; md.bits_in_buffer > 0; out += wc.m.samples_per_bit)
+                mod_get_bit_samples(md, out);
+
+            __atomic_store_n(&wc.state[idx], WAVECACHE_READY, __ATOMIC_RELEASE);
+        }
+    }
+
+    memcpy(samples_out, entry, wc.frame_samples * sizeof(int16_t));
+    p = (p + wc.delta[c]) % sinelen;
+    return true;
+}
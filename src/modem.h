@@ -0,0 +1,343 @@
+#ifndef _MODEM_H_
+#define _MODEM_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+
+#define F_MARK_FREQ     1300
+#define F_SPACE_FREQ    2100
+#define B_MARK_FREQ     390
+#define B_SPACE_FREQ    450
+
+#define F_BIT_RATE      1200
+#define B_BIT_RATE      75
+
+// Null frequencies for the input MAFs
+#define F_FIRST_NULL    1280    // In the middle of the backward channel
+#define B_FIRST_NULL    60      // Just outside the band
+
+#define SKEW_LIMIT          0.2
+#define SKEW_CORRECT_FACTOR 3
+
+#define ERROR_LIMIT         3
+
+#define GATE_HYSTERESIS     0.5 // Carrier drops below this fraction of the detect level
+
+extern int quiet;
+extern int debug;
+extern int monit;
+
+extern volatile bool quit;
+
+struct maf {
+  int16_t *buf;
+  size_t N;
+  size_t p;
+  int32_t sum;
+};
+
+struct differentiator {
+  int16_t last;
+};
+
+// Sign of the phase change from one complex sample to the next
+struct discriminator {
+  int16_t last_i, last_q;
+  int16_t step;             // Output for a change either way
+};
+
+struct osc {
+  int freqhz;
+  int p;
+};
+
+struct framefmt {
+    int frame_size;         // Overall size of a frame
+    int32_t frame_pattern;  // Pattern to look for, including previous idle / stop bit
+    int32_t frame_mask;     // Mask to apply before checking for pattern
+    int32_t parity_mask;    // Mask to apply to find parity bit
+    bool parity_enable;     // Check parity at all ?
+    bool parity_even;       // Set to use even rather than odd parity
+    int data_offset;        // Number of bits after data
+    int data_mask;          // Mark to apply to get data bits
+    int data_size;          // Total number of data bits
+    bool lsb_first;         // Does lsb come first or last (endianism)
+};
+
+// The demodulator settings worth tuning for a line, e.g. with -mt
+struct tuning {
+    int first_null;         // Null frequency for the input MAFs
+    float skew_limit;       // Worst average skew of a good frame, in bits
+    int skew_correct;
+    int error_limit;
+};
+
+struct modemcfg {
+    int sample_rate;
+    int first_null;
+    int mark_freqhz;
+    int space_freqhz;
+    framefmt ff;
+    int samples_per_bit;
+    int max_skew;
+    int skew_correct;       // Divides the timing error corrected at each edge
+    int error_limit;        // Bad frames before output is held back
+    char errchar;
+    int gate_level;         // Carrier detect level (peak amplitude), 0 to always run
+    int leader;             // Bits of mark tone before the first frame
+    int trailer;            // Bits of mark tone after the last frame
+    int idle_timeout;       // Further bits of idle before dropping the carrier, 0 for never
+    bool fast_acquire;      // Lock on to the start bit after idle from the phase signal
+};
+
+// Simple bump allocator, so a session's buffers can come from one block
+struct pool {
+  char *base;
+  size_t size;
+  size_t used;
+};
+
+// Scratch buffers for one pass of the demodulator.  Nothing in here survives
+// between calls to demod_process, so demodulators run from the same thread
+// can share one set.
+struct dspbufs {
+  size_t N;                 // Maximum samples we can take at once
+  int16_t *bufI, *bufQ;
+  int16_t *bufAng;
+  int16_t *bufWork, *bufOut, *bufSign, *bufTiming;
+};
+
+// What became of a frame, for the optional frame event
+enum { FRAME_OK, FRAME_PARITY, FRAME_SKEW, FRAME_HELD };
+
+struct frameinfo {
+    uint64_t time;          // Sample clock when the last bit was read
+    unsigned char c;        // The data, or 0 if dropped for skew before decoding
+    int status;
+    int avg_skew;           // In samples
+};
+
+struct demod {
+    modemcfg m;
+    dspbufs *bufs;
+
+    // Local oscillator
+    osc o;
+    differentiator diffAng;
+    discriminator disc;
+    bool cheap_disc;        // Use disc rather than the angle and diffAng
+    maf mafI, mafQ, mafOut, mafBit;
+
+    int errcount;
+    int errtimeout;
+    int32_t out_shift;      // Raw serial shift-register
+    int frame_hold;         // How many bits to hold off for
+
+    // Quality monitoring
+    int num_transitions;
+    int total_skew;
+
+    // Frames delivered, rejected for skew or parity, and held back for errors
+    unsigned long frames_ok, frames_bad, frames_held;
+
+    int bit_wait;           // Samples left until we read a bit
+    uint64_t clock;         // Samples demodulated before the current block
+
+    // Meaning of +ve / -ve phase change
+    int phase_pos, phase_neg;
+
+    int state;              // What was the last state
+    bool line_idle;         // Are we in idle mode?
+    // Fast acquisition
+    int mark_run;           // Samples of steady mark, up to a bit's worth
+    int space_run;          // Samples of space since a likely start bit, 0 for none
+    int start_wait;         // bit_wait as the start bit would set it
+    int16_t out_last;       // Last filtered phase change, for placing the start bit edge
+
+    // Carrier detect gate
+    float gate_coeff_mark, gate_coeff_space;
+    bool carrier;
+    int gate_hang;          // Samples of low level left before dropping the carrier
+    int16_t *gate_prev;     // Last silent block, in case the carrier started in it
+    size_t gate_prev_n;
+
+    bool pooled;            // Buffers belong to a pool, don't free them
+
+    // Where received characters go
+    void (*put_char)(void *ctx, char c);
+    void *ctx;
+
+    // Optional carrier detect event
+    void (*carrier_event)(void *ctx, bool on);
+
+    // Optional event for the error count reaching the error limit
+    void (*error_event)(void *ctx);
+
+    // Optional event for every frame found, good or bad
+    void (*frame_event)(void *ctx, const frameinfo& fi);
+
+    // Optional signal monitor, handed each of the intermediate buffers
+    void (*monitor)(void *ctx, int16_t *buffers[], size_t n_bufs, size_t n_samples);
+
+    // New framing, waiting for the next frame boundary
+    modemcfg next_m;
+    int reconfig;           // Set once next_m is ready
+
+    // Other framings handed the same bits, each a demod with no filters of
+    // its own - see demod_init_framer
+    demod *framers;
+    int n_framers;
+};
+
+#define BANK_LANES  16      // Lines a bank demodulates in lockstep
+
+// A moving average per lane, with the delay lines interleaved by lane
+struct bankmaf {
+    size_t N;
+    size_t p;
+    int32_t sum[BANK_LANES];
+    int16_t *buf;           // [N][BANK_LANES]
+};
+
+// Demodulates up to BANK_LANES lines on the same channel in lockstep.  The
+// samples for all the lines are interleaved, [time][BANK_LANES], so that each
+// step of each filter is a vector operation across the lines.
+struct demodbank {
+    modemcfg m;
+    size_t N;               // Maximum samples per line at once
+    int n_lines;            // Lanes in use
+
+    osc o;                  // One LO for all: the lines share a sample clock
+    bankmaf mafI, mafQ, mafOut, mafBit;
+    int16_t diff_last[BANK_LANES];
+
+    // Bit timing
+    int32_t bit_wait[BANK_LANES];
+    int16_t state[BANK_LANES];
+    int16_t active[BANK_LANES];
+
+    demod lines[BANK_LANES];    // Framing and output - no filters
+
+    int16_t *loI, *loQ;         // [N]
+};
+
+#define WAVECACHE_MAX_PHASES    64
+#define WAVECACHE_MIN_PHASES    8
+#define WAVECACHE_MAX_BYTES     (64 << 20)
+
+enum { WAVECACHE_EMPTY, WAVECACHE_FILLING, WAVECACHE_READY };
+
+// Pre-rendered frames for every character, by oscillator start phase
+struct wavecache {
+    modemcfg m;
+    size_t frame_samples;   // Samples in one frame
+    int phase_step;         // Phase between cached start phases
+    int n_phases;
+    bool exact;             // Every reachable phase has its own entry
+    int delta[256];         // Phase advance over the frame for each character
+    int16_t *samples;       // [character][phase][frame_samples]
+    uint8_t *state;         // [character][phase], filled in on first use
+};
+
+struct mod {
+    modemcfg m;
+    osc o;
+    int32_t out_shift;
+    int bits_in_buffer;
+    wavecache *cache;       // Optional, may be shared between modulators
+};
+
+extern int16_t *sinebuf;
+extern size_t sinelen;
+
+bool pool_init(pool& p, size_t size);
+void pool_reset(pool& p);
+void pool_free(pool& p);
+
+int16_t* make_buffer(size_t N, pool *p = NULL);
+
+bool sin_init(float amplitude, size_t N);
+void sin_get_samples(int& p, int freqhz, int16_t *samples_out, size_t n_samples);
+
+bool maf_init(maf& maf, size_t N, pool *p = NULL);
+void maf_process(maf& maf, int16_t *samples_in, int16_t *samples_out,
+  size_t n_samples, bool nodivide = false);
+void osc_get_samples(osc& o, int16_t *samples_out, size_t n_samples);
+void osc_get_complex_samples(osc& o, int16_t *i_samples_out, int16_t *q_samples_out,
+  size_t n_samples);
+void mul_samples(int16_t *samples_a, int16_t *samples_b,
+  int16_t *samples_out, size_t n_samples);
+void sub_samples(int16_t *samples_a, int16_t *samples_b,
+  int16_t *samples_out, size_t n_samples);
+void deriv_samples(differentiator& d, int16_t *samples_in, int16_t *samples_out, size_t n_samples);
+void sgn_samples(int16_t *samples_in, int16_t *samples_out, size_t n_samples);
+void mag_complex_samples(int16_t *samples_i, int16_t *samples_q,
+  int16_t *samples_out, size_t n_samples);
+void ang_complex_samples(int16_t *samples_i, int16_t *samples_q,
+  int16_t *samples_out, size_t n_samples);
+void disc_complex_samples(discriminator& d, int16_t *samples_i, int16_t *samples_q,
+  int16_t *samples_out, size_t n_samples);
+
+bool parity(unsigned int v);
+uint64_t bin_as_octal(uint32_t w);
+
+bool init_framefmt(framefmt& ff, const char* fmt, int overlap);
+void init_modemcfg(modemcfg& m, int mark, int space, int firstnull, int samplerate, int baudrate, float skew_limit);
+void init_channel(modemcfg& m, bool forward, int samplerate, const tuning *t = NULL);
+void tuning_defaults(tuning& t, bool forward);
+
+bool dspbufs_init(dspbufs& b, size_t N, pool *p = NULL);
+void dspbufs_free(dspbufs& b);
+size_t dspbufs_size(size_t N);
+
+bool demod_init(demod& d, const modemcfg& m, dspbufs *bufs, pool *p = NULL);
+void demod_process(demod& d, int16_t *bufIn, size_t n);
+void demod_free(demod& d);
+size_t demod_size(const modemcfg& m, size_t N);
+
+// Change the framing and error handling of a running demodulator, at the
+// next frame boundary.  The filters are kept, so only a configuration that
+// demod_same_filters allows can be swapped in this way.  Returns false if the
+// last change hasn't taken effect yet.
+bool demod_same_filters(const modemcfg& a, const modemcfg& b);
+bool demod_reconfigure(demod& d, const modemcfg& m);
+
+// Framers try other frame formats on the bits a demodulator recovers, for
+// the cost of the framing alone.  demod_init_framer sets one up from a
+// configuration with the same filters as the demodulator's; demod_adopt_framer
+// has the demodulator carry on with one's framing and drops the rest.
+void demod_init_framer(demod& d, const modemcfg& m);
+void demod_adopt_framer(demod& d, const demod& f);
+
+// Shed load: find the phase change from the sign of the cross product of
+// successive samples, which needs no division, rather than from the angle.
+// Only the size of the change is lost, and the bits only go by its sign.
+// May be called from another thread than the one running the demodulator, and
+// takes effect from the next block.
+void demod_cheap_discriminator(demod& d, bool on);
+
+// Save and restore the filter, timing and framing state
+bool demod_save(const demod& d, FILE *f);
+bool demod_load(demod& d, FILE *f);
+
+// The stages of demod_process, without carrier detect or the monitor
+void demod_mix(demod& d, dspbufs& b, int16_t *bufIn, size_t n);
+void demod_phase(demod& d, dspbufs& b, size_t n);
+void demod_timing(demod& d, int16_t *bufOut, int16_t *bufTiming, size_t n);
+
+bool demodbank_init(demodbank& b, const modemcfg& m, int n_lines, size_t N);
+void demodbank_process(demodbank& b, int16_t *bufIn, size_t n);
+void demodbank_free(demodbank& b);
+
+void mod_init(mod& md, const modemcfg& m, wavecache *cache = NULL);
+void mod_load_byte(mod& md, unsigned char c_in);
+void mod_get_bit_samples(mod& md, int16_t *samples_out);
+void mod_get_frame_samples(mod& md, unsigned char c_in, int16_t *samples_out);
+int mod_frame_advance(const modemcfg& m, unsigned char c_in);
+
+bool wavecache_init(wavecache& wc, const modemcfg& m);
+void wavecache_free(wavecache& wc);
+bool wavecache_get_frame(wavecache& wc, int& p, unsigned char c_in, int16_t *samples_out);
+
+#endif
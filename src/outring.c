@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "outring.h"
+
+static struct outring_hdr *ring = NULL;
+static size_t ring_size;
+static uint64_t ring_mask;
+static char ring_name[NAME_MAX];
+
+bool outring_open(const char *name, size_t records, int sample_rate)
+{
+    // Round up, so a record is found with a mask
+    size_t capacity = 1;
+    while (capacity < records)
+        capacity <<= 1;
+    if (capacity > UINT32_MAX) {
+        fprintf(stderr, "Output ring of %zu records is too big\n", records);
+        return false;
+    }
+
+    snprintf(ring_name, sizeof(ring_name), "/v23-out-%s", name);
+    ring_size = sizeof(struct outring_hdr) + capacity * sizeof(struct outring_rec);
+
+    // Start afresh, even if an old writer left one behind
+    int fd = shm_open(ring_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(ring_name);
+        return false;
+    }
+    if (ftruncate(fd, ring_size) < 0) {
+        perror(ring_name);
+        close(fd);
+        shm_unlink(ring_name);
+        return false;
+    }
+
+    ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED) {
+        perror(ring_name);
+        ring = NULL;
+        shm_unlink(ring_name);
+        return false;
+    }
+
+    ring->version = OUTRING_VERSION;
+    ring->rec_size = sizeof(struct outring_rec);
+    ring->capacity = capacity;
+    ring->sample_rate = sample_rate;
+    ring->pid = getpid();
+    ring->head = 0;
+    ring_mask = capacity - 1;
+    __atomic_store_n(&ring->magic, OUTRING_MAGIC, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Safe to call from several threads at once: each claims its own record
+void outring_put(uint64_t time, int line, unsigned char c, int status, int skew)
+{
+    if (!ring)
+        return;
+
+    uint64_t s = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+    struct outring_rec *r = &ring->records[s & ring_mask];
+
+    // Mark it as being rewritten before touching the rest
+    __atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    r->time = time;
+    r->line = line;
+    r->c = c;
+    r->status = status;
+    r->skew = (skew > INT16_MAX) ? INT16_MAX : skew;
+    r->reserved = 0;
+
+    __atomic_store_n(&r->seq, s + 1, __ATOMIC_RELEASE);
+}
+
+void outring_close()
+{
+    if (!ring)
+        return;
+
+    // Readers that have it mapped keep it until they let go
+    munmap(ring, ring_size);
+    ring = NULL;
+    shm_unlink(ring_name);
+}
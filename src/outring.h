@@ -0,0 +1,63 @@
+#ifndef _OUTRING_H_
+#define _OUTRING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Structured output: every frame the demodulators find, as a record in a
+// ring in a named shared-memory object (/dev/shm/v23-out-NAME), for other
+// processes to map and poll with no system calls.  The ring never waits for
+// its readers: the oldest records are overwritten, and a reader that falls
+// more than a ring behind can tell from the sequence numbers.
+//
+// To read, map the object and follow `head`.  The record for sequence number
+// s (from 0) is records[s % capacity], and is complete once its own seq is
+// s + 1 - load it with acquire ordering before the rest, and again after to
+// be sure it wasn't overwritten in between.
+
+#define OUTRING_MAGIC   0x7632336f  // "v23o"
+#define OUTRING_VERSION 1
+
+// Record status
+enum {
+    OUTRING_OK,         // Delivered
+    OUTRING_PARITY,     // Bad parity - the error character went out, if any
+    OUTRING_SKEW,       // Too much timing skew - the data isn't decoded
+    OUTRING_HELD,       // Good, but held back after too many errors
+};
+
+struct outring_rec {
+    uint64_t seq;       // Sequence number + 1, written last
+    uint64_t time;      // Sample clock when the last bit was read
+    uint16_t line;      // Line with -n, 0 forward / 1 backward with -cd, else 0
+    uint8_t c;          // The data
+    uint8_t status;
+    int16_t skew;       // Average timing skew of the frame, in samples
+    int16_t reserved;
+};
+
+struct outring_hdr {
+    uint32_t magic;     // Set last, once the rest is filled in
+    uint32_t version;
+    uint32_t rec_size;  // sizeof(struct outring_rec)
+    uint32_t capacity;  // Records, a power of two
+    int32_t sample_rate;
+    int32_t pid;        // Of the writer
+    uint64_t head;      // Records written
+    struct outring_rec records[];
+};
+
+bool outring_open(const char *name, size_t records, int sample_rate);
+void outring_put(uint64_t time, int line, unsigned char c, int status, int skew);
+void outring_close();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
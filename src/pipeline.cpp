@@ -0,0 +1,177 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <ctime>
+#include <pthread.h>
+
+#include "modem.h"
+#include "blockq.h"
+#include "pipeline.h"
+
+// Each block carries the time it entered the pipeline, for measuring latency
+struct pipehdr {
+    uint64_t t_ns;
+};
+
+static demod *pd;
+static size_t pblock;
+static struct blockq *q_mix = NULL;     // Mixer to phase stage: I and Q
+static struct blockq *q_phase = NULL;   // Phase to timing stage: output and timing
+static dspbufs b_mix, b_phase;          // Scratch for the first two stages
+static pthread_t t_phase, t_timing;
+static int p_threads = 0;
+
+// Measured in the timing stage
+static uint64_t lat_total, lat_max, lat_blocks;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// The k'th buffer of samples in a slot
+static int16_t *slot_buf(void *slot, int k)
+{
+    return (int16_t*)((char*)slot + sizeof(pipehdr)) + k * pblock;
+}
+
+static void *write_slot(struct blockq *q)
+{
+    void *slot;
+    // Nothing is ever dropped: if the next stage is behind, wait for it
+    while(!(slot = blockq_write_slot(q)))
+        blockq_wait_space(q, 100);
+    return slot;
+}
+
+static void *read_slot(struct blockq *q, size_t *n)
+{
+    void *slot;
+    while(!(slot = blockq_read_slot(q, n)))
+        blockq_wait(q, 100);
+    return slot;
+}
+
+// An empty block marks the end of the stream
+static void *phase_thread(void *)
+{
+    for(;;)
+    {
+        size_t n;
+        void *in = read_slot(q_mix, &n);
+        void *out = write_slot(q_phase);
+
+        ((pipehdr*)out)->t_ns = ((pipehdr*)in)->t_ns;
+        if(n > 0)
+        {
+            dspbufs b = b_phase;
+            b.bufI      = slot_buf(in, 0);
+            b.bufQ      = slot_buf(in, 1);
+            b.bufOut    = slot_buf(out, 0);
+            b.bufTiming = slot_buf(out, 1);
+            demod_phase(*pd, b, n);
+        }
+
+        blockq_release(q_mix);
+        blockq_commit(q_phase, n);
+        if(n == 0) break;
+    }
+    return NULL;
+}
+
+static void *timing_thread(void *)
+{
+    for(;;)
+    {
+        size_t n;
+        void *in = read_slot(q_phase, &n);
+
+        if(n > 0)
+        {
+            demod_timing(*pd, slot_buf(in, 0), slot_buf(in, 1), n);
+
+            uint64_t lat = now_ns() - ((pipehdr*)in)->t_ns;
+            lat_total += lat;
+            if(lat > lat_max) lat_max = lat;
+            ++lat_blocks;
+        }
+
+        blockq_release(q_phase);
+        if(n == 0) break;
+    }
+    return NULL;
+}
+
+bool pipeline_start(demod& d, size_t block, size_t depth)
+{
+    pd = &d;
+    pblock = block;
+    lat_total = lat_max = lat_blocks = 0;
+
+    size_t slot_size = sizeof(pipehdr) + 2 * block * sizeof(int16_t);
+    q_mix   = blockq_create(slot_size, depth);
+    q_phase = blockq_create(slot_size, depth);
+    if(!q_mix || !q_phase || !dspbufs_init(b_mix, block) || !dspbufs_init(b_phase, block))
+    {
+        pipeline_stop();
+        return false;
+    }
+
+    if(pthread_create(&t_phase, NULL, phase_thread, NULL))
+    {
+        pipeline_stop();
+        return false;
+    }
+    ++p_threads;
+    if(pthread_create(&t_timing, NULL, timing_thread, NULL))
+    {
+        pipeline_stop();
+        return false;
+    }
+    ++p_threads;
+
+    return true;
+}
+
+// The first stage runs on the caller's thread
+void pipeline_put(int16_t *bufIn, size_t n)
+{
+    void *slot = write_slot(q_mix);
+    ((pipehdr*)slot)->t_ns = now_ns();
+
+    dspbufs b = b_mix;
+    b.bufI = slot_buf(slot, 0);
+    b.bufQ = slot_buf(slot, 1);
+    demod_mix(*pd, b, bufIn, n);
+
+    blockq_commit(q_mix, n);
+}
+
+// Waits for everything queued to be demodulated
+void pipeline_stop()
+{
+    if(p_threads > 0)
+    {
+        // Send the end marker down the pipeline.  If only the phase stage
+        // started, it passes the marker on to a queue no one reads - fine.
+        write_slot(q_mix);
+        blockq_commit(q_mix, 0);
+
+        pthread_join(t_phase, NULL);
+        if(p_threads > 1)
+            pthread_join(t_timing, NULL);
+        p_threads = 0;
+
+        if(!quiet && lat_blocks > 0)
+            fprintf(stderr, "Pipeline latency: %.2f ms average, %.2f ms maximum, over %lu blocks\n",
+                    lat_total / 1e6 / lat_blocks, lat_max / 1e6, (unsigned long)lat_blocks);
+    }
+
+    blockq_destroy(q_mix);
+    blockq_destroy(q_phase);
+    q_mix = q_phase = NULL;
+    dspbufs_free(b_mix);
+    dspbufs_free(b_phase);
+}
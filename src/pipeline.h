@@ -0,0 +1,12 @@
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+// Runs a demodulator as three stages - mixing and the input filters, phase
+// and the output filters, then bit timing and framing - with the last two on
+// threads of their own, connected by lock-free block queues.  Blocks of up to
+// `block` samples go in; at most `depth` can be waiting between each stage.
+bool pipeline_start(demod& d, size_t block, size_t depth);
+void pipeline_put(int16_t *bufIn, size_t n);
+void pipeline_stop();
+
+#endif
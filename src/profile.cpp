@@ -0,0 +1,134 @@
+#include <cstdio>
+#include <cstring>
+
+#include "profile.h"
+
+void profile_defaults(profile& p)
+{
+    tuning_defaults(p.chan[0], false);
+    tuning_defaults(p.chan[1], true);
+    p.block = 0;
+    p.format[0] = '\0';
+    p.errchar = -1;
+    p.channel = -1;
+}
+
+static const char *chan_names[2] = {"backward", "forward"};
+
+// Set one "channel.key" from its value, returning false if it isn't known
+static bool profile_set(profile& p, const char *key, const char *value)
+{
+    if(!strcmp(key, "block"))
+        return sscanf(value, "%zu", &p.block) == 1 && p.block > 0;
+    if(!strcmp(key, "format"))
+        return snprintf(p.format, sizeof(p.format), "%s", value) < (int)sizeof(p.format);
+    if(!strcmp(key, "errchar"))
+    {
+        // A single character, or "none"
+        if(!strcmp(value, "none"))
+            p.errchar = 0;
+        else if(strlen(value) == 1)
+            p.errchar = (unsigned char)value[0];
+        else
+            return false;
+        return true;
+    }
+    if(!strcmp(key, "channel"))
+    {
+        if(!strcmp(value, "forward"))
+            p.channel = 1;
+        else if(!strcmp(value, "backward"))
+            p.channel = 0;
+        else
+            return false;
+        return true;
+    }
+
+    for(int c = 0; c < 2; ++c)
+    {
+        size_t len = strlen(chan_names[c]);
+        if(strncmp(key, chan_names[c], len) || key[len] != '.')
+            continue;
+
+        tuning& t = p.chan[c];
+        const char *k = key + len + 1;
+        if(!strcmp(k, "first_null"))
+            return sscanf(value, "%d", &t.first_null) == 1 && t.first_null > 0;
+        if(!strcmp(k, "skew_limit"))
+            return sscanf(value, "%f", &t.skew_limit) == 1 && t.skew_limit > 0;
+        if(!strcmp(k, "skew_correct"))
+            return sscanf(value, "%d", &t.skew_correct) == 1 && t.skew_correct > 0;
+        if(!strcmp(k, "error_limit"))
+            return sscanf(value, "%d", &t.error_limit) == 1 && t.error_limit > 0;
+    }
+    return false;
+}
+
+// Settings not in the file are left as they are in p
+bool profile_load(profile& p, const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if(!f)
+    {
+        perror(path);
+        return false;
+    }
+
+    char line[256];
+    int lineno = 0;
+    bool ok = true;
+    while(ok && fgets(line, sizeof(line), f))
+    {
+        ++lineno;
+        char key[64], value[64];
+        int n = sscanf(line, " %63s %63s", key, value);
+        if(n < 1 || key[0] == '#')
+            continue;
+
+        if(n < 2 || !profile_set(p, key, value))
+        {
+            fprintf(stderr, "%s:%d: bad setting: %s", path, lineno, line);
+            ok = false;
+        }
+    }
+
+    fclose(f);
+    return ok;
+}
+
+bool profile_save(const profile& p, const char *path, const char *comment)
+{
+    FILE *f = fopen(path, "w");
+    if(!f)
+    {
+        perror(path);
+        return false;
+    }
+
+    fprintf(f, "# v23 profile\n");
+    if(comment)
+        fprintf(f, "# %s\n", comment);
+    for(int c = 0; c < 2; ++c)
+    {
+        const tuning& t = p.chan[c];
+        fprintf(f, "%s.first_null %d\n",   chan_names[c], t.first_null);
+        fprintf(f, "%s.skew_limit %g\n",   chan_names[c], t.skew_limit);
+        fprintf(f, "%s.skew_correct %d\n", chan_names[c], t.skew_correct);
+        fprintf(f, "%s.error_limit %d\n",  chan_names[c], t.error_limit);
+    }
+    if(p.block > 0)
+        fprintf(f, "block %zu\n", p.block);
+    if(p.format[0])
+        fprintf(f, "format %s\n", p.format);
+    if(p.errchar >= 0)
+        fprintf(f, p.errchar ? "errchar %c\n" : "errchar none\n", p.errchar);
+    if(p.channel >= 0)
+        fprintf(f, "channel %s\n", chan_names[p.channel]);
+
+    if(fclose(f))
+    {
+        perror(path);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,23 @@
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include "modem.h"
+
+// Settings loaded with -P, as written by the tuner (-mt), and reloaded on
+// SIGHUP.  A profile is a text file of "key value" lines, e.g.
+// "forward.skew_limit 0.15"; anything it doesn't mention keeps its default.
+struct profile {
+    tuning chan[2];         // Backward, forward
+    size_t block;           // Samples taken at once, 0 to leave it alone
+
+    // These override the command line when set
+    char format[64];        // Frame format, "" if not set
+    int errchar;            // Parity error character, 0 for none, -1 if not set
+    int channel;            // 1 for forward, 0 for backward, -1 if not set
+};
+
+void profile_defaults(profile& p);
+bool profile_load(profile& p, const char *path);
+bool profile_save(const profile& p, const char *path, const char *comment);
+
+#endif
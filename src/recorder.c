@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "wav.h"
+#include "recorder.h"
+
+static int rec_rate;
+static bool rec_compress;
+static size_t rec_len;              // Samples the ring holds
+static size_t rec_pos;              // Next sample to write
+static size_t rec_fill;             // Samples written, up to rec_len
+static void *rec_ring = NULL;       // int16_t, or uint8_t mu-law if compressed
+
+// Snapshot handed to the writer thread
+static void *snap_buf = NULL;
+static size_t snap_len;
+static char snap_reason[64];
+static bool snap_busy = false;
+static bool rec_quit = false;
+static bool rec_running = false;
+static pthread_t rec_thread;
+static pthread_mutex_t rec_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rec_cond = PTHREAD_COND_INITIALIZER;
+
+static volatile sig_atomic_t rec_triggered = 0;
+
+// G.711 mu-law, halving the memory needed at some cost in fidelity
+#define MULAW_BIAS  0x84
+#define MULAW_CLIP  32635
+
+static uint8_t mulaw_encode(int16_t sample)
+{
+    int s = sample;
+    int sign = (s < 0) ? 0x80 : 0;
+    if (sign)
+        s = -s;
+    if (s > MULAW_CLIP)
+        s = MULAW_CLIP;
+    s += MULAW_BIAS;
+
+    int exponent = 7;
+    for (int mask = 0x4000; !(s & mask) && exponent > 0; mask >>= 1)
+        --exponent;
+    int mantissa = (s >> (exponent + 3)) & 0x0f;
+
+    return ~(sign | (exponent << 4) | mantissa);
+}
+
+static int16_t mulaw_decode(uint8_t u)
+{
+    u = ~u;
+    int exponent = (u >> 4) & 0x07;
+    int mantissa = u & 0x0f;
+    int s = (((mantissa << 3) + MULAW_BIAS) << exponent) - MULAW_BIAS;
+    return (u & 0x80) ? -s : s;
+}
+
+static void write_snapshot(const void *buf, size_t len, const char *reason)
+{
+    static int seq = 0;
+    char stamp[32], name[64];
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+    snprintf(name, sizeof(name), "v23-%s-%d.wav", stamp, seq++);
+
+    FILE *f = fopen(name, "wb");
+    if (!f) {
+        perror(name);
+        return;
+    }
+
+    uint8_t hdr[WAV_HEADER_SIZE];
+    wav_header(hdr, rec_rate, 1, len * sizeof(int16_t));
+    fwrite(hdr, sizeof(hdr), 1, f);
+
+    if (rec_compress) {
+        // Expand in chunks rather than needing a second full-size buffer
+        int16_t chunk[1024];
+        const uint8_t *u = buf;
+        for (size_t i = 0; i < len; i += 1024) {
+            size_t n = (len - i < 1024) ? len - i : 1024;
+            for (size_t j = 0; j < n; ++j)
+                chunk[j] = mulaw_decode(u[i + j]);
+            fwrite(chunk, sizeof(int16_t), n, f);
+        }
+    } else {
+        fwrite(buf, sizeof(int16_t), len, f);
+    }
+
+    if (fclose(f))
+        perror(name);
+    else
+        fprintf(stderr, "Flight recorder: wrote %.2fs to %s (%s)\n",
+                (double)len / rec_rate, name, reason);
+}
+
+static void *recorder_writer(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&rec_mutex);
+    for (;;) {
+        while (!snap_busy && !rec_quit)
+            pthread_cond_wait(&rec_cond, &rec_mutex);
+        if (!snap_busy)
+            break;
+
+        pthread_mutex_unlock(&rec_mutex);
+        write_snapshot(snap_buf, snap_len, snap_reason);
+        pthread_mutex_lock(&rec_mutex);
+
+        snap_busy = false;
+    }
+    pthread_mutex_unlock(&rec_mutex);
+    return NULL;
+}
+
+bool recorder_start(int rate, int seconds, bool compress)
+{
+    size_t sample_size = compress ? sizeof(uint8_t) : sizeof(int16_t);
+
+    rec_rate = rate;
+    rec_compress = compress;
+    rec_len = (size_t)rate * seconds;
+    rec_pos = 0;
+    rec_fill = 0;
+
+    // Both buffers up front - nothing is allocated when an error hits
+    rec_ring = calloc(rec_len, sample_size);
+    snap_buf = calloc(rec_len, sample_size);
+    if (!rec_ring || !snap_buf) {
+        recorder_stop();
+        return false;
+    }
+
+    rec_quit = false;
+    if (pthread_create(&rec_thread, NULL, recorder_writer, NULL)) {
+        recorder_stop();
+        return false;
+    }
+    rec_running = true;
+    return true;
+}
+
+void recorder_put(const int16_t *buf, size_t n)
+{
+    if (!rec_ring)
+        return;
+
+    for (size_t i = 0; i < n; ) {
+        size_t run = rec_len - rec_pos;
+        if (run > n - i)
+            run = n - i;
+
+        if (rec_compress) {
+            uint8_t *u = (uint8_t *)rec_ring + rec_pos;
+            for (size_t j = 0; j < run; ++j)
+                u[j] = mulaw_encode(buf[i + j]);
+        } else {
+            memcpy((int16_t *)rec_ring + rec_pos, buf + i, run * sizeof(int16_t));
+        }
+
+        i += run;
+        rec_pos = (rec_pos + run) % rec_len;
+    }
+
+    rec_fill = (rec_fill + n > rec_len) ? rec_len : rec_fill + n;
+
+    if (rec_triggered) {
+        rec_triggered = 0;
+        recorder_snapshot("signal");
+    }
+}
+
+// Copy out the ring, oldest first, for the writer thread to save.  Called
+// from the thread doing recorder_put.
+void recorder_snapshot(const char *reason)
+{
+    if (!rec_ring)
+        return;
+
+    pthread_mutex_lock(&rec_mutex);
+    if (snap_busy) {
+        pthread_mutex_unlock(&rec_mutex);
+        fprintf(stderr, "Flight recorder: still writing the last snapshot, skipping (%s)\n", reason);
+        return;
+    }
+
+    size_t sample_size = rec_compress ? sizeof(uint8_t) : sizeof(int16_t);
+    size_t start = (rec_pos + rec_len - rec_fill) % rec_len;
+    size_t first = rec_len - start;
+    if (first > rec_fill)
+        first = rec_fill;
+
+    memcpy(snap_buf, (char *)rec_ring + start * sample_size, first * sample_size);
+    memcpy((char *)snap_buf + first * sample_size, rec_ring, (rec_fill - first) * sample_size);
+    snap_len = rec_fill;
+    snprintf(snap_reason, sizeof(snap_reason), "%s", reason);
+
+    snap_busy = true;
+    pthread_cond_signal(&rec_cond);
+    pthread_mutex_unlock(&rec_mutex);
+}
+
+void recorder_trigger()
+{
+    rec_triggered = 1;
+}
+
+// Waits for any snapshot in progress to be written
+void recorder_stop()
+{
+    if (rec_running) {
+        pthread_mutex_lock(&rec_mutex);
+        rec_quit = true;
+        pthread_cond_signal(&rec_cond);
+        pthread_mutex_unlock(&rec_mutex);
+        pthread_join(rec_thread, NULL);
+        rec_running = false;
+    }
+
+    free(rec_ring);
+    free(snap_buf);
+    rec_ring = NULL;
+    snap_buf = NULL;
+}
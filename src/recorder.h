@@ -0,0 +1,24 @@
+#ifndef _RECORDER_H_
+#define _RECORDER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Flight recorder: keeps the last few seconds of input audio in memory, and
+// writes them to a timestamped WAV file when asked
+bool recorder_start(int rate, int seconds, bool compress);
+void recorder_put(const int16_t *buf, size_t n);
+void recorder_snapshot(const char *reason);
+void recorder_trigger();        // Async-signal-safe: snapshot on the next put
+void recorder_stop();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
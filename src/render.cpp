@@ -0,0 +1,276 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "modem.h"
+#include "render.h"
+#include "wav.h"
+
+#define RENDER_MAX_WORKERS  64
+#define RENDER_BATCH        256     // Frames rendered for each write
+
+// Each worker renders one run of the input, starting at the phase the
+// oscillator will have reached by then, and writes it where it belongs in
+// the output.  Every frame is the same length, so that's known in advance.
+struct renderjob {
+    const rendercfg *cfg;
+    wavecache *cache;           // Shared, NULL for none
+    const unsigned char *in;
+    size_t from, to;            // Characters
+    int phase;                  // Oscillator phase at from
+    int fd;
+    off_t offset;               // Where from's frame goes in the output
+    bool ok;
+};
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool write_all(int fd, const void *buf, size_t len, off_t offset)
+{
+    const char *p = (const char*)buf;
+    while(len > 0)
+    {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if(n <= 0)
+            return false;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+// First pass: how far a run of the input moves the oscillator's phase on
+static void *render_advance(void *arg)
+{
+    renderjob& j = *(renderjob*)arg;
+    int delta[256];
+    for(int c = 0; c < 256; ++c)
+        delta[c] = mod_frame_advance(j.cfg->m, c);
+
+    int64_t p = 0;
+    for(size_t i = j.from; i < j.to; ++i)
+        p += delta[j.in[i]];
+    j.phase = p % sinelen;
+    return NULL;
+}
+
+// Second pass: the samples themselves
+static void *render_frames(void *arg)
+{
+    renderjob& j = *(renderjob*)arg;
+    const modemcfg& m = j.cfg->m;
+    size_t frame_samples = (size_t)m.ff.frame_size * m.samples_per_bit;
+
+    int16_t *buf = make_buffer(frame_samples * RENDER_BATCH);
+    if(!buf)
+    {
+        fprintf(stderr, "Failed to allocate buffers\n");
+        j.ok = false;
+        return NULL;
+    }
+
+    mod md;
+    mod_init(md, m, j.cache);
+    md.o.p = j.phase;
+
+    j.ok = true;
+    off_t offset = j.offset;
+    for(size_t i = j.from; i < j.to && j.ok; )
+    {
+        size_t n = 0;
+        for(; n < RENDER_BATCH && i < j.to; ++n, ++i)
+            mod_get_frame_samples(md, j.in[i], buf + n * frame_samples);
+
+        size_t bytes = n * frame_samples * sizeof(int16_t);
+        j.ok = write_all(j.fd, buf, bytes, offset);
+        offset += bytes;
+    }
+    if(!j.ok)
+        perror(j.cfg->output);
+
+    free(buf);
+    return NULL;
+}
+
+// Mark tone for the leader or trailer, from phase p
+static bool render_idle(const rendercfg& cfg, int fd, off_t offset, int bits, int& p)
+{
+    const modemcfg& m = cfg.m;
+    int16_t *buf = make_buffer(m.samples_per_bit);
+    if(!buf)
+        return false;
+
+    mod md;
+    mod_init(md, m);
+    md.o.p = p;
+
+    bool ok = true;
+    for(int b = 0; b < bits && ok; ++b)
+    {
+        mod_get_bit_samples(md, buf);
+        ok = write_all(fd, buf, m.samples_per_bit * sizeof(int16_t), offset);
+        offset += m.samples_per_bit * sizeof(int16_t);
+    }
+    p = md.o.p;
+
+    free(buf);
+    if(!ok)
+        perror(cfg.output);
+    return ok;
+}
+
+static void run_workers(void *(*fn)(void *), renderjob jobs[], int n)
+{
+    pthread_t threads[RENDER_MAX_WORKERS];
+    int started = 0;
+    for(; started < n; ++started)
+        if(pthread_create(&threads[started], NULL, fn, &jobs[started]))
+            break;
+
+    // Any that couldn't be started are done here instead
+    for(int i = started; i < n; ++i)
+        fn(&jobs[i]);
+    for(int i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+}
+
+bool render_run(const rendercfg& cfg)
+{
+    const modemcfg& m = cfg.m;
+    uint64_t start = now_ns();
+
+    // The input, mapped rather than read so it can be any size
+    int in_fd = open(cfg.input, O_RDONLY);
+    struct stat st;
+    if(in_fd < 0 || fstat(in_fd, &st) < 0)
+    {
+        perror(cfg.input);
+        if(in_fd >= 0) close(in_fd);
+        return false;
+    }
+    size_t n_chars = st.st_size;
+    const unsigned char *in = NULL;
+    if(n_chars > 0)
+    {
+        in = (const unsigned char*)mmap(NULL, n_chars, PROT_READ, MAP_PRIVATE, in_fd, 0);
+        if(in == MAP_FAILED)
+        {
+            perror(cfg.input);
+            close(in_fd);
+            return false;
+        }
+        madvise((void*)in, n_chars, MADV_SEQUENTIAL);
+    }
+    close(in_fd);
+
+    size_t spb = m.samples_per_bit;
+    size_t frame_bytes = (size_t)m.ff.frame_size * spb * sizeof(int16_t);
+    uint64_t data_bytes = ((uint64_t)(m.leader + m.trailer) * spb * sizeof(int16_t)) +
+                          (uint64_t)n_chars * frame_bytes;
+
+    size_t len = strlen(cfg.output);
+    bool wav = len >= 4 && strcmp(cfg.output + len - 4, ".wav") == 0;
+    off_t header = wav ? WAV_HEADER_SIZE : 0;
+    if(wav && data_bytes > UINT32_MAX)
+    {
+        fprintf(stderr, "Error: %llu bytes of audio is too much for a WAV file - write raw samples instead\n",
+                (unsigned long long)data_bytes);
+        if(in) munmap((void*)in, n_chars);
+        return false;
+    }
+
+    int fd = open(cfg.output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0 || ftruncate(fd, header + data_bytes) < 0)
+    {
+        perror(cfg.output);
+        if(fd >= 0) close(fd);
+        if(in) munmap((void*)in, n_chars);
+        return false;
+    }
+
+    bool ok = true;
+    if(wav)
+    {
+        uint8_t hdr[WAV_HEADER_SIZE];
+        wav_header(hdr, m.sample_rate, 1, data_bytes);
+        ok = write_all(fd, hdr, sizeof(hdr), 0);
+    }
+
+    // Frames come from the waveform cache where possible, shared by all
+    wavecache wc;
+    bool cached = wavecache_init(wc, m);
+
+    // Split the input into a run for each worker
+    int workers = cfg.workers;
+    if(workers < 1) workers = 1;
+    if(workers > RENDER_MAX_WORKERS) workers = RENDER_MAX_WORKERS;
+    if((size_t)workers > n_chars) workers = (n_chars > 0) ? n_chars : 1;
+
+    renderjob jobs[RENDER_MAX_WORKERS];
+    for(int w = 0; w < workers; ++w)
+    {
+        renderjob& j = jobs[w];
+        j.cfg = &cfg;
+        j.cache = cached ? &wc : NULL;
+        j.in = in;
+        j.from = n_chars * w / workers;
+        j.to = n_chars * (w + 1) / workers;
+        j.fd = fd;
+        j.ok = true;
+    }
+
+    // Where each run's phase starts is what the leader and every run before
+    // it add up to
+    int p = 0;
+    ok = ok && render_idle(cfg, fd, header, m.leader, p);
+    run_workers(render_advance, jobs, workers);
+    off_t offset = header + (off_t)m.leader * spb * sizeof(int16_t);
+    for(int w = 0; w < workers; ++w)
+    {
+        int advance = jobs[w].phase;
+        jobs[w].phase = p;
+        jobs[w].offset = offset;
+        p = (p + advance) % sinelen;
+        offset += (off_t)(jobs[w].to - jobs[w].from) * frame_bytes;
+    }
+
+    if(ok)
+    {
+        run_workers(render_frames, jobs, workers);
+        for(int w = 0; w < workers; ++w)
+            ok = ok && jobs[w].ok;
+    }
+    ok = ok && render_idle(cfg, fd, offset, m.trailer, p);
+
+    if(close(fd) < 0 && ok)
+    {
+        perror(cfg.output);
+        ok = false;
+    }
+    if(cached)
+        wavecache_free(wc);
+    if(in)
+        munmap((void*)in, n_chars);
+
+    if(ok && !quiet)
+    {
+        double secs = (now_ns() - start) / 1e9;
+        double audio = (double)data_bytes / sizeof(int16_t) / m.sample_rate;
+        fprintf(stderr, "Rendered %zu characters to %s: %.1f s of audio in %.2f s (%.0fx real time) on %d threads\n",
+                n_chars, cfg.output, audio, secs, (secs > 0) ? audio / secs : 0, workers);
+    }
+    return ok;
+}
@@ -0,0 +1,18 @@
+#ifndef _RENDER_H_
+#define _RENDER_H_
+
+#include "modem.h"
+
+struct rendercfg {
+    const char *input;          // Characters to send
+    const char *output;         // A WAV file if it ends in .wav, raw samples otherwise
+    modemcfg m;
+    int workers;                // Threads to render on
+};
+
+// Render a file of characters to audio as fast as it can be made, rather
+// than in real time: the leader, every character back to back, and the
+// trailer - just what the modulator would send for it.
+bool render_run(const rendercfg& cfg);
+
+#endif
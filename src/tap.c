@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "blockq.h"
+#include "tap.h"
+
+static struct blockq *tap_queue = NULL;
+static pthread_t tap_thread;
+static int tap_fd = -1;
+static size_t tap_bufs = 0;
+
+static atomic_bool tap_quit;
+static atomic_ulong tap_dropped;     // Blocks the decoder couldn't queue
+
+static bool write_all(const char *p, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(tap_fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void *tap_writer(void *arg)
+{
+    (void)arg;
+    unsigned long reported = 0;
+    bool failed = false;
+
+    for (;;) {
+        size_t len;
+        char *block = blockq_read_slot(tap_queue, &len);
+        if (!block) {
+            if (!atomic_load(&tap_quit)) {
+                blockq_wait(tap_queue, 200);
+                continue;
+            }
+            // One last look, for a block committed just before tap_quit was set
+            block = blockq_read_slot(tap_queue, &len);
+            if (!block)
+                break;
+        }
+
+        if (!failed && !write_all(block, len)) {
+            perror("Monitor output");
+            failed = true;      // Keep draining, so the decoder never notices
+        }
+        blockq_release(tap_queue);
+
+        unsigned long dropped = atomic_load(&tap_dropped);
+        if (dropped != reported) {
+            fprintf(stderr, "Monitor: dropped %lu blocks (%lu in total)\n",
+                    dropped - reported, dropped);
+            reported = dropped;
+        }
+    }
+    return NULL;
+}
+
+bool tap_start(int fd, size_t n_bufs, size_t max_samples, size_t depth)
+{
+    tap_queue = blockq_create(n_bufs * max_samples * sizeof(int16_t), depth);
+    if (!tap_queue)
+        return false;
+
+    tap_fd = fd;
+    tap_bufs = n_bufs;
+    atomic_init(&tap_quit, false);
+    atomic_init(&tap_dropped, 0);
+
+    if (pthread_create(&tap_thread, NULL, tap_writer, NULL)) {
+        blockq_destroy(tap_queue);
+        tap_queue = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Called from the decoding thread: never blocks
+void tap_put(int16_t *buffers[], size_t n_bufs, size_t n_samples)
+{
+    if (!tap_queue || n_bufs != tap_bufs)
+        return;
+
+    int16_t *out = blockq_write_slot(tap_queue);
+    size_t max_samples = blockq_slot_size(tap_queue) / (n_bufs * sizeof(int16_t));
+    if (!out || n_samples > max_samples) {
+        atomic_fetch_add(&tap_dropped, 1);
+        return;
+    }
+
+    for (size_t i = 0; i < n_samples; ++i)
+        for (size_t j = 0; j < n_bufs; ++j)
+            *out++ = buffers[j][i];
+
+    blockq_commit(tap_queue, n_bufs * n_samples * sizeof(int16_t));
+}
+
+// Write out whatever is queued, then stop
+void tap_stop()
+{
+    if (!tap_queue)
+        return;
+
+    atomic_store(&tap_quit, true);
+    blockq_wake(tap_queue);
+    pthread_join(tap_thread, NULL);
+
+    unsigned long dropped = atomic_load(&tap_dropped);
+    if (dropped)
+        fprintf(stderr, "Monitor: %lu blocks dropped in total\n", dropped);
+
+    blockq_destroy(tap_queue);
+    tap_queue = NULL;
+}
@@ -0,0 +1,22 @@
+#ifndef _TAP_H_
+#define _TAP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Monitor tap: interleaves probe buffers into a queue that a separate thread
+// writes out, so a slow consumer costs monitor data rather than audio
+bool tap_start(int fd, size_t n_bufs, size_t max_samples, size_t depth);
+void tap_put(int16_t *buffers[], size_t n_bufs, size_t n_samples);
+void tap_stop();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
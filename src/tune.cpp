@@ -0,0 +1,412 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include "modem.h"
+#include "profile.h"
+#include "wav.h"
+#include "tune.h"
+
+// The grid tried: every combination of these
+static const float null_scales[]   = {0.8, 0.9, 1.0, 1.1, 1.2};    // Of the default
+static const float skew_limits[]   = {0.1, 0.15, 0.2, 0.3};
+static const int   skew_corrects[] = {2, 3, 4};
+static const int   error_limits[]  = {2, 3, 5};
+static const size_t blocks[]       = {256, 1024, 4096};
+
+#define N_OF(a) (sizeof(a) / sizeof(a[0]))
+
+struct recording {
+    char *name;
+    int16_t *samples;
+    size_t n;
+};
+
+struct trial {
+    tuning t;
+    size_t block;
+
+    // Results, over the whole corpus
+    unsigned long frames_ok, frames_bad, frames_held;
+    double cpu;             // Seconds
+    bool failed;
+};
+
+static tunecfg tcfg;
+static int sample_rate;
+static recording *recs = NULL;
+static int n_recs = 0;
+static trial *trials = NULL;
+static int n_trials;
+
+static int next_trial;
+static pthread_mutex_t next_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static double thread_cpu()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Proportion of the frames seen that were delivered.  Frames a setting never
+// finds at all aren't seen, so this is only a tie-break: every trial replays
+// the same corpus, and frames_ok is what counts.
+static double frame_rate(const trial& t)
+{
+    unsigned long seen = t.frames_ok + t.frames_bad + t.frames_held;
+    return seen ? (double)t.frames_ok / seen : 0.0;
+}
+
+static bool ends_with(const char *s, const char *suffix)
+{
+    size_t ls = strlen(s), lx = strlen(suffix);
+    return ls >= lx && !strcmp(s + ls - lx, suffix);
+}
+
+static int16_t *raw_load(const char *path, size_t *n)
+{
+    FILE *f = fopen(path, "rb");
+    if(!f)
+    {
+        perror(path);
+        return NULL;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long bytes = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    int16_t *samples = (int16_t*)malloc(bytes > 0 ? bytes : 1);
+    if(samples)
+        *n = fread(samples, sizeof(int16_t), bytes / sizeof(int16_t), f);
+    else
+        fprintf(stderr, "%s: out of memory\n", path);
+
+    fclose(f);
+    return samples;
+}
+
+static int by_name(const void *a, const void *b)
+{
+    return strcmp(((const recording*)a)->name, ((const recording*)b)->name);
+}
+
+// Everything is read into memory up front, so the trials only cost CPU
+static bool load_corpus(const char *dir)
+{
+    DIR *d = opendir(dir);
+    if(!d)
+    {
+        perror(dir);
+        return false;
+    }
+
+    bool ok = true;
+    int cap = 0;
+    sample_rate = 0;
+    struct dirent *e;
+    while(ok && (e = readdir(d)))
+    {
+        bool wav = ends_with(e->d_name, ".wav");
+        if(!wav && !ends_with(e->d_name, ".raw"))
+            continue;
+
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+
+        recording r;
+        int rate = tcfg.sample_rate;
+        r.n = 0;
+        r.samples = wav ? wav_load(path, &rate, &r.n) : raw_load(path, &r.n);
+        if(!r.samples)
+        {
+            ok = false;
+            break;
+        }
+
+        // The sine table is made for one rate
+        if(sample_rate == 0)
+            sample_rate = rate;
+        else if(rate != sample_rate)
+        {
+            fprintf(stderr, "%s: recorded at %d Hz, but the rest are %d Hz\n", path, rate, sample_rate);
+            free(r.samples);
+            ok = false;
+            break;
+        }
+
+        if(n_recs == cap)
+        {
+            cap = cap ? 2 * cap : 16;
+            recording *more = (recording*)realloc(recs, cap * sizeof(recording));
+            if(!more)
+            {
+                free(r.samples);
+                ok = false;
+                break;
+            }
+            recs = more;
+        }
+        r.name = strdup(e->d_name);
+        recs[n_recs++] = r;
+    }
+    closedir(d);
+
+    if(ok && n_recs == 0)
+    {
+        fprintf(stderr, "No .wav or .raw recordings in %s\n", dir);
+        ok = false;
+    }
+    if(ok)
+        qsort(recs, n_recs, sizeof(recording), by_name);
+    return ok;
+}
+
+static void free_corpus()
+{
+    for(int i = 0; i < n_recs; ++i)
+    {
+        free(recs[i].name);
+        free(recs[i].samples);
+    }
+    free(recs);
+    recs = NULL;
+    n_recs = 0;
+}
+
+static void make_grid()
+{
+    tuning def;
+    tuning_defaults(def, tcfg.forward);
+
+    n_trials = N_OF(null_scales) * N_OF(skew_limits) * N_OF(skew_corrects) *
+               N_OF(error_limits) * N_OF(blocks);
+    trials = (trial*)calloc(n_trials, sizeof(trial));
+    if(!trials)
+        return;
+
+    trial *t = trials;
+    for(size_t a = 0; a < N_OF(null_scales); ++a)
+    for(size_t b = 0; b < N_OF(skew_limits); ++b)
+    for(size_t c = 0; c < N_OF(skew_corrects); ++c)
+    for(size_t e = 0; e < N_OF(error_limits); ++e)
+    for(size_t k = 0; k < N_OF(blocks); ++k)
+    {
+        t->t.first_null   = def.first_null * null_scales[a] + 0.5;
+        t->t.skew_limit   = skew_limits[b];
+        t->t.skew_correct = skew_corrects[c];
+        t->t.error_limit  = error_limits[e];
+        t->block          = blocks[k];
+        ++t;
+    }
+}
+
+// Run the whole corpus through one set of settings
+static void run_trial(trial& t)
+{
+    modemcfg m;
+    dspbufs bufs;
+    init_framefmt(m.ff, tcfg.frame_format, 1);
+    init_channel(m, tcfg.forward, sample_rate, &t.t);
+
+    if(!dspbufs_init(bufs, t.block))
+    {
+        t.failed = true;
+        return;
+    }
+
+    for(int r = 0; r < n_recs && !quit; ++r)
+    {
+        demod d;
+        if(!demod_init(d, m, &bufs))
+        {
+            t.failed = true;
+            break;
+        }
+
+        // Only the demodulator is timed
+        double start = thread_cpu();
+        for(size_t i = 0; i < recs[r].n; i += t.block)
+        {
+            size_t n = recs[r].n - i;
+            if(n > t.block) n = t.block;
+            demod_process(d, recs[r].samples + i, n);
+        }
+        t.cpu += thread_cpu() - start;
+
+        t.frames_ok   += d.frames_ok;
+        t.frames_bad  += d.frames_bad;
+        t.frames_held += d.frames_held;
+        demod_free(d);
+    }
+
+    dspbufs_free(bufs);
+}
+
+static void *tune_worker(void *)
+{
+    for(;;)
+    {
+        pthread_mutex_lock(&next_mutex);
+        int i = next_trial++;
+        pthread_mutex_unlock(&next_mutex);
+
+        if(i >= n_trials || quit)
+            break;
+        run_trial(trials[i]);
+    }
+    return NULL;
+}
+
+// Does a beat b?  As many good frames or more, and as little CPU or less, and
+// not identical.
+static bool dominates(const trial& a, const trial& b)
+{
+    return a.frames_ok >= b.frames_ok && a.cpu <= b.cpu &&
+           (a.frames_ok > b.frames_ok || a.cpu < b.cpu);
+}
+
+static int by_cpu(const void *a, const void *b)
+{
+    const trial *ta = *(const trial**)a, *tb = *(const trial**)b;
+    return (ta->cpu > tb->cpu) - (ta->cpu < tb->cpu);
+}
+
+// The most frames, then the best rate, then the least CPU
+static bool better(const trial& a, const trial& b)
+{
+    if(a.frames_ok != b.frames_ok) return a.frames_ok > b.frames_ok;
+    double ra = frame_rate(a), rb = frame_rate(b);
+    if(ra != rb) return ra > rb;
+    return a.cpu < b.cpu;
+}
+
+static bool report(double audio_secs)
+{
+    trial **front = (trial**)calloc(n_trials, sizeof(trial*));
+    if(!front)
+        return false;
+
+    int n_front = 0;
+    for(int i = 0; i < n_trials; ++i)
+    {
+        if(trials[i].failed)
+            continue;
+        bool beaten = false;
+        for(int j = 0; j < n_trials && !beaten; ++j)
+            beaten = !trials[j].failed && dominates(trials[j], trials[i]);
+        if(!beaten)
+            front[n_front++] = &trials[i];
+    }
+
+    if(n_front == 0)
+    {
+        fprintf(stderr, "Every trial failed\n");
+        free(front);
+        return false;
+    }
+
+    qsort(front, n_front, sizeof(trial*), by_cpu);
+
+    trial *best = front[0];
+    printf("first_null skew_limit skew_correct error_limit block   frames  rate     cpu/s  x realtime\n");
+    for(int i = 0; i < n_front; ++i)
+    {
+        const trial& t = *front[i];
+        printf("%10d %10g %12d %11d %5zu %8lu %6.4f %9.3f %11.0f\n",
+               t.t.first_null, t.t.skew_limit, t.t.skew_correct, t.t.error_limit, t.block,
+               t.frames_ok, frame_rate(t), t.cpu, t.cpu > 0 ? audio_secs / t.cpu : 0.0);
+        if(better(t, *best))
+            best = front[i];
+    }
+    fflush(stdout);
+
+    // Keep whatever the profile says about the other channel
+    profile p;
+    profile_defaults(p);
+    if(access(tcfg.profile_path, F_OK) == 0 && !profile_load(p, tcfg.profile_path))
+    {
+        free(front);
+        return false;
+    }
+    p.chan[tcfg.forward ? 1 : 0] = best->t;
+    p.block = best->block;
+
+    char comment[160];
+    snprintf(comment, sizeof(comment),
+             "%s channel tuned on %d recordings: %lu frames, rate %.4f, %.3f s CPU",
+             tcfg.forward ? "Forward" : "Backward", n_recs, best->frames_ok,
+             frame_rate(*best), best->cpu);
+    bool ok = profile_save(p, tcfg.profile_path, comment);
+    if(ok && !quiet)
+        fprintf(stderr, "Wrote %s\n", tcfg.profile_path);
+
+    free(front);
+    return ok;
+}
+
+bool tune_run(const tunecfg& cfg)
+{
+    tcfg = cfg;
+    bool ok = false;
+    pthread_t *threads = NULL;
+    int started = 0;
+    double audio_secs = 0;
+
+    if(!load_corpus(cfg.corpus))
+        goto out;
+
+    if(!sin_init(32767.0, sample_rate))
+    {
+        fprintf(stderr, "Failed to initialize sine buffer\n");
+        goto out;
+    }
+
+    make_grid();
+    threads = (pthread_t*)calloc(cfg.workers > 0 ? cfg.workers : 1, sizeof(pthread_t));
+    if(!trials || !threads)
+    {
+        fprintf(stderr, "Failed to allocate the trials\n");
+        goto out;
+    }
+
+    for(int r = 0; r < n_recs; ++r)
+        audio_secs += (double)recs[r].n / sample_rate;
+
+    if(!quiet)
+        fprintf(stderr, "Tuning the %s channel on %d recordings (%.1f s at %d Hz): %d trials on %d threads\n",
+                cfg.forward ? "forward" : "backward", n_recs, audio_secs, sample_rate,
+                n_trials, cfg.workers);
+
+    next_trial = 0;
+    for(int i = 0; i < cfg.workers; ++i)
+    {
+        if(pthread_create(&threads[i], NULL, tune_worker, NULL))
+            break;
+        ++started;
+    }
+    for(int i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+
+    if(started == 0)
+        fprintf(stderr, "Failed to start the tuning threads\n");
+    else if(quit)
+        fprintf(stderr, "Tuning interrupted\n");
+    else
+        ok = report(audio_secs);
+
+out:
+    free(threads);
+    free(trials);
+    trials = NULL;
+    free(sinebuf);
+    sinebuf = NULL;
+    free_corpus();
+    return ok;
+}
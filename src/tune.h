@@ -0,0 +1,18 @@
+#ifndef _TUNE_H_
+#define _TUNE_H_
+
+struct tunecfg {
+    const char *corpus;         // Directory of recordings, .wav or .raw
+    const char *profile_path;   // Where the best settings are written
+    bool forward;               // Channel to tune
+    int sample_rate;            // Of the .raw recordings
+    const char *frame_format;
+    int workers;                // Threads the trials are spread across
+};
+
+// Replay the corpus through a grid of settings, report the ones that are
+// Pareto-best on decoded frame rate and CPU time, and save the best as a
+// profile
+bool tune_run(const tunecfg& cfg);
+
+#endif
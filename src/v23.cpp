@@ -2,37 +2,74 @@
 #include <cstdlib>
 #include <cstdio>
 #include <cmath>
+#include <ctime>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <cstring>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <signal.h>
 
-#include "audioio_alsa.h"
+#include "audioio.h"
+#include "modem.h"
+#include "daemon.h"
+#include "tap.h"
+#include "recorder.h"
+#include "pipeline.h"
+#include "profile.h"
+#include "tune.h"
+#include "bench.h"
+#include "render.h"
+#include "outring.h"
+#include "logger.h"
+#include "bert.h"
+#include "blockq.h"
+#include "watchdog.h"
 
 #define DEF_SAMPLE_RATE 44100
-#define F_MARK_FREQ     1300
-#define F_SPACE_FREQ    2100
-#define B_MARK_FREQ     390
-#define B_SPACE_FREQ    450
-
-#define F_BIT_RATE      1200
-#define B_BIT_RATE      75
-
-#define SKEW_LIMIT          0.2
-#define SKEW_CORRECT_FACTOR 3
-
-#define ERROR_LIMIT         3
 
 #define DEF_FRAME_FORMAT    "10dddddddp1"
 
 #define DEF_AUDIO_DEVICE    NULL
 #define DEF_AUDIO_LATENCY   100
 
+#define DEF_LEADER          1000    // ms
+
+#define MONITOR_DEPTH       256     // Blocks the monitor can fall behind by
+#define DEF_BLOCK           1024    // Samples taken at once
+#define PIPELINE_DEPTH      4       // Blocks each pipeline stage can fall behind by
+#define TXBANK_MIN_SAMPLES  256     // Per line, for each write of the transmitter bank
+
+#define DEF_BENCH_CHARS     50
+
+#define DEF_PROFILE         "v23.profile"  // Written by the tuner
+
+#define DEF_SOCKET_PATH     "/tmp/v23.sock"
+#define DEF_MAX_SESSIONS    256
+
+#define OUTRING_RECORDS     65536   // Frames the structured output holds
+
+#define MAX_FRAMINGS        8       // Frame formats that can be tried at once
+#define FRAMING_MIN_FRAMES  16      // Good frames before a format can be picked
+#define FRAMING_MARGIN      4       // Score the best has to be ahead by
+#define FRAMING_HELD        256     // Characters kept while the formats are tried
+
+#define DIRECT_SLOT         64      // Bytes in each block the audio callback hands over
+#define DIRECT_SLOTS        256     // Blocks it can get ahead of the main thread by
+#define DIRECT_POLL_MS      100     // Main thread's sleep while the callback runs the modem
+
 int quiet=0;
 int debug=0;
 int monit=0;
 
-bool quit=false;
+volatile bool quit=false;
+bool audio_failed=false;
+
+static volatile sig_atomic_t reload_requested = 0;
+static volatile sig_atomic_t save_requested = 0;
 
 void sig_handler(int s){
     fprintf(stderr, "Caught signal %d\n",s);
@@ -40,808 +77,1462 @@ void sig_handler(int s){
     {
         case SIGINT:
             quit=true;
+            audioio_abort();
+            break;
+        case SIGUSR1:
+            recorder_trigger();
+            break;
+        case SIGHUP:
+            reload_requested = 1;
+            break;
+        case SIGUSR2:
+            save_requested = 1;
             break;
     }
 }
 
-struct maf {
-  int16_t *buf;
-  size_t N;
-  size_t p;
-  int32_t sum;
-};
+void output_buf(int16_t *samples_i, size_t n_samples)
+{
+    size_t posn=0;
+    size_t left=n_samples;
+    size_t n;
 
-struct differentiator {
-  int16_t last;
-};
+    // Loop until it's all gone - or the device is given up on
+    if(audio_failed)
+        return;
+    LOG(4, "Output %ld samples...\n", n_samples);
 
-struct osc {
-  int freqhz;
-  int p;
-};
+    while(left > 0)
+    {
+        n = audioio_putsamples(&samples_i[posn], left);
+        posn += n;
+        left -= n;
 
-struct framefmt {
-    int frame_size;         // Overall size of a frame
-    int32_t frame_pattern;  // Pattern to look for, including previous idle / stop bit
-    int32_t frame_mask;     // Mask to apply before checking for pattern
-    int32_t parity_mask;    // Mask to apply to find parity bit
-    bool parity_enable;     // Check parity at all ?
-    bool parity_even;       // Set to use even rather than odd parity
-    int data_offset;        // Number of bits after data
-    int data_mask;          // Mark to apply to get data bits
-    int data_size;          // Total number of data bits
-    bool lsb_first;         // Does lsb come first or last (endianism)
-};
+        LOG(4, "  Wrote %ld (%ld left)\n",n,left);
 
-struct modemcfg {
-    int sample_rate;
-    int first_null;
-    int mark_freqhz;
-    int space_freqhz;
-    framefmt ff;
-    int samples_per_bit;
-    int max_skew;
-    char errchar;
-};
+        if(n == 0)
+        {
+            audio_failed = true;
+            quit = true;
+            return;
+        }
+    }
+}
 
-int16_t *sinebuf;
-size_t sinelen;
+// Points *buf at the samples, which may be straight out of the audio device
+// rather than in the buffer passed in.  Hand them back with audioio_capture_end.
+// Returns 0 if the input has failed or ended, once the caller should wind up.
+size_t get_input_samples(int16_t **buf, size_t n) {
 
-int16_t* make_buffer(size_t N)
-{
-  return (int16_t*)calloc(N, sizeof(int16_t));
-}
+    size_t n_read = audioio_capture_begin(buf, n);
+    if(n_read == 0 && !audioio_ended()) audio_failed = true;
 
-bool sin_init(float amplitude, size_t N)
-{
-  sinebuf = make_buffer(N);
-  if(!sinebuf) return false;
+    return n_read;
+}
 
-  sinelen = N;
+// Characters from the audio callback on their way to the main thread, which
+// writes them out.  The block being filled is only handed over at the end of
+// each callback, or when it's full.
+struct outq {
+    blockq *q;
+    char *slot;                 // Being filled, NULL for none yet
+    size_t len;
+    unsigned long dropped;      // Characters the main thread fell too far behind for
+};
 
-  for(size_t i=0; i<N; ++i)
-  {
-    double x = 2.0 * M_PI * (double)i / (double)N;
-    sinebuf[i] = (int16_t)(amplitude * sin(x));
-  }
+// Where a demodulator's output goes, and the tag that marks it as coming
+// from that direction or line when several are decoded at once
+struct chanout {
+    FILE* out;
+    int tag;                    // -1 for untagged
+    int line;                   // For the structured output
+    bert *tester;               // Checks the frames instead of output, if set
+    outq *queue;                // Characters go through this instead, if set
+};
 
-  return true;
+static void outq_put(outq& oq, char c)
+{
+    if(!oq.slot)
+    {
+        oq.slot = (char*)blockq_write_slot(oq.q);
+        oq.len = 0;
+        if(!oq.slot)
+        {
+            ++oq.dropped;
+            return;
+        }
+    }
+    oq.slot[oq.len++] = c;
+    if(oq.len == DIRECT_SLOT)
+    {
+        blockq_commit(oq.q, oq.len);
+        oq.slot = NULL;
+    }
 }
 
-void sin_get_samples(int& p, int freqhz, int16_t *samples_out, size_t n_samples)
+static void outq_flush(outq& oq)
 {
-  for(size_t i=0; i<n_samples; ++i)
-  {
-    samples_out[i] = sinebuf[p];
-
-    p += freqhz;
-    while(p >= sinelen) p -= sinelen;
-  }
+    if(oq.slot)
+    {
+        blockq_commit(oq.q, oq.len);
+        oq.slot = NULL;
+    }
 }
 
-void maf_process(maf& maf, int16_t *samples_in, int16_t *samples_out,
-  size_t n_samples, bool nodivide=false)
+// Main thread: write out whatever has arrived
+static void outq_drain(outq& oq, FILE *out)
 {
-  for(size_t i=0; i<n_samples; ++i)
-  {
-    maf.sum        -= maf.buf[maf.p];
-    maf.buf[maf.p] =  samples_in[i];
-    maf.sum        += maf.buf[maf.p];
-
-    if(nodivide)
+    size_t len;
+    char *p;
+    bool any = false;
+    while((p = (char*)blockq_read_slot(oq.q, &len)))
     {
-        if(maf.sum > 32767) samples_out[i]=32767;
-        else if(maf.sum < -32767) samples_out[i]=-32767;
-        else samples_out[i] = maf.sum;
+        fwrite(p, 1, len, out);
+        blockq_release(oq.q);
+        any = true;
     }
-    else
-        samples_out[i] = ( maf.sum + (int32_t)maf.N/2 ) / (int32_t)maf.N;
-
-    ++maf.p;
-    if(maf.p >= maf.N) maf.p -= maf.N;
-  }
+    if(any)
+        fflush(out);
 }
 
-void osc_get_samples(osc& o, int16_t *samples_out, size_t n_samples)
+static void put_char_file(void *ctx, char c)
 {
-    // Note: getting samples increments the phase variable
-    sin_get_samples(o.p, o.freqhz, samples_out, n_samples);
+    chanout* co = (chanout*)ctx;
+    if(co->tag >= 0)
+        fputc(co->tag, co->out);
+    fputc(c, co->out);
+    fflush(co->out);
 }
 
-void osc_get_complex_samples(osc& o, int16_t *i_samples_out, int16_t *q_samples_out,
-  size_t n_samples)
+static void put_char_queued(void *ctx, char c)
 {
-  int& q=o.p;                  // This is the Q phase variable (sine)
-  int  i=(o.p + sinelen / 4) % sinelen;    // The I phase variable is always a quarter wave ahead of Q (cosine)
-
-  // Note: getting samples increments the phase variable
-  sin_get_samples(i, o.freqhz, i_samples_out, n_samples);
-  sin_get_samples(q, o.freqhz, q_samples_out, n_samples);
+    chanout* co = (chanout*)ctx;
+    if(co->tag >= 0)
+        outq_put(*co->queue, co->tag);
+    outq_put(*co->queue, c);
 }
 
-bool maf_init(maf& maf, size_t N)
+static void frame_out(void *ctx, const frameinfo& fi)
 {
-  maf.buf = make_buffer(N);
-  if(!maf.buf) return false;
-
-  maf.N   = N;
-  maf.p   = 0;
-  maf.sum = 0;
-
-  return true;
+    chanout* co = (chanout*)ctx;
+    outring_put(fi.time, co->line, fi.c, fi.status, fi.avg_skew);
+    if(co->tester)
+        bert_rx(*co->tester, fi);
 }
 
-void mul_samples(int16_t *samples_a, int16_t *samples_b,
-  int16_t *samples_out, size_t n_samples)
+// A frame format being tried, and what it has decoded so far
+struct framing {
+    const char *format;
+    char held[FRAMING_HELD];
+    int n_held;
+    frameinfo frames[FRAMING_HELD]; // For the output ring, with -O
+    int n_frames;
+    unsigned long dropped;      // Characters there was no room to hold
+};
+
+// Once a format's hold fills up, one is picked straight after the block, so
+// only a block with more than FRAMING_HELD characters in it can drop any
+static void put_char_held(void *ctx, char c)
 {
-  for(size_t i=0; i<n_samples; ++i)
-  {
-    int32_t product = ((int32_t)samples_a[i] * (int32_t)samples_b[i]) / (int32_t)32768;
-    if(product >  32767)
-    {
-        fprintf(stderr, "mul: clipped\n");
-        product =  32767;
-    }
-    else if(product < -32767)
-    {
-        fprintf(stderr, "mul: clipped\n");
-        product = -32767;
-    }
-    samples_out[i] = (int16_t)product;
-  }
+    framing* fr = (framing*)ctx;
+    if(fr->n_held < FRAMING_HELD)
+        fr->held[fr->n_held++] = c;
+    else
+        ++fr->dropped;
 }
 
-//NB: Halves magnitude
-void sub_samples(int16_t *samples_a, int16_t *samples_b,
-  int16_t *samples_out, size_t n_samples)
+static void frame_held(void *ctx, const frameinfo& fi)
 {
-  for(size_t i=0; i<n_samples; ++i)
-  {
-    samples_out[i] = ( samples_a[i]/2 - samples_b[i]/2 );
-  }
+    framing* fr = (framing*)ctx;
+    if(fr->n_frames < FRAMING_HELD)
+        fr->frames[fr->n_frames++] = fi;
 }
 
-void deriv_samples(differentiator& d, int16_t *samples_in, int16_t *samples_out, size_t n_samples)
+static void carrier_stderr(void *ctx, bool on)
 {
-    int16_t last = d.last;
-    for(size_t i=0; i<n_samples; ++i)
-    {
-        samples_out[i] = samples_in[i] - last;
-        last = samples_in[i];
-    }
-    d.last = last;
+    chanout* co = (chanout*)ctx;
+    if(quiet) return;
+
+    if(co->tag >= 0)
+        fprintf(stderr, "Carrier %s (%s channel)\n", on ? "detected" : "lost",
+                co->tag == 'F' ? "forward" : "backward");
+    else
+        fprintf(stderr, "Carrier %s\n", on ? "detected" : "lost");
 }
 
-void sgn_samples(int16_t *samples_in, int16_t *samples_out, size_t n_samples)
+static void monitor_stdout(void *, int16_t *buffers[], size_t n_bufs, size_t n_samples)
 {
-  for(size_t i=0; i<n_samples; ++i)
-  {
-    samples_out[i] = ( samples_in[i] > 0 ) - ( samples_in[i] < 0 );
-  }
+    tap_put(buffers, n_bufs, n_samples);
 }
 
-void mag_complex_samples(int16_t *samples_i, int16_t *samples_q,
-  int16_t *samples_out, size_t n_samples)
+static void error_snapshot(void *)
 {
-  for(size_t i=0; i<n_samples; ++i)
-  {
-    // Fast vector magnitude calculation
-    // http://www.embedded.com/design/real-time-and-performance/4007218/Digital-Signal-Processing-Tricks--High-speed-vector-magnitude-approximation
-    int32_t x, y, max, min, mag;
-    x = samples_i[i];
-    y = samples_q[i];
-
-    x = (x < 0) ? -x : x;
-    y = (y < 0) ? -y : y;
-
-    max = (x > y) ? x : y;
-    min = (x < y) ? x : y;
+    recorder_snapshot("error limit");
+}
 
-    mag = ( 15 * (max + min / 2) ) / 16;
+// What the modem configuration is made from, so that it can be made again
+// when the profile is reloaded
+struct lineopts {
+    const char *frame_format;
+    char errchar;
+    bool forward;
+    int sample_rate;
+    int gate_level;
+    bool fast_acquire;
+    const char *profile_path;   // NULL for none
+};
 
-    if(mag >  32767)
-    {
-        fprintf(stderr, "mag: clipped\n");
-        samples_out[i] = 32767;
-    }
-    else
-        samples_out[i] = mag;
-  }
+// The profile has the last word, so that reloading it can change anything
+static void apply_profile(lineopts& lo, const profile& p)
+{
+    if(p.format[0])      lo.frame_format = p.format;
+    if(p.errchar >= 0)   lo.errchar = p.errchar;
+    if(p.channel >= 0)   lo.forward = p.channel;
 }
 
-void ang_complex_samples(int16_t *samples_i, int16_t *samples_q,
-  int16_t *samples_out, size_t n_samples)
+static bool make_modemcfg(modemcfg& m, bool fwd, const lineopts& lo, const profile& p)
 {
-    for(size_t i=0; i<n_samples; ++i)
+    if( !init_framefmt(m.ff, lo.frame_format, 1) )
     {
-        // Hacky inverse tangent approximation
-        // Taken from my Wheeliebot guidance code
-        int32_t x, y, abs_x, abs_y, angle;
-        x = samples_i[i];
-        y = samples_q[i];
+        fprintf(stderr, "Failed to initialize frame format\n");
+        return false;
+    }
 
-        if(x==0 && y==0)
-        {
-            samples_out[i] = 0;
-            continue;
-        }
+    init_channel(m, fwd, lo.sample_rate, &p.chan[fwd ? 1 : 0]);
 
-        // NOTE: Output phase units are 1/65536 revolution,
-        // i.e. output variable overflows once per cycle
-        abs_x = (x < 0) ? -x : x;
-        abs_y = (y < 0) ? -y : y;
+    m.errchar = lo.errchar;
+    m.gate_level = lo.gate_level;
+    m.fast_acquire = lo.fast_acquire;
+    return true;
+}
 
-        if(abs_x > abs_y)
-        {
-            angle = (8192 * y) / x;
-            if(x < 0) angle += 32768;
-        }
-        else
-        {
-            angle = 16384 - (8192 * x) / y;
-            if(y < 0) angle += 32768;
-        }
+// How the demodulator is run, beyond the modem configuration
+struct runopts {
+    size_t block;           // Maximum samples we can take at once
+    int record_secs;        // Flight recorder length, 0 for none
+    bool compress;          // Flight recorder in mu-law
+    bool pipeline;          // Demodulator stages on separate threads
+    const lineopts *lo;     // For reloading the profile
+    const char *state_path; // Demodulator state is kept here, NULL for none
+    bool outring;           // Frames go to the structured output too
+    int bert_order;         // PRBS to check the bit error rate on, 0 for none
+    const char **framings;  // Frame formats to try, if more than one
+    int n_framings;
+    float max_load;         // Real-time factor the watchdog sheds work at, 0 for no watchdog
+};
 
-        samples_out[i] = angle;
-    }
-}
+// Optional work the watchdog sheds under load, in this order
+enum { SHED_MONITOR, SHED_DEBUG, SHED_FRAMING, SHED_DISCRIMINATOR, SHED_STAGES };
 
-void output_buf(int16_t *samples_i, size_t n_samples)
+static const char *shed_names[SHED_STAGES] = {
+    "the monitor", "debugging output", "trying frame formats", "the full phase discriminator"
+};
+
+static unsigned shed_mask = 0;  // Stages shed
+static int shed_debug;          // Debug level before it was shed
+
+// Reread the profile, and make the configuration for each channel (forward
+// first if there are two).  The old configuration stays if there's a problem.
+static bool reload_modemcfg(modemcfg m[], int n_chans, const runopts& ro)
 {
-    size_t posn=0;
-    size_t left=n_samples;
-    size_t n;
+    static profile p;   // The new frame format may point into it
+    lineopts lo = *ro.lo;
 
-    // Loop until it's all gone - or an error occurs
-    if(debug > 3)
-        fprintf(stderr, "Output %ld samples...\n", n_samples);
+    if(!lo.profile_path)
+    {
+        fprintf(stderr, "No profile to reload - give one with -P\n");
+        return false;
+    }
 
-    while(left > 0)
+    profile_defaults(p);
+    if(!profile_load(p, lo.profile_path))
     {
-        n = audioio_alsa_putsamples(&samples_i[posn], left);
-        posn += n;
-        left -= n;
+        fprintf(stderr, "Keeping the current configuration\n");
+        return false;
+    }
+    apply_profile(lo, p);
 
-        if(debug > 3)
-            fprintf(stderr, "  Wrote %ld (%ld left)\n",n,left);
+    for(int c = 0; c < n_chans; ++c)
+        if(!make_modemcfg(m[c], (n_chans > 1) ? (c == 0) : lo.forward, lo, p))
+            return false;
 
-        if(n == 0) exit(1);
-    }
+    if(!quiet)
+        fprintf(stderr, "Reloaded %s\n", lo.profile_path);
+    return true;
 }
 
-void output_multi(int16_t *buffers[], size_t n_bufs, size_t n_samples)
+// The state of each demodulator, one after another
+static void save_state(const char *path, demod d[], int n_chans)
 {
-    int16_t outbuf[n_bufs];
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
 
-    for(size_t i=0; i<n_samples; ++i)
+    FILE *f = fopen(tmp, "wb");
+    if(!f)
     {
-        for(size_t j=0; j<n_bufs; ++j)
-        {
-            int16_t *b = buffers[j];
-            outbuf[j]=b[i];
-        }
-        write(1, outbuf, sizeof(int16_t) * n_bufs);
+        perror(tmp);
+        return;
     }
+
+    bool ok = true;
+    for(int c = 0; c < n_chans && ok; ++c)
+        ok = demod_save(d[c], f);
+
+    // Replace the old state in one go, so there's always a whole one
+    if(fclose(f) || !ok || rename(tmp, path))
+    {
+        perror(path);
+        unlink(tmp);
+    }
+    else if(!quiet)
+        fprintf(stderr, "Saved demodulator state to %s\n", path);
 }
 
-size_t get_input_samples(int16_t *buf, size_t n) {
+static void load_state(const char *path, demod d[], int n_chans)
+{
+    FILE *f = fopen(path, "rb");
+    if(!f)
+        return;     // Nothing saved yet
 
-    size_t n_read = audioio_alsa_getsamples(buf, n);
-    if(n_read == 0) exit(1);
+    bool ok = true;
+    for(int c = 0; c < n_chans && ok; ++c)
+        ok = demod_load(d[c], f);
+    fclose(f);
 
-    return n_read;
+    if(!quiet)
+        fprintf(stderr, ok ? "Restored demodulator state from %s\n"
+                           : "Not restoring demodulator state from %s\n", path);
 }
 
-// Parity of some data - returns true if an odd number of bits are set
-bool parity(unsigned int v){
-    // http://graphics.stanford.edu/~seander/bithacks.html#ParityWith64Bits
-    v ^= v >> 1;
-    v ^= v >> 2;
-    v = (v & 0x11111111U) * 0x11111111U;
-    return ((v >> 28) & 1 != 0);
+// Where a demodulator's output and events go
+static void hook_demod(demod& d, chanout& co, const runopts& ro, bool first)
+{
+    d.put_char = co.tester ? NULL : co.queue ? put_char_queued : put_char_file;
+    d.ctx = &co;
+    d.carrier_event = carrier_stderr;
+    if(ro.outring || co.tester)
+        d.frame_event = frame_out;
+    if(ro.record_secs > 0)
+        d.error_event = error_snapshot;
+
+    // The monitor has room for one demodulator's signals - the first
+    if(monit > 0 && first && !(shed_mask & (1u << SHED_MONITOR)))
+        d.monitor = monitor_stdout;
+    if(shed_mask & (1u << SHED_DISCRIMINATOR))
+        demod_cheap_discriminator(d, true);
 }
 
-// Note: Overlap of 1 allows checking for previous stop / idle bit
-bool init_framefmt(framefmt& ff, const char* fmt, int overlap)
+// Score the frame formats being tried, and once one is clearly ahead have the
+// demodulator carry on with it, and let out what it has decoded so far.  A
+// parity error counts heavily against a format.  Formats with the same score
+// decode the same frames - 7 data bits with parity and 8 without, say - so
+// the one that checks parity is taken, or else the one given first.  With
+// force, or once any format has held all it can, the best so far is taken
+// anyway.
+static bool pick_framing(demod& d, chanout& co, const runopts& ro, framing tries[], bool force)
 {
-    // Set up frame constants
-    ff.frame_pattern = 0;
-    ff.frame_mask    = 0;
-    ff.parity_mask   = 0;
-    ff.parity_enable = false;
-    ff.parity_even   = false;
-    ff.data_offset = 0;
-    ff.data_mask  = 0;
-    ff.data_size  = 0;
-    ff.frame_size = -overlap;
-    ff.lsb_first  = true;
-    for(size_t i=0; fmt[i] != '\0'; ++i)
-    {
-        char c = fmt[i];
-        ff.frame_mask    <<= 1;
-        ff.frame_pattern <<= 1;
-        ff.parity_mask   <<= 1;
-        ff.data_mask     <<= 1;
-        ++ff.data_offset;
-        ++ff.frame_size;
-
-        switch(c)
-        {
-            case '1':
-                ff.frame_mask    |= 1;
-                ff.frame_pattern |= 1;
-                break;
-            case '0':
-                ff.frame_mask    |= 1;
-                ff.frame_pattern |= 0;
-                break;
-            case 'd':
-            case 'D':
-                ff.data_mask   |= 1;
-                ff.data_offset = 0;
-                ++ff.data_size;
-                ff.lsb_first = (c == 'd');
-                break;
-            case 'p':
-            case 'P':
-                ff.parity_mask   |= 1;
-                ff.parity_enable = true;
-                ff.parity_even = (c == 'P');
-                break;
-            default:
-                fprintf(stderr, "Invalid frame format specifier in %s: %c\n", fmt, c);
+    long score[MAX_FRAMINGS];
+    int best = 0;
+    for(int k = 0; k < d.n_framers; ++k)
+    {
+        const demod& f = d.framers[k];
+        if(tries[k].n_held >= FRAMING_HELD || tries[k].n_frames >= FRAMING_HELD)
+            force = true;
+        score[k] = (long)(f.frames_ok + f.frames_held) - 4 * (long)f.frames_bad;
+        if(score[k] > score[best] ||
+           (score[k] == score[best] && f.m.ff.parity_enable && !d.framers[best].m.ff.parity_enable))
+            best = k;
+    }
+
+    if(!force)
+    {
+        const demod& f = d.framers[best];
+        if(f.frames_ok + f.frames_held < FRAMING_MIN_FRAMES)
+            return false;
+        for(int k = 0; k < d.n_framers; ++k)
+            if(score[k] != score[best] && score[k] > score[best] - FRAMING_MARGIN)
                 return false;
-        }
     }
 
+    if(debug > 0)
+        for(int k = 0; k < d.n_framers; ++k)
+            fprintf(stderr, "Frame format %s: %lu good, %lu bad, %lu held\n", tries[k].format,
+                    d.framers[k].frames_ok, d.framers[k].frames_bad, d.framers[k].frames_held);
+    if(!quiet)
+        fprintf(stderr, "Picked frame format %s\n", tries[best].format);
+
+    framing& fr = tries[best];
+    demod_adopt_framer(d, d.framers[best]);
+    hook_demod(d, co, ro, true);
+    for(int i = 0; i < fr.n_held; ++i)
+        put_char_file(&co, fr.held[i]);
+    for(int i = 0; i < fr.n_frames; ++i)
+        frame_out(&co, fr.frames[i]);
+    if(fr.dropped)
+        fprintf(stderr, "Lost %lu characters decoded while the formats were tried - more than %d in one block\n",
+                fr.dropped, FRAMING_HELD);
     return true;
 }
 
-// Note: This is a nasty function
-uint64_t bin_as_octal(uint32_t w)
+// Shed the next stage of optional work that there is to shed, or restore the
+// last one shed.  Returns the stage, or -1 if there was nothing to do.
+static int shed_work(demod d[], int n_chans, chanout co[], const runopts& ro, framing tries[], bool shed)
 {
-    uint64_t d=0;
-
-    for(int i=0; i<32; ++i)
+    if(shed)
     {
-        d <<= 3;
-        if(w & 0x80000000) ++d;
-        w <<= 1;
+        for(int s = 0; s < SHED_STAGES; ++s)
+        {
+            if(shed_mask & (1u << s))
+                continue;
+            switch(s)
+            {
+                case SHED_MONITOR:
+                    // A pipeline stage thread reads it, so only while there's none
+                    if(!d[0].monitor || ro.pipeline) continue;
+                    d[0].monitor = NULL;
+                    break;
+                case SHED_DEBUG:
+                    if(debug == 0) continue;
+                    shed_debug = debug;
+                    debug = 0;
+                    break;
+                case SHED_FRAMING:
+                    // There's no going back on this one
+                    if(d[0].n_framers == 0) continue;
+                    pick_framing(d[0], co[0], ro, tries, true);
+                    break;
+                case SHED_DISCRIMINATOR:
+                    for(int c = 0; c < n_chans; ++c)
+                        demod_cheap_discriminator(d[c], true);
+                    break;
+            }
+            shed_mask |= 1u << s;
+            return s;
+        }
+        return -1;
     }
 
-    return d;
+    for(int s = SHED_STAGES - 1; s >= 0; --s)
+    {
+        // A format, once picked, stays picked
+        if(!(shed_mask & (1u << s)) || s == SHED_FRAMING)
+            continue;
+        switch(s)
+        {
+            case SHED_MONITOR:
+                d[0].monitor = monitor_stdout;
+                break;
+            case SHED_DEBUG:
+                debug = shed_debug;
+                break;
+            case SHED_DISCRIMINATOR:
+                for(int c = 0; c < n_chans; ++c)
+                    demod_cheap_discriminator(d[c], false);
+                break;
+        }
+        shed_mask &= ~(1u << s);
+        return s;
+    }
+    return -1;
 }
 
-void init_modemcfg(modemcfg& m, int mark, int space, int firstnull, int samplerate, int baudrate, float skew_limit) {
-    m.sample_rate     = samplerate;
-    m.mark_freqhz     = mark;
-    m.space_freqhz    = space;
-    m.samples_per_bit = samplerate / baudrate;
-    m.max_skew        = (float)samplerate * skew_limit / (float)baudrate;
-    m.errchar         = 0;
-    m.first_null      = firstnull;
-}
+// The watchdog's verdict on the last window, acted on and reported
+static void watchdog_act(const watchdog& wd, int verdict, bool& exhausted,
+                         demod d[], int n_chans, chanout co[], const runopts& ro, framing tries[])
+{
+    int s = shed_work(d, n_chans, co, ro, tries, verdict > 0);
+    if(s < 0 && (verdict < 0 || exhausted))
+        return;
 
-void v23_demodulate(modemcfg& m) {
-    FILE* out = (monit > 0) ? stderr : stdout;    // Output chars to stderr if we're monitoring
-    framefmt& f = m.ff;
-    // Local oscillator
-    osc o;
-    o.p = 0;
-    differentiator diffAng;
-    diffAng.last = 0;
-
-    // Working registers
-    int16_t *bufIn;
-    int16_t *bufI, *bufQ;
-    int16_t *bufAng;
-    int16_t *bufWork, *bufOut, *bufSign, *bufTiming;
-
-    int errcount=0;
-    int errtimeout=0;
-    int32_t out_shift = -1; // Raw serial shift-register
-    int frame_hold = f.frame_size;    // How many bits to hold off for
-
-    // Quality monitoring
-    int num_transitions = 0;
-    int total_skew = 0;
-
-    maf mafI, mafQ, mafAng, mafOut, mafBit;
-    size_t N = 1024; // Maximum samples we can take at once
-
-    int bit_wait = m.samples_per_bit;  // Samples left until we read a bit
-
-    // Set up the oscillators, filters etc
-    o.freqhz = (m.mark_freqhz + m.space_freqhz) / 2;
-
-    // Place the first null for the input MAF
-    int input_maf_samples = m.sample_rate / m.first_null;
-    if(debug > 0)
+    char fill[64] = "";
+    if(wd.last_fill >= 0)
+        snprintf(fill, sizeof(fill), ", capture buffer %.0f%% full", wd.last_fill * 100);
+
+    if(s < 0)
+    {
+        fprintf(stderr, "Watchdog: load %.1f%% of real time%s - nothing left to shed\n", wd.load * 100, fill);
+        exhausted = true;
+    }
+    else
     {
-        fprintf(stderr, "LO centre freq: %d Hz\n", o.freqhz);
-        fprintf(stderr, "IQ MAF:         %d samples\n", input_maf_samples);
-        fprintf(stderr, "Null placed at: %d Hz\n", m.first_null);
+        fprintf(stderr, "Watchdog: load %.1f%% of real time%s - %s %s\n", wd.load * 100, fill,
+                (verdict > 0) ? "shedding" : "restoring", shed_names[s]);
+        if(verdict < 0)
+            exhausted = false;
     }
+}
 
-    if(! (
-        maf_init(mafI,  input_maf_samples)     &&
-        maf_init(mafQ,  input_maf_samples)     &&
-        maf_init(mafOut,    m.samples_per_bit) &&
-        maf_init(mafBit,    m.samples_per_bit) )) {
+// Demodulate one channel, or with n_chans == 2 both channels (forward
+// first) from the same input.  The demodulators run one after the other on
+// each input block, so they share the scratch buffers.
+void v23_demodulate(modemcfg m[], int n_chans, const runopts& ro) {
+    FILE* out = (monit > 0) ? stderr : stdout;    // Output chars to stderr if we're monitoring
 
-        fprintf(stderr, "Failed to initialize MAFs\n");
-        exit(1);
-    }
+    dspbufs bufs;
+    demod d[2];
+    chanout co[2];
+    size_t N = ro.block;
+    int record_secs = ro.record_secs;
 
-    bufIn     = make_buffer(N);
-    bufI      = make_buffer(N);
-    bufQ      = make_buffer(N);
-    bufAng    = make_buffer(N);
-    bufWork   = make_buffer(N);
-    bufOut    = make_buffer(N);
-    bufSign   = make_buffer(N);
-    bufTiming = make_buffer(N);
+    bert tester = {}, reported;     // Bit error rate, and as of the last report
+    uint64_t next_report = 0;       // Sample clock
+    if(ro.bert_order && !bert_init(tester, ro.bert_order, m[0]))
+        exit(1);
+    reported = tester;
 
-    if(!( bufIn && bufI && bufQ && bufAng && bufWork  && bufOut && bufSign && bufTiming))
+    int16_t *bufIn = make_buffer(N);
+    if(!( bufIn && dspbufs_init(bufs, N) ))
     {
         fprintf(stderr, "Failed to allocate buffers\n");
         exit(1);
     }
 
-    if(!quiet)
-        fprintf(stderr, "Initialized.  Processing samples.\n");
-
-    // Set the meaning of +ve / -ve phase change
-    // Note this will only change if the frequencies are adjusted
-    int phase_pos, phase_neg;
-    if(m.mark_freqhz > m.space_freqhz)
+    if(monit > 0 && !tap_start(1, 8, N, MONITOR_DEPTH))
     {
-        phase_pos = 0;
-        phase_neg = 1;
+        fprintf(stderr, "Failed to start the monitor\n");
+        exit(1);
     }
-    else    // v.23 frequencies are always like this...
+    if(record_secs > 0 && !recorder_start(m[0].sample_rate, record_secs, ro.compress))
     {
-        phase_pos = 1;
-        phase_neg = 0;
+        fprintf(stderr, "Failed to start the flight recorder\n");
+        exit(1);
     }
 
-    size_t n;       // Number of samples we have this time
-    int state=0;    // What was the last state
-    bool line_idle = true;  // Are we in idle mode?
-    while(!quit)
+    for(int c = 0; c < n_chans; ++c)
     {
-        n = get_input_samples(bufIn, N);
-        if(n == 0) break;
-
-        if(debug > 3)
-            fprintf(stderr, "Got %ld samples (buffer size: %ld)\n", n, N);
-
-        // Mix and filter the local oscillator
-        osc_get_complex_samples(o, bufI, bufQ, n);
-        mul_samples(bufIn, bufI, bufWork, n);
-        maf_process(mafI, bufWork, bufI, n);
-        mul_samples(bufIn, bufQ, bufWork, n);
-        maf_process(mafQ, bufWork, bufQ, n);
+        if(!demod_init(d[c], m[c], &bufs))
+            exit(1);
 
-        // Determine the phase, phase change, then filter it
-        ang_complex_samples(bufI, bufQ, bufAng, n);
-        deriv_samples(diffAng, bufAng, bufWork, n);
-        maf_process(mafOut, bufWork, bufOut, n);
+        co[c].out = out;
+        co[c].tag = (n_chans > 1) ? (c == 0 ? 'F' : 'B') : -1;
+        co[c].line = c;
+        co[c].tester = ro.bert_order ? &tester : NULL;
+        co[c].queue = NULL;
+        hook_demod(d[c], co[c], ro, c == 0);
+    }
 
-        // Sign sampling and filtering to inform timing
-        sgn_samples(bufOut, bufSign, n);
-        maf_process(mafBit, bufSign, bufTiming, n, true);
+    if(ro.state_path)
+        load_state(ro.state_path, d, n_chans);
 
-        if(monit > 0)
+    // Several frame formats: each frames the same bits, and nothing is let
+    // out until one is picked
+    demod framers[MAX_FRAMINGS];
+    framing tries[MAX_FRAMINGS];
+    if(ro.n_framings > 1)
+    {
+        for(int k = 0; k < ro.n_framings; ++k)
         {
-          int16_t *bufs[] = {bufIn, bufI, bufQ, bufAng, bufWork, bufOut, bufSign, bufTiming};
-          output_multi(bufs, 8, n);
+            modemcfg fm = m[0];
+            if(!init_framefmt(fm.ff, ro.framings[k], 1))
+            {
+                fprintf(stderr, "Failed to initialize frame format %s\n", ro.framings[k]);
+                exit(1);
+            }
+            demod_init_framer(framers[k], fm);
+            tries[k].format = ro.framings[k];
+            tries[k].n_held = 0;
+            tries[k].n_frames = 0;
+            tries[k].dropped = 0;
+            framers[k].put_char = put_char_held;
+            if(ro.outring)
+                framers[k].frame_event = frame_held;
+            framers[k].ctx = &tries[k];
         }
+        d[0].framers = framers;
+        d[0].n_framers = ro.n_framings;
+        d[0].put_char = NULL;
+        d[0].frame_event = NULL;
+    }
 
-        // Run through the output samples
-        int last;
-        for(size_t i=0; i<n; ++i)
-        {
-            last = state;
-            state = (bufTiming[i] > 0) ? 1 : 0;
-
-            // Edge detected in timing buffer - re-align
-            if(last != state) {
-                int adj;
+    if(ro.pipeline && !pipeline_start(d[0], N, PIPELINE_DEPTH))
+    {
+        fprintf(stderr, "Failed to start the pipeline\n");
+        exit(1);
+    }
 
-                // Which way?
-                if(bit_wait > (m.samples_per_bit / 2))
-                    // We are ahead (e.g. we just sampled)
-                    adj = m.samples_per_bit - bit_wait;
-                else
-                    // We are behind (e.g. we're about to sample)
-                    adj = -bit_wait;
+    if(!quiet)
+        fprintf(stderr, "Initialized.  Processing samples.\n");
 
-                if(debug > 2)
-                    fprintf(stderr, "Transition, skew: %d samples\n", adj);
+    modemcfg next_m[2];
+    bool rebuild = false;   // Waiting to change channel at the next frame boundary
 
-                // Don't count the first correction, and correct completely
-                if(line_idle)
-                    line_idle = false;
-                else
-                {
-                    total_skew += (adj >= 0) ? adj : -adj;
-                    ++num_transitions;
-
-                    // Figure out the adjustment to make
-                    // ALWAYS adjust in the correct direction
-                    // ALWAYS correct by at least one, unless the error is zero
-                    if(adj > 0) {
-                        adj /= SKEW_CORRECT_FACTOR;
-                        adj += 1;
-                    }
-                    else if(adj < 0) {
-                        adj /= SKEW_CORRECT_FACTOR;
-                        adj -= 1;
-                    }
-                }
-                if(debug > 2)
-                    fprintf(stderr, "Adjusting by %d samples\n", adj);
+    watchdog wd;
+    bool exhausted = false; // Nothing left for the watchdog to shed
+    if(ro.max_load > 0)
+        watchdog_init(wd, ro.max_load, m[0].sample_rate);
 
-                bit_wait += adj;
-            }
+    size_t n;       // Number of samples we have this time
+    while(!quit)
+    {
+        int16_t *in = bufIn;
+        n = get_input_samples(&in, N);
+        if(n == 0) break;
 
-            if(--bit_wait <= 0)
-            {
-                int outbit = (bufOut[i] > 0) ? phase_pos : phase_neg;
-                if(debug > 3)
-                    fprintf(stderr, "Read bit '%d'\n", outbit);
-                out_shift <<= 1;
-                out_shift += outbit;
-
-                // If the shift register is all ones or all zeros, the line is idle
-                if(!line_idle && out_shift == -1 || out_shift == 0)
-                {
-                    line_idle = true;
-                    if(debug > 1)
-                        fprintf(stderr, "Line idle (%04x)\n", out_shift);
-                }
+        timespec t0, t1;
+        if(ro.max_load > 0)
+            clock_gettime(CLOCK_MONOTONIC, &t0);
 
-                if(line_idle);  //Nothing
-                else if(--frame_hold > 0)                                  // Frame Hold-off
-                {
-                    if(debug > 2)
-                        fprintf(stderr, "Frame hold (%d left)\n", frame_hold);
-                }
-                else if((out_shift & f.frame_mask) == f.frame_pattern)    // Frame is valid
-                {
-                    int avg_skew = 0;   // We can't measure skew of a frame with no observed transitions
-                    if(num_transitions > 0) avg_skew = total_skew / num_transitions;
+        LOG(4, "Got %ld samples (buffer size: %ld)\n", n, N);
 
-                    // Set line idle as we don't want to rehandle this frame
-                    line_idle = true;
+        recorder_put(in, n);
+        if(ro.pipeline)
+            pipeline_put(in, n);
+        else
+            for(int c = 0; c < n_chans; ++c)
+                demod_process(d[c], in, n);
 
-                    // Check the quality
-                    if(avg_skew > m.max_skew)
-                    {
-                        if(debug > 1)
-                            fprintf(stderr, "Dropping frame with high skew of %d\n", avg_skew);
-                        ++errcount;
-                        errtimeout = 10*f.frame_size;
-                    }
-                    else
-                    {
-                        uint32_t frame_data = out_shift & ((1 << (f.frame_size+1)) - 1);
-                        if(debug > 1)
-                            fprintf(stderr, "Processing frame: %lo, skew %d\n",
-                                    bin_as_octal(frame_data), avg_skew);
+        audioio_capture_end(n);
 
-                        bool parity_bit = (frame_data & f.parity_mask) != 0;
-                        uint32_t data =   (frame_data & f.data_mask  ) >> f.data_offset;
-                        bool data_parity = parity(data);
+        if(ro.max_load > 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            uint64_t ns = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+            int verdict = watchdog_block(wd, n, ns, audioio_fill());
+            if(verdict)
+                watchdog_act(wd, verdict, exhausted, d, n_chans, co, ro, tries);
+        }
 
-                        if(debug > 1)
-                            fprintf(stderr, "Data: 0x%02x Parity: %c Data parity: %c\n", (int)data,
-                                parity_bit ? '1' : '0', data_parity ? '1' : '0'
-                            );
+        if(d[0].n_framers > 0)
+            pick_framing(d[0], co[0], ro, tries, false);
 
-                        // Check parity
-                        if(!f.parity_even) data_parity = !data_parity;
+        // Once a second of the line
+        if(ro.bert_order && d[0].clock >= next_report)
+        {
+            if(next_report > 0)
+                bert_report(stdout, tester, reported, (double)d[0].clock / m[0].sample_rate);
+            next_report = d[0].clock + m[0].sample_rate;
+        }
 
-                        // Parity check
-                        if(!f.parity_enable || (data_parity == parity_bit))
-                        {
-                            if(errcount > 0) --errcount;
-
-                            // All OK
-                            if(f.lsb_first)
-                            {
-                                // Assume we're working with no more than 8 data bits!
-                                data <<= (8 - f.data_size);
-
-                                // Reverse bits in byte (LSB is first transmitted)
-                                // http://graphics.stanford.edu/~seander/bithacks.html#ReverseByteWith64BitsDiv
-                                data = (data * 0x0202020202ULL & 0x010884422010ULL) % 1023;
-                            }
-
-                            data &= 0xff;
-
-                            if(errcount < ERROR_LIMIT)
-                            {
-
-                                if(debug > 1)
-                                    fprintf(stderr, "Got byte: 0x%02x\n", data);
-
-                                fprintf(out, "%c", (char)data );
-                                fflush(out);
-                            }
-                            else
-                            {
-                                if(debug > 1)
-                                    fprintf(stderr, "Dropping apparently valid frame due to errors\n");
-                            }
-                        }
-                        else
-                        {
-                            if(debug > 1)
-                                fprintf(stderr, "Dropping frame with bad parity\n");
-                            ++errcount;
-                            errtimeout = 10*f.frame_size;
-                            if(errcount < ERROR_LIMIT && m.errchar)
-                            {
-                                fprintf(out, "%c", m.errchar);
-                                fflush(out);
-                            }
-                        }
-                    }
-                }
-                else if(!line_idle)
+        if(reload_requested)
+        {
+            reload_requested = 0;
+            if(reload_modemcfg(next_m, n_chans, ro))
+                for(int c = 0; c < n_chans; ++c)
                 {
-                    if (debug > 2)
-                        fprintf(stderr, "Waiting for a valid frame\n");
+                    if(demod_same_filters(d[c].m, next_m[c]))
+                    {
+                        if(!demod_reconfigure(d[c], next_m[c]))
+                            fprintf(stderr, "The last reload hasn't taken effect yet - try again\n");
+                    }
+                    else if(n_chans > 1 || ro.pipeline || d[0].n_framers > 0)
+                        fprintf(stderr, "Error: can't change the channel or its filters with -cd or -p, or before a frame format is picked\n");
+                    else
+                        rebuild = true;
                 }
+        }
 
-                // If the line is in idle state, reset the skew and transition count
-                if(line_idle)
-                {
-                    out_shift &= (2 << f.frame_size) - 1;
-                    total_skew = 0;
-                    num_transitions = 0;
-                    frame_hold = f.frame_size - 1;
-                    if(errtimeout > 0) --errtimeout;
-                    else errcount=0;
-                }
+        // A new channel needs new filters, so start them afresh - but not
+        // in the middle of a frame
+        if(rebuild && d[0].line_idle)
+        {
+            rebuild = false;
+            uint64_t clock = d[0].clock;
+            demod_free(d[0]);
+            if(!demod_init(d[0], next_m[0], &bufs))
+                exit(1);
+            d[0].clock = clock;
+            hook_demod(d[0], co[0], ro, true);
+            if(!quiet)
+                fprintf(stderr, "Now demodulating the %s channel\n",
+                        next_m[0].mark_freqhz == F_MARK_FREQ ? "FORWARD" : "BACKWARD");
+        }
 
-                bit_wait += m.samples_per_bit;
-            }
+        if(save_requested && ro.state_path && !ro.pipeline)
+        {
+            save_requested = 0;
+            save_state(ro.state_path, d, n_chans);
         }
     }
 
+    if(ro.pipeline)
+        pipeline_stop();
+    if(d[0].n_framers > 0)
+        pick_framing(d[0], co[0], ro, tries, true);
+    if(ro.bert_order)
+        bert_report(stdout, tester, reported, (double)d[0].clock / m[0].sample_rate);
+    if(ro.state_path)
+        save_state(ro.state_path, d, n_chans);
+    tap_stop();
+    recorder_stop();
+
     free(bufIn);
-    free(bufI);
-    free(bufQ);
-    free(bufAng);
-    free(bufWork);
-    free(bufOut);
-    free(bufSign);
-    free(bufTiming);
-    free(mafI.buf);
-    free(mafQ.buf);
-    free(mafOut.buf);
-    free(mafBit.buf);
+    dspbufs_free(bufs);
+    for(int c = 0; c < n_chans; ++c)
+        demod_free(d[c]);
 }
 
-void v23_modulate(modemcfg& m) {
-    // Set non-blocking input (STDIN)
-    int flags = fcntl(0, F_GETFL, 0);
-    fcntl(0, F_SETFL, flags | O_NONBLOCK);
-
-    framefmt& f = m.ff;
-
-    osc o;
-    o.p = 0;
-    o.freqhz = m.mark_freqhz;
-
-    int32_t out_shift = -1;
-    int bits_in_buffer = 0;
-    int bit_wait = m.sample_rate;   // At least 1s leader tone
+// The demodulators as run from the capture callback, for -x
+struct directrx {
+    bool ready;             // Set once the rest is, until then samples are dropped
+    demod *d;
+    int n_chans;
+    size_t N;               // Most samples a demodulator takes at once
+    outq queue;
+};
+static directrx direct_rx;
 
-    bool line_idle = true;
+static void capture_direct(void *ctx, const int16_t *buf, size_t n)
+{
+    directrx* rx = (directrx*)ctx;
+    if(!__atomic_load_n(&rx->ready, __ATOMIC_ACQUIRE))
+        return;
+    logger_realtime();
 
-    size_t N = m.samples_per_bit;   // Number of samples to handle at once
+    // The demodulators only read the samples, so they're used where they are
+    for(size_t i = 0; i < n; i += rx->N)
+    {
+        size_t k = (n - i < rx->N) ? n - i : rx->N;
+        for(int c = 0; c < rx->n_chans; ++c)
+            demod_process(rx->d[c], (int16_t*)buf + i, k);
+    }
+    outq_flush(rx->queue);
+}
 
-    int16_t *bufOut;
-    bufOut = make_buffer(N);
-    if(!bufOut)
+// As v23_demodulate, but with the demodulators run on each period straight
+// from the capture callback, and the characters queued for this thread to
+// write out.  The handler has to be set up before the audio device is opened.
+void v23_demodulate_direct(modemcfg m[], int n_chans, const runopts& ro) {
+    FILE* out = stdout;
+
+    dspbufs bufs;
+    demod d[2];
+    chanout co[2];
+    directrx& rx = direct_rx;
+
+    rx.queue.q = blockq_create(DIRECT_SLOT, DIRECT_SLOTS);
+    rx.queue.slot = NULL;
+    rx.queue.dropped = 0;
+    if(!( rx.queue.q && dspbufs_init(bufs, ro.block) ))
     {
         fprintf(stderr, "Failed to allocate buffers\n");
         exit(1);
     }
 
-    while(!quit)
+    for(int c = 0; c < n_chans; ++c)
     {
-        // Time for another byte?
-        if( bits_in_buffer < 1 )
-        {
-            // Is there a byte available ?
-            unsigned char c_in;
-            if(read(0, &c_in, 1) > 0)
-            {
-                // Set up the frame
-                out_shift = f.frame_pattern;
+        if(!demod_init(d[c], m[c], &bufs))
+            exit(1);
 
-                // Truncate data if needed
-                uint32_t data = (int)c_in & (( 1 << f.data_size ) - 1);
+        co[c].out = out;
+        co[c].tag = (n_chans > 1) ? (c == 0 ? 'F' : 'B') : -1;
+        co[c].line = c;
+        co[c].tester = NULL;
+        co[c].queue = &rx.queue;
+        hook_demod(d[c], co[c], ro, c == 0);
+    }
 
-                // Work out parity
-                if( f.parity_enable && ( parity(data) == f.parity_even ) )
-                {
-                    // Set all parity bits if needed
-                    out_shift |= f.parity_mask;
-                }
+    if(ro.state_path)
+        load_state(ro.state_path, d, n_chans);
 
-                // Sort out the data order
-                if(f.lsb_first)
-                {
-                    // Assume we're working with no more than 8 data bits!
-                    data <<= (8 - f.data_size);
+    rx.d = d;
+    rx.n_chans = n_chans;
+    rx.N = ro.block;
+    __atomic_store_n(&rx.ready, true, __ATOMIC_RELEASE);
 
-                    // Reverse bits in byte (LSB is first transmitted)
-                    // http://graphics.stanford.edu/~seander/bithacks.html#ReverseByteWith64BitsDiv
-                    data = (data * 0x0202020202ULL & 0x010884422010ULL) % 1023;
-                }
+    if(!quiet)
+        fprintf(stderr, "Initialized.  Demodulating in the audio callback.\n");
 
-                // Manipulate the data bits into the right position
-                data <<= f.data_offset;
-                data &=  f.data_mask;  // Probably not necessary... just in case
+    modemcfg next_m[2];
+    while(!quit)
+    {
+        blockq_wait(rx.queue.q, DIRECT_POLL_MS);
+        outq_drain(rx.queue, out);
 
-                // Set the data bits
-                out_shift |= data;
+        if(!audioio_wait(0))
+        {
+            audio_failed = true;
+            break;
+        }
+
+        // Only the framing can change under the callback
+        if(reload_requested)
+        {
+            reload_requested = 0;
+            if(reload_modemcfg(next_m, n_chans, ro))
+                for(int c = 0; c < n_chans; ++c)
+                {
+                    if(!demod_same_filters(d[c].m, next_m[c]))
+                        fprintf(stderr, "Error: can't change the channel or its filters with -x\n");
+                    else if(!demod_reconfigure(d[c], next_m[c]))
+                        fprintf(stderr, "The last reload hasn't taken effect yet - try again\n");
+                }
+        }
+    }
 
-                bits_in_buffer = f.frame_size;
+    // Nothing is called back once the device is closed
+    audioio_stop();
+    __atomic_store_n(&rx.ready, false, __ATOMIC_RELEASE);
+    outq_drain(rx.queue, out);
+    if(rx.queue.dropped)
+        fprintf(stderr, "Dropped %lu characters the output couldn't keep up with\n", rx.queue.dropped);
+
+    if(ro.state_path)
+        save_state(ro.state_path, d, n_chans);
+
+    blockq_destroy(rx.queue.q);
+    dspbufs_free(bufs);
+    for(int c = 0; c < n_chans; ++c)
+        demod_free(d[c]);
+}
 
-                if(debug > 1)
-                    fprintf(stderr, "Frame for input 0x%02x: %lo\n", (int)c_in, bin_as_octal(out_shift));
+// Demodulate n_lines lines on the same channel, one per input channel, in
+// banks of BANK_LANES lines at a time
+void v23_demodulate_lines(modemcfg& m, int n_lines, const runopts& ro) {
+    int n_banks = (n_lines + BANK_LANES - 1) / BANK_LANES;
+    size_t N = ro.block; // Maximum samples per line we can take at once
+
+    int16_t *bufIn   = make_buffer(N * n_lines);
+    int16_t *bankIn  = make_buffer(N * BANK_LANES);
+    demodbank *banks = (demodbank*)calloc(n_banks, sizeof(demodbank));
+    chanout *co      = (chanout*)calloc(n_lines, sizeof(chanout));
+    if(!bufIn || !bankIn || !banks || !co)
+    {
+        fprintf(stderr, "Failed to allocate buffers\n");
+        exit(1);
+    }
+
+    for(int b = 0; b < n_banks; ++b)
+    {
+        int lanes = n_lines - b * BANK_LANES;
+        if(lanes > BANK_LANES) lanes = BANK_LANES;
+        if(!demodbank_init(banks[b], m, lanes, N))
+            exit(1);
+
+        for(int l = 0; l < lanes; ++l)
+        {
+            int line = b * BANK_LANES + l;
+            co[line].out = stdout;
+            co[line].tag = line;
+            co[line].line = line;
+            banks[b].lines[l].put_char = put_char_file;
+            banks[b].lines[l].ctx = &co[line];
+            if(ro.outring)
+                banks[b].lines[l].frame_event = frame_out;
+        }
+    }
 
-                // One last manipulation: shift the data to the top of the word
-                out_shift <<= (32 - f.frame_size);
+    if(!quiet)
+        fprintf(stderr, "Initialized.  Processing samples for %d lines.\n", n_lines);
+
+    size_t n;       // Number of samples we have this time, for all lines
+    while(!quit)
+    {
+        int16_t *in = bufIn;
+        n = get_input_samples(&in, N * n_lines);
+        if(n == 0) break;
+
+        size_t frames = n / n_lines;
+        for(int b = 0; b < n_banks; ++b)
+        {
+            // Gather this bank's lines, leaving any spare lanes silent
+            int first = b * BANK_LANES;
+            int lanes = banks[b].n_lines;
+            for(size_t t = 0; t < frames; ++t)
+                for(int l = 0; l < BANK_LANES; ++l)
+                    bankIn[t * BANK_LANES + l] = (l < lanes) ? in[t * n_lines + first + l] : 0;
+
+            demodbank_process(banks[b], bankIn, frames);
+        }
+
+        audioio_capture_end(n);
+
+        // The lines share their filters, so only the framing can change
+        modemcfg next_m;
+        if(reload_requested)
+        {
+            reload_requested = 0;
+            if(reload_modemcfg(&next_m, 1, ro))
+            {
+                if(!demod_same_filters(m, next_m))
+                    fprintf(stderr, "Error: can't change the channel or its filters with -n\n");
+                else
+                    for(int b = 0; b < n_banks; ++b)
+                        for(int l = 0; l < banks[b].n_lines; ++l)
+                            demod_reconfigure(banks[b].lines[l], next_m);
             }
         }
+    }
+
+    for(int b = 0; b < n_banks; ++b)
+        demodbank_free(banks[b]);
+    free(banks);
+    free(co);
+    free(bufIn);
+    free(bankIn);
+}
+
+// Modulate what comes in on STDIN, or with tx the bit error rate tester's
+// sequence, for as long as it runs
+void v23_modulate(modemcfg& m, bert *tx) {
+    // Set non-blocking input (STDIN)
+    int flags = fcntl(0, F_GETFL, 0);
+    fcntl(0, F_SETFL, flags | O_NONBLOCK);
+
+    // Frames come from the waveform cache where possible
+    wavecache wc;
+    bool cached = wavecache_init(wc, m);
 
-        if( bits_in_buffer > 0 )
+    mod md;
+    mod_init(md, m, cached ? &wc : NULL);
+
+    int leader = m.leader;          // Bits of leader tone left to send
+    int idle_bits = 0;              // Bits sent since the last frame
+    bool carrier = true;
+    bool eof = false;
+    int pending = -1;               // Byte that woke us up, held back for the leader
+
+    size_t N = m.samples_per_bit;   // Number of samples to handle at once
+
+    size_t frame_samples = m.ff.frame_size * m.samples_per_bit;
+
+    int16_t *bufOut, *bufFrame;
+    bufOut   = make_buffer(N);
+    bufFrame = make_buffer(frame_samples);
+    if(!bufOut || !bufFrame)
+    {
+        fprintf(stderr, "Failed to allocate buffers\n");
+        exit(1);
+    }
+
+    while(!quit)
+    {
+        if(!carrier)
         {
-            int i_out = 0;
-            // Get next bit
-            if(out_shift & 0x80000000) i_out = 1;
+            // Nothing more can arrive
+            if(eof) break;
 
-            if(debug > 2)
-                fprintf(stderr, "State '%d'\n", i_out);
+            // Sleep until there's something to send
+            pollfd pfd;
+            pfd.fd = 0;
+            pfd.events = POLLIN;
+            if(poll(&pfd, 1, -1) < 0)
+                continue;
 
-            if(i_out)
-                o.freqhz = m.mark_freqhz;
+            unsigned char c_in;
+            ssize_t r = read(0, &c_in, 1);
+            if(r == 0) break;
+            if(r < 0) continue;
+            pending = c_in;
+
+            if(!quiet)
+                fprintf(stderr, "Carrier on\n");
+            audioio_idle(false);
+            carrier = true;
+            leader = m.leader;
+            idle_bits = 0;
+        }
+
+        // Time for another byte?
+        if( md.bits_in_buffer < 1 && leader <= 0 && !eof )
+        {
+            // Is there a byte available ?
+            unsigned char c_in;
+            ssize_t r;
+            if(tx)
+            {
+                c_in = bert_tx(*tx);
+                r = 1;
+            }
+            else if(pending >= 0)
+            {
+                c_in = pending;
+                pending = -1;
+                r = 1;
+            }
             else
-                o.freqhz = m.space_freqhz;
+                r = read(0, &c_in, 1);
 
-            out_shift <<= 1;
-            --bits_in_buffer;
+            if(r > 0)
+            {
+                // Send the whole frame in one go
+                mod_get_frame_samples(md, c_in, bufFrame);
+                output_buf(bufFrame, frame_samples);
+                idle_bits = 0;
+                continue;
+            }
+            else if(r == 0)
+                eof = true;
+        }
+
+        if(leader > 0)
+            --leader;
+        else if( md.bits_in_buffer < 1 && m.idle_timeout > 0 &&
+                 ++idle_bits > m.trailer + m.idle_timeout )
+        {
+            // Drop the carrier - the audio device plays out what it has
+            if(!quiet)
+                fprintf(stderr, "Carrier off\n");
+            audioio_idle(true);
+            carrier = false;
+            continue;
         }
-        else
-            o.freqhz = m.mark_freqhz;   // Idle
 
         // Get the oscillator samples and dump them to stdout
-        osc_get_samples(o, bufOut, N);
+        mod_get_bit_samples(md, bufOut);
         output_buf(bufOut, N);
     }
 
+    // Finish the last frame and send the trailer before stopping
+    if(carrier)
+    {
+        while(md.bits_in_buffer > 0 || idle_bits++ < m.trailer)
+        {
+            mod_get_bit_samples(md, bufOut);
+            output_buf(bufOut, N);
+        }
+    }
+
     free(bufOut);
+    free(bufFrame);
+    if(cached)
+        wavecache_free(wc);
+};
+
+// One line of the transmitter bank: the same steps as v23_modulate, a bit
+// period at a time
+struct txline {
+    int fd;
+    blockq *inq;                // Input from another thread instead of fd, if set...
+    bool in_eof;                // ...which sets this once there's no more
+    mod md;
+    unsigned char inbuf[256];   // Read ahead from fd
+    size_t in_len, in_pos;
+    int leader;
+    int idle_bits;
+    bool carrier;
+    bool eof;
+    int pending;
+    int16_t *frame;             // Frame being sent
+    size_t frame_pos, frame_len;
 };
 
+// Open a line's input: a Unix socket is connected to, anything else opened.
+// FIFOs are opened for writing as well, so they never see end-of-file and
+// writers can come and go.
+static int open_line_input(const char *pattern, int line)
+{
+    sockaddr_un addr;
+    char path[sizeof(addr.sun_path)];
+    snprintf(path, sizeof(path), pattern, line);
+
+    struct stat st;
+    bool found = (stat(path, &st) == 0);
+    int fd;
+    if(found && S_ISSOCK(st.st_mode))
+    {
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path);
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(fd >= 0 && connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    else
+        fd = open(path, (found && S_ISFIFO(st.st_mode) ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+
+    if(fd < 0)
+        perror(path);
+    else
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+// Next byte of input, or -1 if there's none yet (or ever, with eof set)
+static int txline_read(txline& tl)
+{
+    if(tl.in_pos == tl.in_len)
+    {
+        ssize_t r;
+        if(tl.inq)
+        {
+            // The end counts once it's known nothing came before it
+            bool eof = __atomic_load_n(&tl.in_eof, __ATOMIC_ACQUIRE);
+            size_t len;
+            void *p = blockq_read_slot(tl.inq, &len);
+            if(p)
+            {
+                memcpy(tl.inbuf, p, len);
+                blockq_release(tl.inq);
+                r = len;
+            }
+            else
+                r = eof ? 0 : -1;
+        }
+        else
+            r = read(tl.fd, tl.inbuf, sizeof(tl.inbuf));
+        if(r == 0)
+            tl.eof = true;
+        if(r <= 0)
+            return -1;
+        tl.in_len = r;
+        tl.in_pos = 0;
+    }
+    return tl.inbuf[tl.in_pos++];
+}
+
+// Fill one bit period of a line's samples
+static void txline_step(txline& tl, const modemcfg& m, int16_t *out)
+{
+    size_t spb = m.samples_per_bit;
+
+    if(!tl.carrier)
+    {
+        int c = (tl.eof || quit) ? -1 : txline_read(tl);
+        if(c < 0)
+        {
+            memset(out, 0, spb * sizeof(int16_t));
+            return;
+        }
+        tl.pending = c;
+        tl.carrier = true;
+        tl.leader = m.leader;
+        tl.idle_bits = 0;
+    }
+
+    // Part way through a frame
+    if(tl.frame_pos < tl.frame_len)
+    {
+        memcpy(out, tl.frame + tl.frame_pos, spb * sizeof(int16_t));
+        tl.frame_pos += spb;
+        return;
+    }
+
+    if(tl.leader <= 0 && !tl.eof && !quit)
+    {
+        int c = tl.pending;
+        tl.pending = -1;
+        if(c < 0)
+            c = txline_read(tl);
+
+        if(c >= 0)
+        {
+            mod_get_frame_samples(tl.md, c, tl.frame);
+            memcpy(out, tl.frame, spb * sizeof(int16_t));
+            tl.frame_pos = spb;
+            tl.idle_bits = 0;
+            return;
+        }
+    }
+
+    if(tl.leader > 0 && !quit)
+        --tl.leader;
+    else if( m.idle_timeout > 0 && ++tl.idle_bits > m.trailer + m.idle_timeout )
+    {
+        tl.carrier = false;
+        memset(out, 0, spb * sizeof(int16_t));
+        return;
+    }
+    else if(quit)
+        ++tl.idle_bits;     // Counting down the trailer
+
+    mod_get_bit_samples(tl.md, out);
+}
+
+// Has a line finished sending, so that we can stop?
+static bool txline_done(const txline& tl, const modemcfg& m)
+{
+    if(!tl.carrier)
+        return tl.eof || quit;
+    return quit && tl.frame_pos >= tl.frame_len && tl.idle_bits >= m.trailer;
+}
+
+// The modulator as run from the playback callback, for -x: a line of the
+// transmitter bank, its input handed over from STDIN by the main thread
+struct directtx {
+    bool ready;             // Set once the rest is, until then it's silence
+    bool done;              // Set by the callback once the line has finished
+    const modemcfg *m;
+    txline tl;
+    int16_t *bit;           // The bit period being sent...
+    size_t bit_pos;         // ...and how much of it has gone
+};
+static directtx direct_tx;
+
+static size_t render_direct(void *ctx, int16_t *buf, size_t n)
+{
+    directtx* tx = (directtx*)ctx;
+    if(!__atomic_load_n(&tx->ready, __ATOMIC_ACQUIRE))
+        return 0;
+    logger_realtime();
+
+    size_t spb = tx->m->samples_per_bit;
+    size_t filled = 0;
+    while(filled < n)
+    {
+        if(tx->bit_pos == spb)
+        {
+            if(txline_done(tx->tl, *tx->m))
+            {
+                __atomic_store_n(&tx->done, true, __ATOMIC_RELEASE);
+                break;
+            }
+            txline_step(tx->tl, *tx->m, tx->bit);
+            tx->bit_pos = 0;
+        }
+        size_t k = spb - tx->bit_pos;
+        if(k > n - filled) k = n - filled;
+        memcpy(buf + filled, tx->bit + tx->bit_pos, k * sizeof(int16_t));
+        tx->bit_pos += k;
+        filled += k;
+    }
+    return filled;
+}
+
+// As v23_modulate, but with the samples made in the playback callback.  The
+// handler has to be set up before the audio device is opened.
+void v23_modulate_direct(modemcfg& m) {
+    wavecache wc;
+    bool cached = wavecache_init(wc, m);
+
+    size_t spb = m.samples_per_bit;
+    size_t frame_samples = m.ff.frame_size * spb;
+
+    directtx& tx = direct_tx;
+    txline& tl = tx.tl;
+    memset(&tl, 0, sizeof(tl));
+    tl.fd = 0;
+    tl.inq = blockq_create(sizeof(tl.inbuf), DIRECT_SLOTS);
+    tl.frame = make_buffer(frame_samples);
+    tl.frame_len = tl.frame_pos = frame_samples;
+    tx.bit = make_buffer(spb);
+    if(!tl.inq || !tl.frame || !tx.bit)
+    {
+        fprintf(stderr, "Failed to allocate buffers\n");
+        exit(1);
+    }
+
+    mod_init(tl.md, m, cached ? &wc : NULL);
+    tl.carrier = true;
+    tl.leader = m.leader;
+    tl.pending = -1;
+    tx.m = &m;
+    tx.bit_pos = spb;
+    tx.done = false;
+    __atomic_store_n(&tx.ready, true, __ATOMIC_RELEASE);
+
+    if(!quiet)
+        fprintf(stderr, "Initialized.  Modulating in the audio callback.\n");
+
+    bool eof = false;
+    bool carrier = true;
+    while(!__atomic_load_n(&tx.done, __ATOMIC_ACQUIRE))
+    {
+        // Read STDIN only when there's room to hand it over
+        void *slot = (eof || quit) ? NULL : blockq_write_slot(tl.inq);
+        pollfd pfd;
+        pfd.fd = 0;
+        pfd.events = POLLIN;
+        if(poll(&pfd, slot ? 1 : 0, DIRECT_POLL_MS) > 0)
+        {
+            ssize_t r = read(0, slot, sizeof(tl.inbuf));
+            if(r > 0)
+                blockq_commit(tl.inq, r);
+            else if(r == 0)
+            {
+                eof = true;
+                __atomic_store_n(&tl.in_eof, true, __ATOMIC_RELEASE);
+            }
+        }
+
+        bool on = __atomic_load_n(&tl.carrier, __ATOMIC_RELAXED);
+        if(on != carrier && !quiet)
+            fprintf(stderr, "Carrier %s\n", on ? "on" : "off");
+        carrier = on;
+
+        if(!audioio_wait(0))
+        {
+            audio_failed = true;
+            break;
+        }
+    }
+
+    // Let the end play out, and then nothing is called back
+    audioio_stop();
+    __atomic_store_n(&tx.ready, false, __ATOMIC_RELEASE);
+
+    blockq_destroy(tl.inq);
+    free(tl.frame);
+    free(tx.bit);
+    if(cached)
+        wavecache_free(wc);
+}
+
+// Modulate n_lines lines, one per output channel, each from its own input.
+// Every line shares the sine table and waveform cache, and all of them are
+// rendered into one interleaved buffer per period, for one audio stream.
+void v23_modulate_lines(modemcfg& m, int n_lines, const char *inputs) {
+    wavecache wc;
+    bool cached = wavecache_init(wc, m);
+
+    size_t spb = m.samples_per_bit;
+    size_t frame_samples = m.ff.frame_size * spb;
+    size_t bits = (TXBANK_MIN_SAMPLES + spb - 1) / spb;   // Bit periods per write
+    size_t N = bits * spb;
+
+    txline *lines = (txline*)calloc(n_lines, sizeof(txline));
+    int16_t *bufLine = make_buffer(spb);
+    int16_t *bufOut  = make_buffer(N * n_lines);
+    pollfd *pfds = (pollfd*)calloc(n_lines, sizeof(pollfd));
+    if(!lines || !bufLine || !bufOut || !pfds)
+    {
+        fprintf(stderr, "Failed to allocate buffers\n");
+        exit(1);
+    }
+
+    for(int l = 0; l < n_lines; ++l)
+    {
+        txline& tl = lines[l];
+        tl.fd = open_line_input(inputs, l);
+        tl.frame = make_buffer(frame_samples);
+        tl.frame_len = tl.frame_pos = frame_samples;
+        if(tl.fd < 0 || !tl.frame)
+            exit(1);
+
+        mod_init(tl.md, m, cached ? &wc : NULL);
+        tl.carrier = true;
+        tl.leader = m.leader;
+        tl.pending = -1;
+    }
+
+    if(!quiet)
+        fprintf(stderr, "Initialized.  Sending on %d lines.\n", n_lines);
+
+    bool idle = false;      // Every line has dropped its carrier
+    for(;;)
+    {
+        bool done = true, any_carrier = false;
+        for(int l = 0; l < n_lines; ++l)
+        {
+            done = done && txline_done(lines[l], m);
+            any_carrier = any_carrier || lines[l].carrier;
+        }
+        if(done) break;
+
+        if(!any_carrier)
+        {
+            // Sleep until any line has something to send
+            if(!idle)
+            {
+                if(!quiet)
+                    fprintf(stderr, "Carrier off on all lines\n");
+                audioio_idle(true);
+                idle = true;
+            }
+
+            int n_pfds = 0;
+            for(int l = 0; l < n_lines; ++l)
+                if(!lines[l].eof)
+                {
+                    pfds[n_pfds].fd = lines[l].fd;
+                    pfds[n_pfds].events = POLLIN;
+                    ++n_pfds;
+                }
+            poll(pfds, n_pfds, -1);
+        }
+
+        for(size_t b = 0; b < bits; ++b)
+            for(int l = 0; l < n_lines; ++l)
+            {
+                txline_step(lines[l], m, bufLine);
+
+                int16_t *out = bufOut + b * spb * n_lines + l;
+                for(size_t i = 0; i < spb; ++i)
+                    out[i * n_lines] = bufLine[i];
+            }
+
+        // Nothing turned up after all
+        bool carrier = false;
+        for(int l = 0; l < n_lines; ++l)
+            carrier = carrier || lines[l].carrier;
+        if(!carrier)
+            continue;
+
+        if(idle)
+        {
+            if(!quiet)
+                fprintf(stderr, "Carrier on\n");
+            audioio_idle(false);
+            idle = false;
+        }
+        output_buf(bufOut, N * n_lines);
+    }
+
+    for(int l = 0; l < n_lines; ++l)
+    {
+        close(lines[l].fd);
+        free(lines[l].frame);
+    }
+    free(lines);
+    free(bufLine);
+    free(bufOut);
+    free(pfds);
+    if(cached)
+        wavecache_free(wc);
+}
+
+// Convert a time to whole bit periods, rounding up
+static int ms_to_bits(const modemcfg& m, int ms)
+{
+    int samples = (int64_t)ms * m.sample_rate / 1000;
+    return (samples + m.samples_per_bit - 1) / m.samples_per_bit;
+}
+
 int main(int argc, char* argv[])
 {
     bool demodulate = true;     // By default, demodulate the backward channel.
+    bool serve = false;
+    bool tune = false;
+    bool bench = false;
+    bool render = false;        // Modulate a file to a file, unpaced
     bool forward = false;
+    bool dual = false;          // Decode both channels at once
+    bool fast_acquire = false;
+    bool direct = false;        // Run the modem in the audio callback
+    float max_load = 0;         // Percentage of real time to shed work at, 0 for no watchdog
     char errchar = 0;           // No output for errors
     const char *frame_format = DEF_FRAME_FORMAT;
+    const char *framings[MAX_FRAMINGS];
+    int n_framings = 0;
     const char *audio_device = DEF_AUDIO_DEVICE;
-    modemcfg modem;
+    modemcfg modems[2];
+    int n_chans = 1;
+    int n_lines = 1;            // Lines on separate input channels
     int sample_rate   = DEF_SAMPLE_RATE;
     int audio_latency = DEF_AUDIO_LATENCY;
     float amplitude = 32767.0;  // Full-scale
+    int gate_level = 0;         // No carrier detect
+    int leader_ms  = DEF_LEADER;
+    int trailer_ms = 0;
+    int idle_ms    = 0;         // Never drop the carrier
+    runopts ro;
+    ro.block       = DEF_BLOCK;
+    ro.record_secs = 0;         // No flight recorder
+    ro.compress    = false;
+    ro.pipeline    = false;
+    const char *profile_path = NULL;
+    const char *state_path = NULL;
+    const char *outring_name = NULL;
+    int bert_order = 0;         // Bit error rate test sequence, 0 for none
+    int log_rate = 0;           // Debug messages a second from each site, 0 for any number
+    const char *corpus = NULL;
+    const char *inputs = NULL;  // Where each line's characters come from
+    const char *output = NULL;  // Rendered audio
+    benchcfg bcfg;              // Lists of values for the benchmark
+    bcfg.rates     = "44100";
+    bcfg.latencies = "100";
+    bcfg.blocks    = "1024";
+    bcfg.chars     = DEF_BENCH_CHARS;
+    bool block_set = false;     // -N given, so it wins over the profile
+    profile prof;
+    profile_defaults(prof);
+    daemoncfg dcfg;
+    dcfg.sock_path    = DEF_SOCKET_PATH;
+    dcfg.workers      = sysconf(_SC_NPROCESSORS_ONLN);
+    dcfg.max_sessions = DEF_MAX_SESSIONS;
 
     // Process args
     for(int i=0; i<argc; ++i)
@@ -868,12 +1559,27 @@ int main(int argc, char* argv[])
                     }
                     break;
 
+                case 'G':   // Carrier detect level in dB
+                    {
+                        float dB=0.0;
+                        if(sscanf(&arg[2],"%f",&dB) < 1)
+                        {
+                            fprintf(stderr, "Error: -G requires a float e.g. -G40 for a -40dB FS carrier detect level\n");
+                            exit(1);
+                        }
+                        gate_level = 32767.0 / pow(10.0, dB / 20.0);
+                        if(gate_level < 1) gate_level = 1;
+                        fprintf(stderr, "Set carrier detect level to -%f (amplitude %d)\n", dB, gate_level);
+                    }
+                    break;
+
                 case 'c':   // Set channel
                     switch(arg[2]) {
-                        case 'f': forward = true; break;
-                        case 'b': forward = false; break;
+                        case 'f': forward = true;  dual = false; break;
+                        case 'b': forward = false; dual = false; break;
+                        case 'd': dual = true; break;
                         default:
-                            fprintf(stderr, "Error: use -cf for forward or -cb for backward channel\n");
+                            fprintf(stderr, "Error: use -cf for forward, -cb for backward or -cd for both channels\n");
                             exit(1);
                     }
                     break;
@@ -881,8 +1587,12 @@ int main(int argc, char* argv[])
                     switch(arg[2]) {
                         case 'm': demodulate = false; break;
                         case 'd': demodulate = true; break;
+                        case 's': serve = true; break;
+                        case 't': tune = true; break;
+                        case 'b': bench = true; break;
+                        case 'r': render = true; demodulate = false; break;
                         default:
-                            fprintf(stderr, "Error: use -mm to modulate or -md to demodulate\n");
+                            fprintf(stderr, "Error: use -mm to modulate, -md to demodulate, -ms to serve, -mt to tune, -mb to benchmark or -mr to render\n");
                             exit(1);
                     }
                     break;
@@ -894,13 +1604,20 @@ int main(int argc, char* argv[])
                     break;
                 case 'r':   // Sample Rate
                     sscanf(&arg[2],"%d",&sample_rate);
+                    bcfg.rates = &arg[2];
                     fprintf(stderr, "Set sample rate to %d\n", sample_rate);
                     break;
                 case 'e':   // Character to output for parity errors
                     errchar = arg[2];
                     break;
-                case 'f':   // Frame format specifier
-                    frame_format = &arg[2];
+                case 'f':   // Frame format specifier, several to try them all
+                    if(n_framings == MAX_FRAMINGS)
+                    {
+                        fprintf(stderr, "Error: no more than %d frame formats with -f\n", MAX_FRAMINGS);
+                        exit(1);
+                    }
+                    framings[n_framings++] = &arg[2];
+                    frame_format = framings[0];
                     break;
                 case 'M':   // Monitor mode
                     ++monit;
@@ -910,8 +1627,93 @@ int main(int argc, char* argv[])
                     break;
                 case 'L':   // Latency
                     sscanf(&arg[2],"%d",&audio_latency);
+                    bcfg.latencies = &arg[2];
                     fprintf(stderr, "Set latency to %d ms\n", audio_latency);
                     break;
+                case 'l':   // Leader tone
+                    sscanf(&arg[2],"%d",&leader_ms);
+                    break;
+                case 't':   // Trailer tone
+                    sscanf(&arg[2],"%d",&trailer_ms);
+                    break;
+                case 'I':   // Idle timeout before dropping the carrier
+                    sscanf(&arg[2],"%d",&idle_ms);
+                    break;
+                case 'n':   // Number of lines to demodulate
+                    sscanf(&arg[2],"%d",&n_lines);
+                    if(n_lines < 1 || n_lines > 255)
+                    {
+                        fprintf(stderr, "Error: -n needs between 1 and 255 lines\n");
+                        exit(1);
+                    }
+                    break;
+                case 'R':   // Flight recorder length
+                    sscanf(&arg[2],"%d",&ro.record_secs);
+                    break;
+                case 'z':   // Compress the flight recorder
+                    ro.compress = true;
+                    break;
+                case 'a':   // Fast acquisition of the start bit
+                    fast_acquire = true;
+                    break;
+                case 'p':   // Pipelined demodulator
+                    ro.pipeline = true;
+                    break;
+                case 'x':   // Minimum latency, the modem in the audio callback
+                    direct = true;
+                    break;
+                case 'w':   // Watchdog, shedding work over this much of real time
+                    if(sscanf(&arg[2],"%f",&max_load) < 1 || max_load <= 0)
+                    {
+                        fprintf(stderr, "Error: -w requires a percentage of real time e.g. -w80\n");
+                        exit(1);
+                    }
+                    break;
+                case 'N':   // Block size
+                    if(sscanf(&arg[2],"%zu",&ro.block) < 1 || ro.block < 1)
+                    {
+                        fprintf(stderr, "Error: -N requires a block size in samples e.g. -N256\n");
+                        exit(1);
+                    }
+                    block_set = true;
+                    bcfg.blocks = &arg[2];
+                    break;
+                case 'k':   // Characters to benchmark
+                    sscanf(&arg[2],"%d",&bcfg.chars);
+                    break;
+                case 'P':   // Profile to load, or for the tuner to write
+                    profile_path = &arg[2];
+                    break;
+                case 'S':   // Demodulator state to restore and save
+                    state_path = &arg[2];
+                    break;
+                case 'b':   // Bit error rate test, PRBS9 or PRBS15
+                    sscanf(&arg[2],"%d",&bert_order);
+                    break;
+                case 'y':   // Rate limit for debug messages
+                    sscanf(&arg[2],"%d",&log_rate);
+                    break;
+                case 'O':   // Structured output in shared memory
+                    outring_name = &arg[2];
+                    break;
+                case 'i':   // Input for each line
+                    inputs = &arg[2];
+                    break;
+                case 'o':   // Rendered output
+                    output = &arg[2];
+                    break;
+                case 'T':   // Recordings to tune on
+                    corpus = &arg[2];
+                    break;
+                case 'U':   // Socket to serve sessions on
+                    dcfg.sock_path = &arg[2];
+                    break;
+                case 'j':   // Worker threads for serving, tuning or rendering
+                    sscanf(&arg[2],"%d",&dcfg.workers);
+                    break;
+                case 's':   // Maximum concurrent sessions
+                    sscanf(&arg[2],"%d",&dcfg.max_sessions);
+                    break;
                 default:
                     fprintf(stderr, "Unknown flag: %c\n", arg[1]);
                     exit(1);
@@ -920,51 +1722,146 @@ int main(int argc, char* argv[])
         }
     }
 
-    // Demodulation expects the amplitude to be set to this!
-    if(demodulate) amplitude = 32767.0;
-
-    // Set up the audio device early - in case the sample rate is modified
-    if(!audioio_alsa_init(audio_device, sample_rate, audio_latency, demodulate ? 'r' : 'w'))
+    if(debug > 0 && !logger_start(log_rate))
     {
-        fprintf(stderr, "Failed to open the audio device\n");
+        fprintf(stderr, "Failed to start the debug log\n");
         exit(1);
     }
 
-    // Set up a the sine buffer
-    if(!sin_init(amplitude, sample_rate)) {
-        fprintf(stderr, "Failed to initialize sine buffer\n");
-        exit(1);
+    if(tune)
+    {
+        if(!corpus || dual)
+        {
+            fprintf(stderr, "Error: -mt needs a directory of recordings with -T, and one of -cf or -cb\n");
+            exit(1);
+        }
+
+        tunecfg tcfg;
+        tcfg.corpus       = corpus;
+        tcfg.profile_path = profile_path ? profile_path : DEF_PROFILE;
+        tcfg.forward      = forward;
+        tcfg.sample_rate  = sample_rate;
+        tcfg.frame_format = frame_format;
+        tcfg.workers      = dcfg.workers;
+        return tune_run(tcfg) ? 0 : 1;
     }
 
-    if( !init_framefmt(modem.ff, frame_format, 1) )
+    if(bench)
     {
-        fprintf(stderr, "Failed to initialize frame format\n");
-        exit(1);
+        if(dual)
+        {
+            fprintf(stderr, "Error: -mb works on one channel, -cf or -cb\n");
+            exit(1);
+        }
+        bcfg.device       = audio_device;
+        bcfg.forward      = forward;
+        bcfg.frame_format = frame_format;
+        return bench_run(bcfg) ? 0 : 1;
     }
 
-    if(forward) // Forward:  Place the first null in the middle of the backward channel
-        init_modemcfg(modem, F_MARK_FREQ, F_SPACE_FREQ, 1280, sample_rate, F_BIT_RATE, SKEW_LIMIT);
-    else        // Backward: Place the first null just outside the band
-        init_modemcfg(modem, B_MARK_FREQ, B_SPACE_FREQ, 60, sample_rate, B_BIT_RATE, SKEW_LIMIT);
-
-    modem.errchar = errchar;
+    if(profile_path)
+    {
+        if(!profile_load(prof, profile_path))
+            exit(1);
+        if(prof.block > 0 && !block_set)
+            ro.block = prof.block;
+        if(!quiet)
+            fprintf(stderr, "Loaded profile %s\n", profile_path);
+    }
 
-    if(!quiet)
+    lineopts lo;
+    lo.frame_format = frame_format;
+    lo.errchar      = errchar;
+    lo.forward      = forward;
+    lo.sample_rate  = sample_rate;
+    lo.gate_level   = gate_level;
+    lo.fast_acquire = fast_acquire;
+    lo.profile_path = profile_path;
+    apply_profile(lo, prof);
+    frame_format = lo.frame_format;
+    errchar      = lo.errchar;
+    forward      = lo.forward;
+
+    ro.lo = &lo;
+    ro.state_path = state_path;
+    ro.outring = (outring_name != NULL);
+    ro.bert_order = demodulate ? bert_order : 0;
+    ro.framings = framings;
+    ro.n_framings = n_framings;
+    ro.max_load = max_load / 100;
+
+    if(dual && (!demodulate || serve))
     {
-        framefmt& ff = modem.ff;
-        fprintf(stderr, "%s the %s channel\n",
-                demodulate ? "Demodulating" : "Modulating", forward ? "FORWARD" : "BACKWARD");
-        fprintf(stderr, "Mark frequency:  %d Hz\n", modem.mark_freqhz);
-        fprintf(stderr, "Space frequency: %d Hz\n", modem.space_freqhz);
-        fprintf(stderr, "Bit period:      %d samples\n", modem.samples_per_bit);
-        fprintf(stderr, "Max skew:        %d samples\n", modem.max_skew);
-        fprintf(stderr, "Frame size:      %d, format %s\n", ff.frame_size, frame_format);
-        fprintf(stderr, "Data size:       %d, %s first, with %s parity\n",
-                ff.data_size, ff.lsb_first ? "lsb":"msb",
-                ff.parity_enable ? (ff.parity_even ? "even" : "odd" ) : "no");
-        fprintf(stderr, "Sample rate:     %d Hz\n", sample_rate);
+        fprintf(stderr, "Error: -cd only works when demodulating\n");
+        exit(1);
+    }
+    if(ro.pipeline && (!demodulate || serve || dual || n_lines > 1 || monit || ro.record_secs || gate_level))
+    {
+        fprintf(stderr, "Error: -p only works when demodulating one channel, without -n, -M, -R or -G\n");
+        exit(1);
+    }
+    if(n_lines > 1 && (serve || dual || monit || ro.record_secs || gate_level))
+    {
+        fprintf(stderr, "Error: -n only works on one channel, without -M, -R or -G\n");
+        exit(1);
+    }
+    if(!demodulate && !serve && n_lines > 1 && !inputs)
+    {
+        fprintf(stderr, "Error: modulating with -n needs the inputs for the lines, e.g. -i/run/v23/line%%d\n");
+        exit(1);
+    }
+    if(render && (!inputs || !inputs[0] || !output || !output[0] || serve || dual || n_lines > 1 ||
+                  direct || bert_order))
+    {
+        fprintf(stderr, "Error: -mr needs a file to read with -i and one to write with -o, and works on one channel without -n, -x or -b\n");
+        exit(1);
+    }
+    if(output && !render)
+    {
+        fprintf(stderr, "Error: -o only works with -mr\n");
+        exit(1);
+    }
+    if(inputs && (demodulate || serve))
+    {
+        fprintf(stderr, "Error: -i only works when modulating\n");
+        exit(1);
+    }
+    if(state_path && (!demodulate || serve || n_lines > 1))
+    {
+        fprintf(stderr, "Error: -S only works when demodulating, without -n\n");
+        exit(1);
+    }
+    if(bert_order && (serve || dual || n_lines > 1 || inputs || ro.pipeline))
+    {
+        fprintf(stderr, "Error: -b works on one line and channel, without -n, -i or -p\n");
+        exit(1);
+    }
+    if(n_framings > 1 && (!demodulate || serve || dual || n_lines > 1 || ro.pipeline || bert_order))
+    {
+        fprintf(stderr, "Error: several -f only work when demodulating one line and channel, without -n, -p or -b\n");
+        exit(1);
+    }
+    if(direct && (serve || n_lines > 1 || inputs || ro.pipeline || monit || ro.record_secs ||
+                  gate_level || bert_order || n_framings > 1))
+    {
+        fprintf(stderr, "Error: -x only works on one line, without -n, -i, -p, -M, -R, -G, -b or several -f\n");
+        exit(1);
+    }
+    // With -p the work is done in the stage threads, where it isn't timed
+    if(max_load > 0 && (!demodulate || serve || n_lines > 1 || direct || ro.pipeline))
+    {
+        fprintf(stderr, "Error: -w only works when demodulating, without -n, -p or -x\n");
+        exit(1);
+    }
+    if(outring_name && (!demodulate || serve || !outring_name[0]))
+    {
+        fprintf(stderr, "Error: -O needs a name, and only works when demodulating\n");
+        exit(1);
     }
 
+    // Demodulation expects the amplitude to be set to this!
+    if(demodulate || serve) amplitude = 32767.0;
+
     struct sigaction sigIntHandler;
 
     sigIntHandler.sa_handler = sig_handler;
@@ -972,15 +1869,157 @@ int main(int argc, char* argv[])
     sigIntHandler.sa_flags = 0;
 
     sigaction(SIGINT, &sigIntHandler, NULL);
+    sigaction(SIGUSR1, &sigIntHandler, NULL);
+    sigaction(SIGHUP, &sigIntHandler, NULL);
+    sigaction(SIGUSR2, &sigIntHandler, NULL);
 
-    if(demodulate)
-        v23_demodulate(modem);
+    if(serve)
+    {
+        // No audio device: sessions bring their own samples
+        if(!sin_init(amplitude, sample_rate)) {
+            fprintf(stderr, "Failed to initialize sine buffer\n");
+            exit(1);
+        }
+
+        dcfg.sample_rate  = sample_rate;
+        dcfg.frame_format = frame_format;
+        dcfg.errchar      = errchar;
+        dcfg.gate_level   = gate_level;
+        dcfg.prof         = &prof;
+        bool ok = daemon_run(dcfg);
+
+        free(sinebuf);
+        return ok ? 0 : 1;
+    }
+
+    if(render)
+    {
+        // No audio device either: the samples go straight to the file
+        if(!sin_init(amplitude, sample_rate)) {
+            fprintf(stderr, "Failed to initialize sine buffer\n");
+            exit(1);
+        }
+
+        rendercfg rcfg;
+        rcfg.input   = inputs;
+        rcfg.output  = output;
+        rcfg.workers = dcfg.workers;
+        if(!make_modemcfg(rcfg.m, forward, lo, prof))
+            exit(1);
+        rcfg.m.leader  = ms_to_bits(rcfg.m, leader_ms);
+        rcfg.m.trailer = ms_to_bits(rcfg.m, trailer_ms);
+        bool ok = render_run(rcfg);
+
+        free(sinebuf);
+        return ok ? 0 : 1;
+    }
+
+    // The callback starts as soon as the device is open, and waits until the
+    // modem is ready
+    if(direct && demodulate)
+        audioio_set_handler(capture_direct, NULL, &direct_rx);
+    else if(direct)
+        audioio_set_handler(NULL, render_direct, &direct_tx);
+
+    // Set up the audio device early - in case the sample rate is modified
+    if(!audioio_init(audio_device, sample_rate, audio_latency, demodulate ? 'r' : 'w', n_lines))
+    {
+        fprintf(stderr, "Failed to open the audio device\n");
+        exit(1);
+    }
+
+    // Set up a the sine buffer
+    if(!sin_init(amplitude, sample_rate)) {
+        fprintf(stderr, "Failed to initialize sine buffer\n");
+        exit(1);
+    }
+
+    if(dual)
+        n_chans = 2;
+
+    for(int c = 0; c < n_chans; ++c)
+    {
+        modemcfg& modem = modems[c];
+        bool fwd = dual ? (c == 0) : forward;
+
+        if(!make_modemcfg(modem, fwd, lo, prof))
+            exit(1);
+
+        modem.leader = ms_to_bits(modem, leader_ms);
+        modem.trailer = ms_to_bits(modem, trailer_ms);
+        modem.idle_timeout = ms_to_bits(modem, idle_ms);
+
+        if(!quiet)
+        {
+            framefmt& ff = modem.ff;
+            fprintf(stderr, "%s the %s channel\n",
+                    demodulate ? "Demodulating" : "Modulating", fwd ? "FORWARD" : "BACKWARD");
+            fprintf(stderr, "Mark frequency:  %d Hz\n", modem.mark_freqhz);
+            fprintf(stderr, "Space frequency: %d Hz\n", modem.space_freqhz);
+            fprintf(stderr, "Bit period:      %d samples\n", modem.samples_per_bit);
+            fprintf(stderr, "Max skew:        %d samples\n", modem.max_skew);
+            fprintf(stderr, "Frame size:      %d, format %s\n", ff.frame_size, frame_format);
+            if(max_load > 0 && demodulate)
+                fprintf(stderr, "Watchdog:        sheds work over %g%% of real time\n", max_load);
+            if(n_framings > 1 && demodulate)
+            {
+                fprintf(stderr, "Trying formats: ");
+                for(int k = 0; k < n_framings; ++k)
+                    fprintf(stderr, " %s", framings[k]);
+                fprintf(stderr, "\n");
+            }
+            fprintf(stderr, "Data size:       %d, %s first, with %s parity\n",
+                    ff.data_size, ff.lsb_first ? "lsb":"msb",
+                    ff.parity_enable ? (ff.parity_even ? "even" : "odd" ) : "no");
+            fprintf(stderr, "Sample rate:     %d Hz\n", sample_rate);
+            if(n_lines > 1 && demodulate)
+                fprintf(stderr, "Lines:           %d, %d at a time\n", n_lines, BANK_LANES);
+            else if(inputs)
+                fprintf(stderr, "Lines:           %d, from %s\n", n_lines, inputs);
+            if(!demodulate)
+            {
+                fprintf(stderr, "Leader:          %d bits\n", modem.leader);
+                fprintf(stderr, "Trailer:         %d bits\n", modem.trailer);
+                if(modem.idle_timeout > 0)
+                    fprintf(stderr, "Carrier off:     after %d idle bits\n", modem.idle_timeout);
+            }
+        }
+    }
+
+    if(outring_name && !outring_open(outring_name, OUTRING_RECORDS, sample_rate))
+    {
+        fprintf(stderr, "Failed to open the structured output\n");
+        exit(1);
+    }
+
+    if(demodulate && n_lines > 1)
+        v23_demodulate_lines(modems[0], n_lines, ro);
+    else if(demodulate && direct)
+        v23_demodulate_direct(modems, n_chans, ro);
+    else if(demodulate)
+        v23_demodulate(modems, n_chans, ro);
+    else if(direct)
+        v23_modulate_direct(modems[0]);
+    else if(inputs)
+        v23_modulate_lines(modems[0], n_lines, inputs);
+    else if(bert_order)
+    {
+        bert tx;
+        if(!bert_init(tx, bert_order, modems[0]))
+            exit(1);
+        v23_modulate(modems[0], &tx);
+    }
     else
-        v23_modulate(modem);
+        v23_modulate(modems[0], NULL);
+
+    audioio_stop();
+    outring_close();
 
-    audioio_alsa_stop();
+    if(!quiet && (audioio_stats.xruns || audioio_stats.errors))
+        fprintf(stderr, "Audio recovery: %lu xruns, %lu errors, %lu re-opens, %lu frames of silence for lost capture\n",
+                audioio_stats.xruns, audioio_stats.errors, audioio_stats.reopens, audioio_stats.gap_frames);
 
     free(sinebuf);
 
-    return 0;
+    return audio_failed ? 1 : 0;
 }
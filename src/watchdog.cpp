@@ -0,0 +1,49 @@
+#include "watchdog.h"
+
+void watchdog_init(watchdog& w, float max_load, int sample_rate)
+{
+    w.max_load = max_load;
+    w.sample_rate = sample_rate;
+    w.busy_ns = 0;
+    w.samples = 0;
+    w.fill = -1;
+    w.calm = 0;
+    w.load = 0;
+    w.last_fill = -1;
+}
+
+int watchdog_block(watchdog& w, size_t samples, uint64_t ns, float fill)
+{
+    w.busy_ns += ns;
+    w.samples += samples;
+    if(fill > w.fill)
+        w.fill = fill;
+
+    if(w.samples * 1000 < (uint64_t)w.sample_rate * WATCHDOG_WINDOW_MS)
+        return 0;
+
+    // The window is over
+    w.load = (double)w.busy_ns * w.sample_rate / (w.samples * 1e9);
+    w.last_fill = w.fill;
+    w.busy_ns = 0;
+    w.samples = 0;
+    w.fill = -1;
+
+    if(w.load > w.max_load || w.last_fill > WATCHDOG_FILL)
+    {
+        w.calm = 0;
+        return 1;
+    }
+
+    if(w.load < w.max_load * WATCHDOG_RESTORE && w.last_fill < WATCHDOG_FILL / 2)
+    {
+        if(++w.calm >= WATCHDOG_CALM)
+        {
+            w.calm = 0;
+            return -1;
+        }
+    }
+    else
+        w.calm = 0;
+    return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef _WATCHDOG_H_
+#define _WATCHDOG_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#define WATCHDOG_WINDOW_MS  1000    // Audio the load is measured over
+#define WATCHDOG_FILL       0.5     // Capture buffer fill that means falling behind
+#define WATCHDOG_RESTORE    0.5     // Fraction of the load limit to restore work below...
+#define WATCHDOG_CALM       3       // ...for this many windows in a row
+
+// CPU headroom watchdog.  Each window of audio, it compares the time spent
+// processing it with the time it lasts - the real-time factor - and looks at
+// how full the capture buffer is.  Over the limit, or with the buffer filling
+// up, it asks for a stage of optional work to be shed; once there's plenty of
+// headroom again for a while, for the last one to be restored.
+struct watchdog {
+    float max_load;         // Real-time factor to shed work at
+    int sample_rate;
+    uint64_t busy_ns;       // Spent processing in this window
+    uint64_t samples;       // Of audio in it
+    float fill;             // Fullest the capture buffer has been in it, -1 if unknown
+    int calm;               // Windows in a row with headroom
+
+    // The last window, for reporting
+    float load, last_fill;
+};
+
+void watchdog_init(watchdog& w, float max_load, int sample_rate);
+
+// Time to process a block of samples, and the capture buffer fill after it.
+// Returns +1 to shed a stage, -1 to restore one, or 0 to carry on.
+int watchdog_block(watchdog& w, size_t samples, uint64_t ns, float fill);
+
+#endif
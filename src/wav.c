@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wav.h"
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+void wav_header(uint8_t hdr[WAV_HEADER_SIZE], int rate, int channels, uint32_t data_bytes)
+{
+    int block_align = channels * sizeof(int16_t);
+
+    memcpy(hdr, "RIFF", 4);
+    put_le32(hdr + 4, 36 + data_bytes);
+    memcpy(hdr + 8, "WAVE", 4);
+
+    memcpy(hdr + 12, "fmt ", 4);
+    put_le32(hdr + 16, 16);                     // Chunk size
+    put_le16(hdr + 20, 1);                      // PCM
+    put_le16(hdr + 22, channels);
+    put_le32(hdr + 24, rate);
+    put_le32(hdr + 28, rate * block_align);     // Byte rate
+    put_le16(hdr + 32, block_align);
+    put_le16(hdr + 34, 16);                     // Bits per sample
+
+    memcpy(hdr + 36, "data", 4);
+    put_le32(hdr + 40, data_bytes);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t get_le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+int16_t *wav_load(const char *path, int *rate, size_t *n_samples)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+
+    uint8_t hdr[12], chunk[8], fmt[16];
+    int channels = 0;
+    int16_t *samples = NULL;
+
+    if (fread(hdr, sizeof(hdr), 1, f) != 1 ||
+        memcmp(hdr, "RIFF", 4) || memcmp(hdr + 8, "WAVE", 4)) {
+        fprintf(stderr, "%s: not a WAV file\n", path);
+        goto out;
+    }
+
+    // Walk the chunks: we need "fmt " before "data", and skip anything else
+    while (fread(chunk, sizeof(chunk), 1, f) == 1) {
+        uint32_t size = get_le32(chunk + 4);
+
+        if (!memcmp(chunk, "fmt ", 4) && size >= sizeof(fmt)) {
+            if (fread(fmt, sizeof(fmt), 1, f) != 1)
+                break;
+            if (get_le16(fmt) != 1 || get_le16(fmt + 14) != 16) {
+                fprintf(stderr, "%s: only 16-bit PCM is supported\n", path);
+                goto out;
+            }
+            channels = get_le16(fmt + 2);
+            *rate = get_le32(fmt + 4);
+            size -= sizeof(fmt);
+        } else if (!memcmp(chunk, "data", 4) && channels > 0) {
+            size_t frames = size / (channels * sizeof(int16_t));
+            samples = malloc(frames * channels * sizeof(int16_t));
+            if (!samples) {
+                fprintf(stderr, "%s: out of memory\n", path);
+                goto out;
+            }
+            frames = fread(samples, channels * sizeof(int16_t), frames, f);
+
+            // Keep the first channel only
+            for (size_t i = 0; i < frames; ++i)
+                samples[i] = (int16_t)get_le16((uint8_t *)&samples[i * channels]);
+            *n_samples = frames;
+            goto out;
+        }
+
+        // Chunks are padded to an even length
+        if (fseek(f, size + (size & 1), SEEK_CUR))
+            break;
+    }
+    fprintf(stderr, "%s: no audio data found\n", path);
+
+out:
+    fclose(f);
+    return samples;
+}
@@ -0,0 +1,24 @@
+#ifndef _WAV_H_
+#define _WAV_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WAV_HEADER_SIZE 44
+
+// Fill in a header for 16-bit PCM, data_bytes long
+void wav_header(uint8_t hdr[WAV_HEADER_SIZE], int rate, int channels, uint32_t data_bytes);
+
+// Read a 16-bit PCM file into memory, keeping the first channel only.
+// Returns NULL after reporting the problem on stderr.
+int16_t *wav_load(const char *path, int *rate, size_t *n_samples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif